@@ -0,0 +1,357 @@
+/*
+ * DyIO library: asynchronous packets and background reader thread.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include "dyio.h"
+
+typedef struct {
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             stop;           /* Request to terminate */
+    int             running;        /* Thread is started */
+    int             receiving;      /* Some thread reads the link */
+    pthread_t       receiver;       /* ...and which one */
+} dyio_reader_t;
+
+/*
+ * Set a callback for asynchronous packets.
+ */
+void dyio_set_callback(dyio_t *d, int namespace, int ch,
+    dyio_callback_t *func, void *arg)
+{
+    dyio_handler_t *h;
+
+    if (namespace < 0 || namespace >= MAX_NAMESPACES ||
+        ch >= MAX_CHANNELS || (ch >= 0 && namespace != ID_BCS_IO)) {
+        fprintf(stderr, "dyio: cannot set callback for namespace %d, channel %d\n",
+            namespace, ch);
+        return;
+    }
+    h = (ch >= 0) ? &d->ch_handler[ch] : &d->ns_handler[namespace];
+
+    _dyio_lock(d);
+    h->func = func;
+    h->arg = arg;
+    _dyio_unlock(d);
+}
+
+/*
+ * Call the user function, with device unlocked.
+ */
+static void invoke(dyio_t *d, dyio_handler_t *h, dyio_event_t *ev)
+{
+    dyio_callback_t *func = h->func;
+    void *arg = h->arg;
+
+    _dyio_unlock(d);
+    func(d, ev, arg);
+    _dyio_lock(d);
+}
+
+/*
+ * Pass an asynchronous packet to user callbacks.
+ * Channel values come either as gchv (one channel)
+ * or as gacv (all channels).
+ */
+void _dyio_dispatch_async(dyio_t *d, int namespace, char *rpc,
+    unsigned char *data, int datalen)
+{
+    dyio_event_t ev;
+    dyio_handler_t *h;
+    unsigned char *p;
+    int c, num_channels;
+    unsigned long long usec = _dyio_usec();
+
+    ev.namespace = namespace;
+    memcpy(ev.rpc, rpc, sizeof(ev.rpc));
+    ev.ch = -1;
+    ev.value = 0;
+    ev.data = data;
+    ev.datalen = datalen;
+
+    if (namespace == ID_BCS_IO && memcmp(rpc, "gchv", 4) == 0 && datalen >= 5) {
+        /* Value of one channel. */
+        ev.ch = data[0];
+        ev.value = (data[1] << 24) | (data[2] << 16) | (data[3] << 8) | data[4];
+        _dyio_put_sample(d, ev.ch, ev.value, usec);
+        if (ev.ch < MAX_CHANNELS && d->ch_handler[ev.ch].func) {
+            invoke(d, &d->ch_handler[ev.ch], &ev);
+            return;
+        }
+    }
+    else if (namespace == ID_BCS_IO && memcmp(rpc, "gacv", 4) == 0 && datalen >= 1) {
+        /* Values of all channels. */
+        num_channels = data[0];
+        if (num_channels > MAX_CHANNELS)
+            num_channels = MAX_CHANNELS;
+        for (c=0; c<num_channels && 1 + c*4 + 4 <= datalen; c++) {
+            p = &data[1 + c*4];
+            ev.ch = c;
+            ev.value = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+            _dyio_put_sample(d, ev.ch, ev.value, usec);
+
+            h = &d->ch_handler[c];
+            if (h->func)
+                invoke(d, h, &ev);
+        }
+        ev.ch = -1;
+        ev.value = 0;
+    }
+
+    if (namespace < MAX_NAMESPACES && d->ns_handler[namespace].func) {
+        invoke(d, &d->ns_handler[namespace], &ev);
+        return;
+    }
+    if (d->debug)
+        printf("dyio: ignore async packet '%c%c%c%c'\n",
+            rpc[0], rpc[1], rpc[2], rpc[3]);
+}
+
+/*
+ * Sleep on the condition until woken, or until the deadline.
+ */
+static void wait_until(dyio_reader_t *r, unsigned long long deadline)
+{
+    struct timespec ts;
+
+    if (! deadline) {
+        pthread_cond_wait(&r->cond, &r->lock);
+        return;
+    }
+#if defined(__WIN32__) || defined(WIN32)
+    /* Convert to the real-time clock. */
+    unsigned long long now = _dyio_usec();
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (deadline > now)
+        deadline = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000 + deadline - now;
+    else
+        deadline = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+    ts.tv_sec = deadline / 1000000;
+    ts.tv_nsec = deadline % 1000000 * 1000;
+    pthread_cond_timedwait(&r->cond, &r->lock, &ts);
+}
+
+/*
+ * Receive a packet, with the device locked.
+ * The link is read by one thread at a time: the lock is released
+ * while reading, so others wait until the receiver is done.
+ * Nested calls from callbacks in the receiving thread read directly.
+ */
+static void receive(dyio_t *d, dyio_reader_t *r, unsigned long long deadline)
+{
+    if (r->receiving && ! pthread_equal(pthread_self(), r->receiver)) {
+        wait_until(r, deadline);
+        return;
+    }
+    if (r->receiving) {
+        _dyio_receive(d, deadline);
+        return;
+    }
+    r->receiving = 1;
+    r->receiver = pthread_self();
+    _dyio_receive(d, deadline);
+    r->receiving = 0;
+    pthread_cond_broadcast(&r->cond);
+}
+
+/*
+ * Background thread: receive packets until stopped.
+ */
+static void *reader_loop(void *arg)
+{
+    dyio_t *d = arg;
+    dyio_reader_t *r = d->reader;
+
+    _dyio_lock(d);
+    while (! __atomic_load_n(&r->stop, __ATOMIC_ACQUIRE) && ! d->broken)
+        receive(d, r, _dyio_usec() + d->timeout);
+    _dyio_unlock(d);
+    return 0;
+}
+
+/*
+ * Allocate the reader state, on first start.
+ */
+static dyio_reader_t *new_reader(dyio_t *d)
+{
+    dyio_reader_t *r;
+
+    r = calloc(1, sizeof(dyio_reader_t));
+    if (! r) {
+        fprintf(stderr, "dyio: Out of memory\n");
+        return 0;
+    }
+    pthread_mutex_init(&r->lock, 0);
+#if defined(__WIN32__) || defined(WIN32)
+    pthread_cond_init(&r->cond, 0);
+#else
+    /* Deadlines are measured on the monotonic clock. */
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&r->cond, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+    return r;
+}
+
+/*
+ * Start a background thread, receiving packets from the device.
+ * The reader state is kept after stop, so the device lock
+ * remains the same mutex until dyio_close().
+ */
+int dyio_start_reader(dyio_t *d)
+{
+    dyio_reader_t *r = d->reader;
+
+    if (_dyio_shared_running(d)) {
+        fprintf(stderr, "dyio: cannot start reader in thread-safe mode\n");
+        return -1;
+    }
+    if (! r) {
+        r = new_reader(d);
+        if (! r)
+            return -1;
+        d->reader = r;
+    }
+
+    /* Reader is visible to the new thread from the very start. */
+    pthread_mutex_lock(&r->lock);
+    if (r->running) {
+        pthread_mutex_unlock(&r->lock);
+        return 0;
+    }
+    __atomic_store_n(&r->stop, 0, __ATOMIC_RELEASE);
+    if (pthread_create(&r->thread, 0, reader_loop, d) != 0) {
+        fprintf(stderr, "dyio: cannot create reader thread\n");
+        pthread_mutex_unlock(&r->lock);
+        return -1;
+    }
+    __atomic_store_n(&r->running, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+
+/*
+ * Stop the background reader thread.
+ * It terminates after the current read, in one second at most.
+ * Threads waiting for replies switch to receiving by themselves.
+ */
+void dyio_stop_reader(dyio_t *d)
+{
+    dyio_reader_t *r = d->reader;
+
+    if (! r)
+        return;
+
+    pthread_mutex_lock(&r->lock);
+    if (! r->running) {
+        pthread_mutex_unlock(&r->lock);
+        return;
+    }
+    __atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    pthread_join(r->thread, 0);
+
+    pthread_mutex_lock(&r->lock);
+    __atomic_store_n(&r->running, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * Check whether the background reader is running.
+ */
+int _dyio_reader_running(dyio_t *d)
+{
+    dyio_reader_t *r = d->reader;
+
+    return r && __atomic_load_n(&r->running, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Stop the reader and deallocate its state.
+ * No other thread may use the device.
+ */
+void _dyio_close_reader(dyio_t *d)
+{
+    dyio_reader_t *r = d->reader;
+
+    if (! r)
+        return;
+    dyio_stop_reader(d);
+    d->reader = 0;
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
+
+/*
+ * Lock the device against the background reader.
+ */
+void _dyio_lock(dyio_t *d)
+{
+    dyio_reader_t *r = d->reader;
+
+    if (r)
+        pthread_mutex_lock(&r->lock);
+    else
+        _dyio_hold(d);
+}
+
+void _dyio_unlock(dyio_t *d)
+{
+    dyio_reader_t *r = d->reader;
+
+    if (r)
+        pthread_mutex_unlock(&r->lock);
+    else
+        _dyio_release(d);
+}
+
+/*
+ * Wait until some packet is received, with the device locked.
+ * Without the reader (or from a callback, running in the reader
+ * thread), receive the packet directly.
+ */
+void _dyio_wait(dyio_t *d, unsigned long long deadline)
+{
+    dyio_reader_t *r = d->reader;
+
+    if (! r) {
+        _dyio_receive(d, deadline ? deadline : _dyio_usec() + d->timeout);
+        return;
+    }
+    if (r->running && ! pthread_equal(pthread_self(), r->thread)) {
+        wait_until(r, deadline);
+        return;
+    }
+    receive(d, r, deadline ? deadline : _dyio_usec() + d->timeout);
+}
+
+/*
+ * Wake up all waiters.
+ */
+void _dyio_wakeup(dyio_t *d)
+{
+    dyio_reader_t *r = d->reader;
+
+    if (r)
+        pthread_cond_broadcast(&r->cond);
+}
@@ -0,0 +1,550 @@
+/*
+ * DyIO library: persistent cache of device descriptors.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "dyio.h"
+
+#define CACHE_MAGIC     "DYIOrpc1"  /* Signature and version of file format */
+#define CHAN_MAGIC      "DYIOchn1"  /* Same for channel capabilities */
+
+/*
+ * Get a name of cache file for the device.
+ * Directory is $DYIO_CACHE, or ~/.dyio by default.
+ * Return 0 when no location is available.
+ */
+static char *cache_path(dyio_t *d, const char *suffix, char *path, int size, int create)
+{
+    const char *dir = getenv("DYIO_CACHE");
+    char buf[1024];
+
+    if (! dir) {
+        const char *home = getenv("HOME");
+
+        if (! home)
+            return 0;
+        snprintf(buf, sizeof(buf), "%s/.dyio", home);
+        dir = buf;
+    }
+    if (create) {
+#if defined(__WIN32__) || defined(WIN32)
+        mkdir(dir);
+#else
+        mkdir(dir, 0755);
+#endif
+    }
+    snprintf(path, size, "%s/%02x%02x%02x%02x%02x%02x.%s", dir,
+        d->reply_mac[0], d->reply_mac[1], d->reply_mac[2],
+        d->reply_mac[3], d->reply_mac[4], d->reply_mac[5], suffix);
+    return path;
+}
+
+/*
+ * Create a temporary file for the cache: it replaces the cache file
+ * only when complete, see cache_commit().
+ * Return 0 on error.
+ */
+static FILE *cache_create(dyio_t *d, const char *suffix, char *path, char *tmp, int size)
+{
+    FILE *fd;
+
+    if (! cache_path(d, suffix, path, size, 1))
+        return 0;
+    if (snprintf(tmp, size, "%s.tmp", path) >= size)
+        return 0;
+    fd = fopen(tmp, "wb");
+    if (! fd && d->debug)
+        perror(tmp);
+    return fd;
+}
+
+/*
+ * Close the temporary file, and rename it to the cache file.
+ * A reader sees either the old file, or the complete new one.
+ */
+static void cache_commit(dyio_t *d, FILE *fd, const char *path, const char *tmp)
+{
+    int error = ferror(fd);
+
+    if (fclose(fd) != 0 || error) {
+        if (d->debug)
+            perror(tmp);
+        remove(tmp);
+        return;
+    }
+#if defined(__WIN32__) || defined(WIN32)
+    /* No atomic replace of existing file. */
+    remove(path);
+#endif
+    if (rename(tmp, path) != 0) {
+        if (d->debug)
+            perror(path);
+        remove(tmp);
+    }
+}
+
+/*
+ * Get firmware revision from the device.
+ * It is queried only once per connection.
+ * Return 0 when the device did not reply.
+ */
+static unsigned char *get_revision(dyio_t *d)
+{
+    int rev[6], i;
+
+    if (! d->rev_valid) {
+        if (dyio_rpc_get_revision(d, &rev[0], &rev[1], &rev[2],
+            &rev[3], &rev[4], &rev[5]) < 0) {
+            printf("dyio: cannot get firmware revision\n");
+            return 0;
+        }
+        for (i=0; i<6; i++)
+            d->rev[i] = rev[i];
+        d->rev_valid = 1;
+    }
+    return d->rev;
+}
+
+/*
+ * Query the table of namespaces and methods from the device.
+ * Requests are pipelined, about one round-trip per namespace.
+ * Return 0 on success, or -1 when the device did not reply.
+ */
+static int query_rpc_table(dyio_t *d, dyio_rpc_table_t *t)
+{
+    int tag[MAX_INFLIGHT], nm[MAX_NAMESPACES], ns, m, i, k, n;
+    int args[MAX_ARGS], resp[MAX_ARGS], query_type, resp_type, nargs, nresp;
+    int status = 0;
+    char rpc[5];
+    dyio_method_t *mt;
+
+    memset(t, 0, sizeof(*t));
+    memcpy(t->mac, d->reply_mac, sizeof(t->mac));
+    if (! get_revision(d))
+        return -1;
+    memcpy(t->rev, d->rev, sizeof(t->rev));
+    t->verified = 1;
+
+    /* Query the number of namespaces. */
+    if (dyio_rpc_get_num_namespaces(d, &t->num_spaces) < 0) {
+        printf("dyio: incorrect _nms reply: length %u bytes\n", d->reply_len);
+        return -1;
+    }
+    if (t->num_spaces > MAX_NAMESPACES)
+        t->num_spaces = MAX_NAMESPACES;
+
+    _dyio_hold(d);
+
+    /* Get names and number of methods of all namespaces. */
+    for (ns=0; ns<t->num_spaces; ns++) {
+        tag[2*ns] = dyio_pipe_get_namespace(d, MAX_INFLIGHT, ns);
+        tag[2*ns+1] = dyio_pipe_get_method(d, MAX_INFLIGHT, ns, 0);
+    }
+    for (ns=0; ns<t->num_spaces; ns++) {
+        /* Collect all replies, even after an error. */
+        if (dyio_wait_reply(d, tag[2*ns]) < 0 ||
+            dyio_decode_get_namespace(d, t->space_name[ns], 0) < 0) {
+            printf("dyio: incorrect _nms[%u] reply\n", ns);
+            status = -1;
+        }
+        if (dyio_wait_reply(d, tag[2*ns+1]) < 0 ||
+            dyio_decode_get_method(d, 0, 0, &nm[ns], 0) < 0) {
+            printf("dyio: incorrect _rpc[%u] reply\n", ns);
+            status = -1;
+        }
+    }
+    if (status < 0)
+        goto done;
+
+    /* Get RPC and arguments of every method, namespace by namespace. */
+    for (ns=0; ns<t->num_spaces; ns++) {
+        for (m=0; m<nm[ns]; m+=n) {
+            n = nm[ns] - m;
+            if (n > MAX_INFLIGHT/2)
+                n = MAX_INFLIGHT/2;
+            for (i=0; i<n; i++) {
+                tag[2*i] = dyio_pipe_get_method(d, MAX_INFLIGHT, ns, m + i);
+                tag[2*i+1] = dyio_pipe_get_method_args(d, MAX_INFLIGHT, ns, m + i);
+            }
+            for (i=0; i<n; i++) {
+                if (t->num_methods >= MAX_METHODS) {
+                    dyio_wait_reply(d, tag[2*i]);
+                    dyio_wait_reply(d, tag[2*i+1]);
+                    continue;
+                }
+                mt = &t->method[t->num_methods];
+
+                /* Get method name (RPC). */
+                if (dyio_wait_reply(d, tag[2*i]) < 0 ||
+                    dyio_decode_get_method(d, 0, 0, 0, rpc) < 0) {
+                    printf("dyio: incorrect _rpc[%u] reply\n", ns);
+                    dyio_wait_reply(d, tag[2*i+1]);
+                    status = -1;
+                    continue;
+                }
+                mt->ns = ns;
+                strncpy(mt->rpc, rpc, 4);
+
+                /* Get method args. */
+                if (dyio_wait_reply(d, tag[2*i+1]) < 0 ||
+                    dyio_decode_get_method_args(d, 0, 0, &query_type,
+                    &nargs, args, &resp_type, &nresp, resp) < 0) {
+                    printf("dyio: incorrect args[%u] reply\n", ns);
+                    status = -1;
+                    continue;
+                }
+                mt->query_type = query_type;
+                mt->resp_type = resp_type;
+                mt->nargs = nargs;
+                mt->nresp = nresp;
+                for (k=0; k<nargs; k++)
+                    mt->args[k] = args[k];
+                for (k=0; k<nresp; k++)
+                    mt->resp[k] = resp[k];
+                t->num_methods++;
+            }
+        }
+    }
+done:
+    _dyio_release(d);
+    return status;
+}
+
+/*
+ * Save the table to the cache file.
+ * File format: signature, MAC address, firmware revision,
+ * names of namespaces, and packed method descriptors.
+ */
+static void save_rpc_table(dyio_t *d, dyio_rpc_table_t *t)
+{
+    char path[1024], tmp[1024];
+    FILE *fd;
+    int i;
+    dyio_method_t *mt;
+
+    fd = cache_create(d, "rpc", path, tmp, sizeof(path));
+    if (! fd)
+        return;
+    fwrite(CACHE_MAGIC, 1, 8, fd);
+    fwrite(t->mac, 1, sizeof(t->mac), fd);
+    fwrite(t->rev, 1, sizeof(t->rev), fd);
+    putc(t->num_spaces, fd);
+    for (i=0; i<t->num_spaces; i++) {
+        putc(strlen(t->space_name[i]), fd);
+        fputs(t->space_name[i], fd);
+    }
+    putc(t->num_methods, fd);
+    for (i=0; i<t->num_methods; i++) {
+        mt = &t->method[i];
+        putc(mt->ns, fd);
+        fwrite(mt->rpc, 1, 4, fd);
+        putc(mt->query_type, fd);
+        putc(mt->nargs, fd);
+        fwrite(mt->args, 1, mt->nargs, fd);
+        putc(mt->resp_type, fd);
+        putc(mt->nresp, fd);
+        fwrite(mt->resp, 1, mt->nresp, fd);
+    }
+    cache_commit(d, fd, path, tmp);
+}
+
+/*
+ * Read a string of bytes, prefixed by length.
+ * Return -1 on error.
+ */
+static int read_counted(FILE *fd, void *buf, int maxlen)
+{
+    int len = getc(fd);
+
+    if (len < 0 || len > maxlen)
+        return -1;
+    if (len > 0 && fread(buf, 1, len, fd) != len)
+        return -1;
+    return len;
+}
+
+/*
+ * Load the table from the cache file.
+ * Return -1 when the file is missing or damaged.
+ */
+static int load_rpc_table(dyio_t *d, dyio_rpc_table_t *t)
+{
+    char path[1024], magic[8];
+    FILE *fd;
+    int i, n;
+    dyio_method_t *mt;
+
+    if (! cache_path(d, "rpc", path, sizeof(path), 0))
+        return -1;
+    fd = fopen(path, "rb");
+    if (! fd)
+        return -1;
+
+    memset(t, 0, sizeof(*t));
+    if (fread(magic, 1, 8, fd) != 8 || memcmp(magic, CACHE_MAGIC, 8) != 0 ||
+        fread(t->mac, 1, sizeof(t->mac), fd) != sizeof(t->mac) ||
+        memcmp(t->mac, d->reply_mac, sizeof(t->mac)) != 0 ||
+        fread(t->rev, 1, sizeof(t->rev), fd) != sizeof(t->rev))
+        goto bad;
+
+    t->num_spaces = getc(fd);
+    if (t->num_spaces < 0 || t->num_spaces > MAX_NAMESPACES)
+        goto bad;
+    for (i=0; i<t->num_spaces; i++) {
+        n = read_counted(fd, t->space_name[i], sizeof(t->space_name[i]) - 1);
+        if (n < 0)
+            goto bad;
+        t->space_name[i][n] = 0;
+    }
+
+    t->num_methods = getc(fd);
+    if (t->num_methods < 0 || t->num_methods > MAX_METHODS)
+        goto bad;
+    for (i=0; i<t->num_methods; i++) {
+        mt = &t->method[i];
+        mt->ns = getc(fd);
+        if (fread(mt->rpc, 1, 4, fd) != 4)
+            goto bad;
+        mt->query_type = getc(fd);
+        n = read_counted(fd, mt->args, MAX_ARGS);
+        if (n < 0)
+            goto bad;
+        mt->nargs = n;
+        mt->resp_type = getc(fd);
+        n = read_counted(fd, mt->resp, MAX_ARGS);
+        if (n < 0)
+            goto bad;
+        mt->nresp = n;
+    }
+    fclose(fd);
+    return 0;
+bad:
+    if (d->debug)
+        printf("dyio: ignore damaged cache file %s\n", path);
+    fclose(fd);
+    return -1;
+}
+
+/*
+ * Load channel capabilities from the cache file.
+ * File format: signature, MAC address, firmware revision,
+ * number of channels and a 32-bit mask of modes per channel.
+ */
+static void load_chan_modes(dyio_t *d)
+{
+    char path[1024], magic[8];
+    unsigned char mac[6], rev[6], buf[4];
+    unsigned long modes[MAX_CHANNELS];
+    FILE *fd;
+    int num_channels, c;
+
+    if (! cache_path(d, "chn", path, sizeof(path), 0))
+        return;
+    fd = fopen(path, "rb");
+    if (! fd)
+        return;
+
+    if (fread(magic, 1, 8, fd) != 8 || memcmp(magic, CHAN_MAGIC, 8) != 0 ||
+        fread(mac, 1, sizeof(mac), fd) != sizeof(mac) ||
+        memcmp(mac, d->reply_mac, sizeof(mac)) != 0 ||
+        fread(rev, 1, sizeof(rev), fd) != sizeof(rev))
+        goto bad;
+
+    num_channels = getc(fd);
+    if (num_channels <= 0 || num_channels > MAX_CHANNELS)
+        goto bad;
+    for (c=0; c<num_channels; c++) {
+        if (fread(buf, 1, 4, fd) != 4)
+            goto bad;
+        modes[c] = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+    }
+    fclose(fd);
+
+    /* Nothing is used until the revision is checked,
+     * see dyio_channel_supports(). */
+    memcpy(d->chan_modes, modes, num_channels * sizeof(modes[0]));
+    memcpy(d->chan_modes_rev, rev, sizeof(rev));
+    d->chan_modes_count = num_channels;
+    d->chan_modes_state = 1;
+    return;
+bad:
+    if (d->debug)
+        printf("dyio: ignore damaged cache file %s\n", path);
+    fclose(fd);
+}
+
+/*
+ * Save channel capabilities to the cache file.
+ */
+static void save_chan_modes(dyio_t *d)
+{
+    char path[1024], tmp[1024];
+    FILE *fd;
+    int c;
+
+    fd = cache_create(d, "chn", path, tmp, sizeof(path));
+    if (! fd)
+        return;
+    fwrite(CHAN_MAGIC, 1, 8, fd);
+    fwrite(d->reply_mac, 1, 6, fd);
+    fwrite(d->chan_modes_rev, 1, 6, fd);
+    putc(d->chan_modes_count, fd);
+    for (c=0; c<d->chan_modes_count; c++) {
+        putc(d->chan_modes[c] >> 24, fd);
+        putc(d->chan_modes[c] >> 16, fd);
+        putc(d->chan_modes[c] >> 8, fd);
+        putc(d->chan_modes[c], fd);
+    }
+    cache_commit(d, fd, path, tmp);
+}
+
+/*
+ * Query the list of modes for all channels.
+ * Requests are pipelined: about one round-trip.
+ * Return 0 on success, or an error code.
+ */
+static int query_chan_modes(dyio_t *d)
+{
+    int tag[MAX_CHANNELS], mode[MAX_MODES], num_channels, c, i, n, s;
+    int status = 0;
+
+    num_channels = dyio_num_channels(d);
+    if (num_channels < 0)
+        return num_channels;
+    _dyio_hold(d);
+    for (c=0; c<num_channels; c++)
+        tag[c] = dyio_pipe_get_channel_modes(d, num_channels, c);
+    for (c=0; c<num_channels; c++) {
+        s = dyio_wait_reply(d, tag[c]);
+        if (s == 0)
+            s = dyio_decode_get_channel_modes(d, &n, mode);
+        if (s < 0) {
+            if (status == 0)
+                status = s;
+            continue;
+        }
+        d->chan_modes[c] = 0;
+        for (i=0; i<n; i++) {
+            if (mode[i] < MAX_MODES)
+                d->chan_modes[c] |= 1UL << mode[i];
+        }
+    }
+    _dyio_release(d);
+    if (status < 0) {
+        printf("dyio: cannot query channel modes, status %d\n", status);
+        return status;
+    }
+    if (! get_revision(d))
+        return -1;
+    memcpy(d->chan_modes_rev, d->rev, 6);
+    d->chan_modes_count = num_channels;
+    d->chan_modes_state = 2;
+    return 0;
+}
+
+/*
+ * Check whether the channel supports the given mode.
+ * The matrix of channel capabilities is built on first use.
+ */
+int dyio_channel_supports(dyio_t *d, int ch, int mode)
+{
+    int status;
+
+    if (d->chan_modes_state == 1) {
+        /* Loaded from cache: check firmware revision. */
+        if (! get_revision(d))
+            return -1;
+        if (memcmp(d->rev, d->chan_modes_rev, 6) == 0) {
+            /* Same firmware: number of channels is known too. */
+            if (d->num_channels == 0)
+                d->num_channels = d->chan_modes_count;
+            d->chan_modes_state = 2;
+        } else {
+            if (d->debug)
+                printf("dyio: firmware changed, query channel modes again\n");
+            d->chan_modes_state = 0;
+        }
+    }
+    if (d->chan_modes_state == 0) {
+        status = query_chan_modes(d);
+        if (status < 0)
+            return status;
+        save_chan_modes(d);
+    }
+
+    if (mode == MODE_NO_CHANGE)
+        return 1;
+    if (ch < 0 || ch >= d->chan_modes_count || mode < 0 || mode >= MAX_MODES)
+        return 0;
+    return (d->chan_modes[ch] >> mode) & 1;
+}
+
+/*
+ * Load descriptors from the cache, without any bus traffic.
+ * They are verified later, on first use.
+ */
+void _dyio_load_cache(dyio_t *d)
+{
+    dyio_rpc_table_t *t;
+
+    load_chan_modes(d);
+
+    t = malloc(sizeof(*t));
+    if (! t)
+        return;
+    if (load_rpc_table(d, t) < 0) {
+        free(t);
+        return;
+    }
+    if (d->debug)
+        printf("dyio: loaded RPC table, firmware revision %u.%u.%u\n",
+            t->rev[0], t->rev[1], t->rev[2]);
+    t->verified = 0;
+    d->rpc_table = t;
+}
+
+/*
+ * Get the table of namespaces and methods.
+ */
+dyio_rpc_table_t *dyio_get_rpc_table(dyio_t *d)
+{
+    dyio_rpc_table_t *t = d->rpc_table;
+
+    if (t && ! t->verified) {
+        /* Loaded from cache: check firmware revision. */
+        if (! get_revision(d))
+            return 0;
+        if (memcmp(d->rev, t->rev, sizeof(t->rev)) == 0) {
+            t->verified = 1;
+            return t;
+        }
+        if (d->debug)
+            printf("dyio: firmware changed, query RPC table again\n");
+        free(t);
+        d->rpc_table = t = 0;
+    }
+    if (t)
+        return t;
+
+    t = malloc(sizeof(*t));
+    if (! t) {
+        fprintf(stderr, "dyio: Out of memory\n");
+        return 0;
+    }
+    if (query_rpc_table(d, t) < 0) {
+        printf("dyio: cannot query RPC table\n");
+        free(t);
+        return 0;
+    }
+    save_rpc_table(d, t);
+    d->rpc_table = t;
+    return t;
+}
@@ -12,52 +12,212 @@
 #include <stdint.h>
 #include "dyio.h"
 
+/*
+ * Update the shadow from a list of all channel modes (reply of
+ * gacm, schm or sacm). Values of channels with changed modes
+ * become unknown.
+ */
+static void shadow_set_modes(dyio_t *d, int num_channels, const int *mode)
+{
+    int c;
+
+    _dyio_lock(d);
+    if (d->shadow) {
+        for (c=0; c<num_channels; c++) {
+            if (d->shadow_mode[c] != mode[c]) {
+                d->shadow_mode[c] = mode[c];
+                d->shadow_known &= ~(1ULL << c);
+            }
+        }
+        d->shadow_modes_known = 1;
+    }
+    _dyio_unlock(d);
+}
+
+/*
+ * Update the shadow value of one channel.
+ */
+static void shadow_set_value(dyio_t *d, int ch, int value)
+{
+    if (ch < 0 || ch >= MAX_CHANNELS)
+        return;
+
+    _dyio_lock(d);
+    if (d->shadow) {
+        d->shadow_value[ch] = value;
+        d->shadow_known |= 1ULL << ch;
+    }
+    _dyio_unlock(d);
+}
+
+/*
+ * Forget values of channels in the mask: they change by themselves,
+ * during a timed transition.
+ */
+static void shadow_forget(dyio_t *d, unsigned long long mask)
+{
+    _dyio_lock(d);
+    d->shadow_known &= ~mask;
+    _dyio_unlock(d);
+}
+
+/*
+ * Check whether the output channel already has this value.
+ * Only modes, in which the device never changes the value
+ * by itself, are considered. The saved frame is counted.
+ */
+static int shadow_has_value(dyio_t *d, int ch, int value)
+{
+    int found = 0;
+
+    if (ch < 0 || ch >= MAX_CHANNELS)
+        return 0;
+
+    _dyio_lock(d);
+    if (d->shadow && (d->shadow_known & (1ULL << ch)) &&
+        d->shadow_value[ch] == value) {
+        switch (d->shadow_mode[ch]) {
+        case MODE_DO:
+        case MODE_ANALOG_OUT:
+        case MODE_PWM:
+        case MODE_SERVO:
+        case MODE_DC_MOTOR_VEL:
+        case MODE_DC_MOTOR_DIR:
+            found = 1;
+            d->frames_saved++;
+            break;
+        }
+    }
+    _dyio_unlock(d);
+    return found;
+}
+
+/*
+ * Check whether the channel already has this mode.
+ * The saved frame is counted.
+ */
+static int shadow_has_mode(dyio_t *d, int ch, int mode)
+{
+    int found;
+
+    _dyio_lock(d);
+    found = d->shadow && d->shadow_modes_known && d->shadow_mode[ch] == mode;
+    if (found)
+        d->frames_saved++;
+    _dyio_unlock(d);
+    return found;
+}
+
+/*
+ * Enable host-side shadow of channel modes and output values.
+ */
+int dyio_enable_shadow(dyio_t *d, int on)
+{
+    int mode[MAX_CHANNELS], value[MAX_CHANNELS], num_channels, status, c;
+
+    _dyio_lock(d);
+    d->shadow = 0;
+    d->shadow_known = 0;
+    d->shadow_modes_known = 0;
+    _dyio_unlock(d);
+    if (! on)
+        return 0;
+
+    /* Seed from the device. */
+    num_channels = dyio_get_all_modes(d, mode);
+    if (num_channels < 0)
+        return num_channels;
+    status = dyio_get_all_values(d, value);
+    if (status < 0)
+        return status;
+    _dyio_lock(d);
+    for (c=0; c<num_channels; c++) {
+        d->shadow_mode[c] = mode[c];
+        d->shadow_value[c] = value[c];
+        d->shadow_known |= 1ULL << c;
+    }
+    d->shadow_modes_known = 1;
+    d->shadow = 1;
+    _dyio_unlock(d);
+    return 0;
+}
+
 /*
  * Set channel mode.
  */
-void dyio_set_mode(dyio_t *d, int ch, int mode)
+int dyio_set_mode(dyio_t *d, int ch, int mode)
 {
-    uint8_t query[3];
+    int modes[MAX_CHANNELS], num_channels, status;
 
-    query[0] = ch;
-    query[1] = mode;
-    query[2] = 0;
-    dyio_call(d, PKT_POST, ID_BCS_SETMODE, "schm", query, 3);
-    if (d->reply_len < 1) {
-        printf("dyio-info: incorrect schm[%u] reply\n", ch);
-        exit(-1);
+    status = dyio_channel_supports(d, ch, mode);
+    if (status < 0)
+        return status;
+    if (! status) {
+        printf("dyio: channel %u does not support mode %u\n", ch, mode);
+        return -1;
     }
+    if (shadow_has_mode(d, ch, mode))
+        return 0;
+
+    status = dyio_rpc_set_mode(d, ch, mode, 0, &num_channels, modes);
+    if (status < 0) {
+        if (d->debug)
+            printf("dyio: schm[%u] failed, status %d\n", ch, status);
+        return status;
+    }
+    shadow_set_modes(d, num_channels, modes);
+    return 0;
 }
 
 /*
  * Set channel value.
  */
-void dyio_set_value(dyio_t *d, int ch, int value)
+int dyio_set_value(dyio_t *d, int ch, int value)
 {
-    dyio_set_value_msec(d, ch, value, 0);
+    return dyio_set_value_msec(d, ch, value, 0);
 }
 
 /*
  * Set channel value with additional timing parameter.
  */
-void dyio_set_value_msec(dyio_t *d, int ch, int value, int msec)
+int dyio_set_value_msec(dyio_t *d, int ch, int value, int msec)
 {
-    uint8_t query[9];
+    int reply_ch, status;
 
-    query[0] = ch;
-    query[1] = value >> 24;
-    query[2] = value >> 16;
-    query[3] = value >> 8;
-    query[4] = value;
-    query[5] = msec >> 24;
-    query[6] = msec >> 16;
-    query[7] = msec >> 8;
-    query[8] = msec;
-    dyio_call(d, PKT_POST, ID_BCS_IO, "schv", query, 9);
-    if (d->reply_len < 2) {
-        printf("dyio-info: incorrect schv[%u] reply\n", ch);
-        exit(-1);
+    /* A timed write restarts the transition: never skipped. */
+    if (msec == 0 && shadow_has_value(d, ch, value))
+        return 0;
+
+    status = dyio_rpc_set_value(d, ch, value, msec, &reply_ch, 0);
+    if (status < 0) {
+        if (d->debug)
+            printf("dyio: schv[%u] failed, status %d\n", ch, status);
+        return status;
     }
+    if (reply_ch != ch)
+        return 0;
+    if (msec == 0)
+        shadow_set_value(d, ch, value);
+    else if (ch >= 0 && ch < MAX_CHANNELS)
+        shadow_forget(d, 1ULL << ch);
+    return 0;
+}
+
+/*
+ * Read current channel value into *value.
+ */
+int dyio_read_value(dyio_t *d, int ch, int *value)
+{
+    int status;
+
+    status = dyio_rpc_get_value(d, ch, 0, value);
+    if (status < 0) {
+        if (d->debug)
+            printf("dyio: gchv[%u] failed, status %d\n", ch, status);
+        return status;
+    }
+    shadow_set_value(d, ch, *value);
+    return 0;
 }
 
 /*
@@ -65,16 +225,178 @@ void dyio_set_value_msec(dyio_t *d, int ch, int value, int msec)
  */
 int dyio_get_value(dyio_t *d, int ch)
 {
-    uint8_t query[1];
-    int value;
+    int value, status;
 
-    query[0] = ch;
-    dyio_call(d, PKT_GET, ID_BCS_IO, "gchv", query, 1);
-    if (d->reply_len < 5) {
-        printf("dyio-info: incorrect gchv[%u] reply\n", ch);
-        exit(-1);
-    }
-    value = (d->reply[1] << 24) | (d->reply[2] << 16) |
-            (d->reply[3] << 8) | d->reply[4];
+    status = dyio_read_value(d, ch, &value);
+    if (status < 0)
+        return status;
     return value;
 }
+
+/*
+ * Get current values of several channels.
+ * All requests are pipelined, so it costs about one round-trip.
+ * Every reply is collected, even after a failure.
+ */
+int dyio_get_values(dyio_t *d, int nchan, const int *chan, int *value)
+{
+    int tag[MAX_INFLIGHT], i, k, n, s, status = 0;
+
+    /* Requests go with the window as wide as needed. */
+    _dyio_hold(d);
+    for (i=0; i<nchan; i+=n) {
+        n = nchan - i;
+        if (n > MAX_INFLIGHT)
+            n = MAX_INFLIGHT;
+
+        for (k=0; k<n; k++)
+            tag[k] = dyio_pipe_get_value(d, n, chan[i+k]);
+        for (k=0; k<n; k++) {
+            s = dyio_wait_reply(d, tag[k]);
+            if (s == 0)
+                s = dyio_decode_get_value(d, 0, &value[i+k]);
+            if (s < 0 && status == 0) {
+                if (d->debug)
+                    printf("dyio: gchv[%u] failed, status %d\n", chan[i+k], s);
+                status = s;
+            }
+        }
+    }
+    _dyio_release(d);
+    return status;
+}
+
+/*
+ * Get number of i/o channels.
+ */
+int dyio_num_channels(dyio_t *d)
+{
+    int status;
+
+    if (d->num_channels > 0)
+        return d->num_channels;
+
+    status = dyio_rpc_get_num_channels(d, &d->num_channels);
+    if (status < 0) {
+        if (d->debug)
+            printf("dyio: gchc failed, status %d\n", status);
+        d->num_channels = 0;
+        return status;
+    }
+    if (d->num_channels < 0)
+        d->num_channels = 0;
+    if (d->num_channels > MAX_CHANNELS)
+        d->num_channels = MAX_CHANNELS;
+    return d->num_channels;
+}
+
+/*
+ * Get current values of all channels, in one request.
+ * Return number of channels.
+ */
+int dyio_get_all_values(dyio_t *d, int *value)
+{
+    int num_channels, status, c;
+
+    status = dyio_rpc_get_all_values(d, &num_channels, value);
+    if (status < 0) {
+        if (d->debug)
+            printf("dyio: gacv failed, status %d\n", status);
+        return status;
+    }
+    for (c=0; c<num_channels; c++)
+        shadow_set_value(d, c, value[c]);
+    return num_channels;
+}
+
+/*
+ * Set values of all channels, in one request.
+ */
+int dyio_set_all_values(dyio_t *d, int msec, const int *value)
+{
+    int num_channels = dyio_num_channels(d);
+    int reply_value[RPC_MAX_VALUES], n, c, status;
+
+    if (num_channels < 0)
+        return num_channels;
+    status = dyio_rpc_set_all_values(d, msec, num_channels, value, &n, reply_value);
+    if (status < 0) {
+        if (d->debug)
+            printf("dyio: sacv failed, status %d\n", status);
+        return status;
+    }
+
+    /* Reply has the new values of all channels.
+     * With a transition, they are not final. */
+    if (msec > 0)
+        shadow_forget(d, ~0ULL);
+    else if (n == num_channels) {
+        for (c=0; c<num_channels; c++)
+            shadow_set_value(d, c, reply_value[c]);
+    }
+    return 0;
+}
+
+/*
+ * Get current modes of all channels, in one request.
+ * Return number of channels.
+ */
+int dyio_get_all_modes(dyio_t *d, int *mode)
+{
+    int num_channels, status;
+
+    status = dyio_rpc_get_all_modes(d, &num_channels, mode);
+    if (status < 0) {
+        if (d->debug)
+            printf("dyio: gacm failed, status %d\n", status);
+        return status;
+    }
+    shadow_set_modes(d, num_channels, mode);
+    return num_channels;
+}
+
+/*
+ * Set modes of all channels, in one request.
+ */
+int dyio_set_all_modes(dyio_t *d, const int *mode)
+{
+    int num_channels = dyio_num_channels(d);
+    int modes[MAX_CHANNELS], n, status;
+
+    if (num_channels < 0)
+        return num_channels;
+    status = dyio_rpc_set_all_modes(d, num_channels, mode, &n, modes);
+    if (status < 0) {
+        if (d->debug)
+            printf("dyio: sacm failed, status %d\n", status);
+        return status;
+    }
+    shadow_set_modes(d, n, modes);
+    return 0;
+}
+
+/*
+ * Watch the channel: configure the device to push its value
+ * asynchronously, and call the user function on every event.
+ */
+int dyio_watch_channel(dyio_t *d, int ch, int mode, int msec, int value,
+    int edge, dyio_callback_t *func, void *arg)
+{
+    int status;
+
+    if (ch < 0 || ch >= MAX_CHANNELS) {
+        printf("dyio: cannot watch channel %d\n", ch);
+        return -1;
+    }
+    dyio_set_callback(d, ID_BCS_IO, ch, func, arg);
+    if (dyio_start_reader(d) < 0)
+        return -1;
+
+    status = dyio_rpc_set_async(d, ch, mode, msec, value, edge);
+    if (status < 0) {
+        printf("dyio: cannot watch channel %d: no asyn reply\n", ch);
+        dyio_set_callback(d, ID_BCS_IO, ch, 0, 0);
+        return status;
+    }
+    return 0;
+}
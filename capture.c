@@ -0,0 +1,329 @@
+/*
+ * DyIO library: capture of raw traffic to a binary file, and replay.
+ *
+ * Capture file starts with magic "DYIOcap1", followed by records:
+ *      8 bytes     time in microseconds since start of capture
+ *      1 byte      direction: 'T' - sent to device, 'R' - received
+ *      2 bytes     length of data
+ *      N bytes     data, as passed to write() or returned by read()
+ * All numbers are little endian. A received record of zero length
+ * means the read timed out.
+ *
+ * On replay, received data are delayed as in the capture: relative
+ * to the time, when the preceding sent record was written.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dyio.h"
+
+#if defined(__WIN32__) || defined(WIN32)
+#   include <windows.h>
+#else
+#   include <unistd.h>
+#endif
+
+#define CAPTURE_MAGIC   "DYIOcap1"
+#define CAPTURE_BUFSZ   65536           /* Size of capture buffer */
+#define RECORD_HDRSZ    11              /* Size of record header */
+
+struct _dyio_capture_t {
+    FILE                *fd;            /* Output file */
+    unsigned long long  start;          /* Time of capture start */
+    int                 len;            /* Number of bytes in buffer */
+    unsigned char       buf[CAPTURE_BUFSZ];
+};
+
+struct _dyio_replay_t {
+    unsigned char       *data;          /* Contents of capture file */
+    long                size;           /* Size of file */
+    long                rx;             /* Position of next received record */
+    int                 rxoff;          /* Bytes already returned from it */
+    long                tx;             /* Position of next sent record */
+    int                 txoff;          /* Bytes already compared to it */
+    int                 differ;         /* Sent data differ from capture */
+    unsigned long long  shift;          /* Real time minus capture time */
+};
+
+/*
+ * Write the buffer to the file.
+ */
+static void capture_flush(dyio_capture_t *c)
+{
+    if (c->len > 0 && fwrite(c->buf, 1, c->len, c->fd) != c->len)
+        fprintf(stderr, "dyio: capture write error\n");
+    c->len = 0;
+}
+
+/*
+ * Start capture of all traffic to the given file.
+ * Return 0 on success, -1 on error.
+ */
+int dyio_capture_start(dyio_t *d, const char *filename)
+{
+    dyio_capture_t *c;
+
+    dyio_capture_stop(d);
+    c = calloc(1, sizeof(dyio_capture_t));
+    if (! c) {
+        fprintf(stderr, "dyio: Out of memory\n");
+        return -1;
+    }
+    c->fd = fopen(filename, "wb");
+    if (! c->fd) {
+        perror(filename);
+        free(c);
+        return -1;
+    }
+    c->start = _dyio_usec();
+    memcpy(c->buf, CAPTURE_MAGIC, 8);
+    c->len = 8;
+
+    _dyio_lock(d);
+    d->capture = c;
+    _dyio_unlock(d);
+    return 0;
+}
+
+/*
+ * Stop the capture and close the file.
+ */
+void dyio_capture_stop(dyio_t *d)
+{
+    dyio_capture_t *c;
+
+    _dyio_lock(d);
+    c = d->capture;
+    d->capture = 0;
+    _dyio_unlock(d);
+    if (! c)
+        return;
+
+    capture_flush(c);
+    fclose(c->fd);
+    free(c);
+}
+
+/*
+ * Append a record to the capture buffer.
+ * Must be called with the device locked.
+ */
+void _dyio_capture(dyio_t *d, int dir, const unsigned char *data, int len)
+{
+    dyio_capture_t *c = d->capture;
+    unsigned long long usec = _dyio_usec() - c->start;
+    unsigned char *p;
+    int i;
+
+    if (c->len + RECORD_HDRSZ + len > CAPTURE_BUFSZ)
+        capture_flush(c);
+    if (RECORD_HDRSZ + len > CAPTURE_BUFSZ)
+        return;
+
+    p = c->buf + c->len;
+    for (i=0; i<8; i++)
+        p[i] = usec >> (i * 8);
+    p[8] = dir;
+    p[9] = len;
+    p[10] = len >> 8;
+    memcpy(p + RECORD_HDRSZ, data, len);
+    c->len += RECORD_HDRSZ + len;
+}
+
+/*
+ * Find next record with the given direction, starting from given position.
+ * Return position, or -1 when not found.
+ */
+static long next_record(dyio_replay_t *r, long pos, int dir)
+{
+    int len;
+
+    while (pos + RECORD_HDRSZ <= r->size) {
+        len = r->data[pos+9] | r->data[pos+10] << 8;
+        if (pos + RECORD_HDRSZ + len > r->size)
+            break;
+        if (r->data[pos+8] == dir)
+            return pos;
+        pos += RECORD_HDRSZ + len;
+    }
+    return -1;
+}
+
+/*
+ * Get length of the record at given position.
+ */
+static int record_len(dyio_replay_t *r, long pos)
+{
+    return r->data[pos+9] | r->data[pos+10] << 8;
+}
+
+/*
+ * Get time of the record at given position.
+ */
+static unsigned long long record_time(dyio_replay_t *r, long pos)
+{
+    unsigned long long usec = 0;
+    int i;
+
+    for (i=7; i>=0; i--)
+        usec = usec << 8 | r->data[pos+i];
+    return usec;
+}
+
+/*
+ * Take data, sent to the device, and compare it with the capture.
+ * Return number of bytes.
+ */
+int _dyio_replay_write(dyio_t *d, unsigned char *data, int len)
+{
+    dyio_replay_t *r = d->replay;
+    int i, n;
+
+    for (i=0; i<len; i++) {
+        if (r->tx < 0)
+            break;
+        n = record_len(r, r->tx);
+        if (r->txoff >= n) {
+            /* Go to next record. */
+            r->tx = next_record(r, r->tx + RECORD_HDRSZ + n, 'T');
+            r->txoff = 0;
+            i--;
+            continue;
+        }
+        if (r->txoff == 0) {
+            /* Align the capture time to the real time of sending. */
+            r->shift = _dyio_usec() - record_time(r, r->tx);
+        }
+        if (data[i] != r->data[r->tx + RECORD_HDRSZ + r->txoff] && ! r->differ) {
+            fprintf(stderr, "dyio-replay: sent data differ from capture at offset %ld\n",
+                r->tx + RECORD_HDRSZ + r->txoff);
+            r->differ = 1;
+        }
+        r->txoff++;
+    }
+    return len;
+}
+
+/*
+ * Return data, received from the device, as recorded in the capture.
+ * A record is delayed until its time, relative to the last sent record,
+ * but not longer than the timeout: a timeout is replayed only
+ * when it is in the capture.
+ * Return number of bytes, or 0 at the end of capture.
+ */
+int _dyio_replay_read(dyio_t *d, unsigned char *data, int len,
+    unsigned long usec)
+{
+    dyio_replay_t *r = d->replay;
+    unsigned long long now, due;
+    int n;
+
+    if (r->rx < 0) {
+        if (d->debug)
+            printf("dyio-replay: end of capture\n");
+        return 0;
+    }
+    if (r->rxoff == 0 && r->shift) {
+        now = _dyio_usec();
+        due = r->shift + record_time(r, r->rx);
+        if (due > now + usec)
+            due = now + usec;
+        if (due > now) {
+#if defined(__WIN32__) || defined(WIN32)
+            Sleep((due - now) / 1000);
+#else
+            usleep(due - now);
+#endif
+        }
+    }
+    n = record_len(r, r->rx) - r->rxoff;
+    if (n > len)
+        n = len;
+    memcpy(data, r->data + r->rx + RECORD_HDRSZ + r->rxoff, n);
+    r->rxoff += n;
+
+    if (r->rxoff >= record_len(r, r->rx)) {
+        r->rx = next_record(r, r->rx + RECORD_HDRSZ + record_len(r, r->rx), 'R');
+        r->rxoff = 0;
+    }
+    return n;
+}
+
+static const dyio_transport_t replay_transport = {
+    "replay",
+    _dyio_replay_write,
+    _dyio_replay_read,
+    0,
+    _dyio_replay_close,
+    0,
+};
+
+/*
+ * Open the capture file and create a device object,
+ * which replays the traffic instead of a real device.
+ * Return 0 on error.
+ */
+dyio_t *_dyio_replay_open(const char *filename)
+{
+    dyio_replay_t *r;
+    dyio_t *d;
+    FILE *fd;
+
+    fd = fopen(filename, "rb");
+    if (! fd) {
+        perror(filename);
+        return 0;
+    }
+    d = calloc(1, sizeof(dyio_t));
+    r = calloc(1, sizeof(dyio_replay_t));
+    if (! d || ! r) {
+        fprintf(stderr, "dyio: Out of memory\n");
+        goto failed;
+    }
+    fseek(fd, 0, SEEK_END);
+    r->size = ftell(fd);
+    rewind(fd);
+    r->data = malloc(r->size + 1);
+    if (! r->data) {
+        fprintf(stderr, "dyio: Out of memory\n");
+        goto failed;
+    }
+    if (fread(r->data, 1, r->size, fd) != r->size ||
+        r->size < 8 || memcmp(r->data, CAPTURE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: Bad capture file\n", filename);
+        goto failed;
+    }
+    fclose(fd);
+
+    r->rx = next_record(r, 8, 'R');
+    r->tx = next_record(r, 8, 'T');
+    d->replay = r;
+    d->transport = &replay_transport;
+    return d;
+
+failed:
+    fclose(fd);
+    if (r)
+        free(r->data);
+    free(r);
+    free(d);
+    return 0;
+}
+
+/*
+ * Deallocate the replay data and the device object.
+ */
+void _dyio_replay_close(dyio_t *d)
+{
+    dyio_replay_t *r = d->replay;
+
+    d->replay = 0;
+    free(r->data);
+    free(r);
+    free(d);
+}
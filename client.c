@@ -0,0 +1,159 @@
+/*
+ * DyIO library: client of dyiod daemon.
+ *
+ * The device state is read from shared memory, exported by the daemon.
+ * Calls are passed to the daemon through a Unix socket.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "dyio.h"
+
+struct _dyio_client_t {
+    int                 sock;           /* Socket, connected to daemon */
+    const dyio_state_t  *state;         /* Shared memory of daemon */
+};
+
+/*
+ * Attach to the daemon.
+ */
+dyio_client_t *dyio_client_open(const char *name)
+{
+    dyio_client_t *c;
+    struct sockaddr_un addr;
+    char path[256];
+    void *shm;
+    int fd;
+
+    c = calloc(1, sizeof(dyio_client_t));
+    if (! c) {
+        fprintf(stderr, "dyio: Out of memory\n");
+        return 0;
+    }
+
+    /* Map the state. */
+    snprintf(path, sizeof(path), DYIOD_SHM, name);
+    fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        perror(path);
+        free(c);
+        return 0;
+    }
+    shm = mmap(0, sizeof(dyio_state_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror(path);
+        free(c);
+        return 0;
+    }
+    c->state = shm;
+    if (c->state->magic != DYIOD_MAGIC) {
+        fprintf(stderr, "%s: Bad shared memory of daemon\n", path);
+        goto failed;
+    }
+
+    /* Connect to the socket. */
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), DYIOD_SOCKET, name);
+    c->sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (c->sock < 0) {
+        perror("socket");
+        goto failed;
+    }
+    if (connect(c->sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        perror(addr.sun_path);
+        close(c->sock);
+        goto failed;
+    }
+    return c;
+
+failed:
+    munmap((void*) c->state, sizeof(dyio_state_t));
+    free(c);
+    return 0;
+}
+
+/*
+ * Detach from the daemon.
+ */
+void dyio_client_close(dyio_client_t *c)
+{
+    close(c->sock);
+    munmap((void*) c->state, sizeof(dyio_state_t));
+    free(c);
+}
+
+/*
+ * Get consistent snapshot of the state.
+ * Retry while the daemon is updating it.
+ */
+void dyio_client_state(dyio_client_t *c, dyio_state_t *st)
+{
+    const dyio_state_t *shm = c->state;
+    unsigned seq;
+
+    for (;;) {
+        seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(st, shm, sizeof(dyio_state_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq)
+            break;
+    }
+}
+
+/*
+ * Pass the call to the device through the daemon.
+ */
+int dyio_client_call(dyio_client_t *c, int type, int namespace, char *rpc,
+    unsigned char *data, int datalen, unsigned char *reply)
+{
+    dyio_client_query_t q;
+    dyio_client_reply_t r;
+    int n;
+
+    if (datalen < 0 || datalen > 255 - sizeof(q.rpc)) {
+        fprintf(stderr, "dyio: too long request '%.4s': %u bytes\n", rpc, datalen);
+        return -1;
+    }
+    q.type = type;
+    q.id = namespace;
+    memcpy(q.rpc, rpc, sizeof(q.rpc));
+    q.datalen = datalen;
+    if (datalen > 0)
+        memcpy(q.data, data, datalen);
+
+    n = offsetof(dyio_client_query_t, data) + datalen;
+    if (send(c->sock, &q, n, 0) != n) {
+        perror("dyio: send to daemon");
+        return -1;
+    }
+    n = recv(c->sock, &r, sizeof(r), 0);
+    if (n < (int) offsetof(dyio_client_reply_t, reply)) {
+        fprintf(stderr, "dyio: no reply from daemon\n");
+        return -1;
+    }
+    if (r.status < 0)
+        return r.status;
+    if (r.reply_len < 0 || r.reply_len > sizeof(r.reply))
+        r.reply_len = 0;
+    if (reply)
+        memcpy(reply, r.reply, r.reply_len);
+    return r.reply_len;
+}
@@ -12,7 +12,14 @@
 #include <stdint.h>
 #include "dyio.h"
 
+#if defined(__WIN32__) || defined(WIN32)
+#   include <windows.h>
+#else
+#   include <time.h>
+#endif
+
 #define PROTO_VERSION   3   /* Revision of the current protocol */
+#define TAG_MASK        0x7fffffff /* Tags are non-negative */
 
 struct dyio_header {
     uint8_t proto;          /* Protocol revision */
@@ -25,172 +32,1281 @@ struct dyio_header {
 };
 
 /*
- * Send the command sequence and get back a response.
+ * Compute a sum of the header bytes.
  */
-void dyio_call(dyio_t *d, int type, int namespace, char *rpc, uint8_t *data, int datalen)
+static uint8_t header_sum(struct dyio_header *hdr)
 {
-    struct dyio_header hdr;
-    uint8_t *p, sum;
-    int len, i, got, retry = 0;
-
-    /*
-     * Prepare header and checksum.
-     */
-again:
-    hdr.proto     = PROTO_VERSION;
-    hdr.type      = type;
-    hdr.id        = namespace;
-    hdr.datalen   = datalen + sizeof(hdr.rpc);
-    memcpy(hdr.mac, d->mac, sizeof(hdr.mac));
-    memcpy(hdr.rpc, rpc, sizeof(hdr.rpc));
-    hdr.hsum = hdr.proto + hdr.mac[0] + hdr.mac[1] + hdr.mac[2] +
-               hdr.mac[3] + hdr.mac[4] + hdr.mac[5] + hdr.type +
-               hdr.id + hdr.datalen;
-    sum = hdr.rpc[0] + hdr.rpc[1] + hdr.rpc[2] + hdr.rpc[3];
+    return hdr->proto + hdr->mac[0] + hdr->mac[1] + hdr->mac[2] +
+           hdr->mac[3] + hdr->mac[4] + hdr->mac[5] + hdr->type +
+           hdr->id + hdr->datalen;
+}
+
+/*
+ * Build a frame in the given buffer: header, RPC, data and checksum.
+ * Buffer must have room for sizeof(struct dyio_header) + datalen + 1 bytes.
+ * Return length of the frame.
+ */
+static int build_frame(dyio_t *d, uint8_t *buf, int type, int id,
+    const char *rpc, const uint8_t *data, int datalen)
+{
+    struct dyio_header *hdr = (struct dyio_header*) buf;
+    uint8_t sum;
+    int i;
+
+    hdr->proto    = PROTO_VERSION;
+    hdr->type     = type;
+    hdr->id       = id;
+    hdr->datalen  = datalen + sizeof(hdr->rpc);
+    memcpy(hdr->mac, d->mac, sizeof(hdr->mac));
+    memcpy(hdr->rpc, rpc, sizeof(hdr->rpc));
+    hdr->hsum = header_sum(hdr);
+    sum = hdr->rpc[0] + hdr->rpc[1] + hdr->rpc[2] + hdr->rpc[3];
     for (i=0; i<datalen; i++)
-        sum += data[i];
+        sum += buf[sizeof(*hdr) + i] = data[i];
+    buf[sizeof(*hdr) + datalen] = sum;
 
-    /*
-     * Send command.
-     */
     if (d->debug) {
         printf("--- send %x-%x-%x-%x-%x-%x-%x-%x-%x-[%u]-%x-'%c%c%c%c'",
-            hdr.proto, hdr.mac[0], hdr.mac[1], hdr.mac[2],
-            hdr.mac[3], hdr.mac[4], hdr.mac[5], hdr.type,
-            hdr.id, hdr.datalen, hdr.hsum,
-            hdr.rpc[0], hdr.rpc[1], hdr.rpc[2], hdr.rpc[3]);
+            hdr->proto, hdr->mac[0], hdr->mac[1], hdr->mac[2],
+            hdr->mac[3], hdr->mac[4], hdr->mac[5], hdr->type,
+            hdr->id, hdr->datalen, hdr->hsum,
+            hdr->rpc[0], hdr->rpc[1], hdr->rpc[2], hdr->rpc[3]);
         for (i=0; i<datalen; i++)
             printf("-%x", data[i]);
         printf("-%x\n", sum);
     }
-    if (_dyio_serial_write(d, (uint8_t*)&hdr, sizeof(hdr)) < 0) {
-        fprintf(stderr, "dyio: header write error\n");
-        exit(-1);
+    return sizeof(*hdr) + datalen + 1;
+}
+
+/*
+ * Send data to the device through the transport.
+ * Return number of bytes, or -1 on error.
+ */
+static int link_write(dyio_t *d, unsigned char *data, int len)
+{
+    int got = d->transport->write(d, data, len);
+
+    if (d->capture && got > 0)
+        _dyio_capture(d, 'T', data, got);
+    return got;
+}
+
+/*
+ * Receive data from the device through the transport.
+ * Called with the device unlocked.
+ * Return number of bytes, or 0 on timeout.
+ */
+static int link_read(dyio_t *d, unsigned char *data, int len, unsigned long usec)
+{
+    int got = d->transport->read(d, data, len, usec);
+
+    if (d->capture && got >= 0) {
+        _dyio_lock(d);
+        if (d->capture)
+            _dyio_capture(d, 'R', data, got);
+        _dyio_unlock(d);
     }
-    if (datalen > 0 && _dyio_serial_write(d, data, datalen) < 0) {
-        fprintf(stderr, "dyio: data write error\n");
-        exit(-1);
+    return got;
+}
+
+/*
+ * Send all frames from the transmit buffer, in one write.
+ * On error the link is marked broken, and the frames are dropped:
+ * requests fail with DYIO_ELINK, see check_deadlines().
+ * Must be called with the device locked.
+ */
+static void flush_tx(dyio_t *d)
+{
+    int len = 0, got;
+
+    while (len < d->txlen && ! d->broken) {
+        got = link_write(d, d->txbuf + len, d->txlen - len);
+        if (got <= 0) {
+            fprintf(stderr, "dyio: write error, link is broken\n");
+            d->broken = 1;
+            break;
+        }
+        len += got;
     }
-    if (_dyio_serial_write(d, &sum, 1) < 0) {
-        fprintf(stderr, "dyio: data sum write error\n");
-        exit(-1);
+    d->txlen = 0;
+}
+
+/*
+ * Put the request into the transmit buffer.
+ * When the buffer is full, send it to the device.
+ * Replies are matched in the order of sending.
+ */
+static void send_request(dyio_t *d, dyio_request_t *r)
+{
+    int len;
+
+    r->order = d->order++;
+    if (d->txlen + sizeof(struct dyio_header) + r->datalen + 1 > sizeof(d->txbuf))
+        flush_tx(d);
+
+    len = build_frame(d, d->txbuf + d->txlen, r->type, r->id,
+        r->rpc, r->data, r->datalen);
+    d->txlen += len;
+    if (r->stat >= 0)
+        d->stats[r->stat].bytes_tx += len;
+}
+
+/*
+ * Check whether the header is valid.
+ */
+static int valid_header(struct dyio_header *hdr)
+{
+    return hdr->proto == PROTO_VERSION &&
+           hdr->datalen >= sizeof(hdr->rpc) &&
+           hdr->hsum == header_sum(hdr);
+}
+
+/*
+ * Receive one packet from the device.
+ * Input is read in large chunks into the receive buffer.
+ * A frame starts with a valid header: protocol version and header sum.
+ * On a bad data sum, only one byte is skipped, and the next header
+ * is searched from there, so good frames are never dropped.
+ * Data bytes are placed into buf, followed by the data sum.
+ * Deadline is an absolute time in microseconds, see _dyio_usec().
+ * Return 0 on success, or 1 when no packet was received until deadline.
+ */
+static int receive_packet(dyio_t *d, struct dyio_header *hdr, uint8_t *buf,
+    int *datalen, unsigned long long deadline)
+{
+    unsigned long long now;
+    uint8_t *p, sum;
+    int i, got, skipped = 0;
+
+    for (;;) {
+        /* Skip garbage until a valid header. */
+        while (d->rxlen >= sizeof(*hdr)) {
+            memcpy(hdr, d->rxbuf + d->rxpos, sizeof(*hdr));
+            if (valid_header(hdr))
+                break;
+            d->rxpos++;
+            d->rxlen--;
+            skipped++;
+        }
+        if (skipped) {
+            if (d->debug)
+                printf("dyio: skip %u bytes of input\n", skipped);
+            d->resyncs++;
+            skipped = 0;
+        }
+
+        if (d->rxlen >= sizeof(*hdr)) {
+            *datalen = hdr->datalen - sizeof(hdr->rpc);
+            if (d->rxlen > sizeof(*hdr) + *datalen) {
+                /* Complete frame: check data sum. */
+                p = d->rxbuf + d->rxpos + sizeof(*hdr);
+                sum = hdr->rpc[0] + hdr->rpc[1] + hdr->rpc[2] + hdr->rpc[3];
+                for (i=0; i<*datalen; i++)
+                    sum += p[i];
+                if (sum != p[*datalen]) {
+                    if (d->debug)
+                        printf("dyio: invalid reply data sum = %02x, expected %02x \n",
+                            sum, p[*datalen]);
+                    i = _dyio_stat_index(d, hdr->id & ~ID_RESPONSE, (char*) hdr->rpc, 0);
+                    if (i >= 0)
+                        __atomic_fetch_add(&d->stats[i].bad_sums, 1, __ATOMIC_RELAXED);
+                    d->rxpos++;
+                    d->rxlen--;
+                    d->resyncs++;
+                    continue;
+                }
+                memcpy(buf, p, *datalen + 1);
+                d->rxpos += sizeof(*hdr) + *datalen + 1;
+                d->rxlen -= sizeof(*hdr) + *datalen + 1;
+
+                if (d->debug) {
+                    printf("-- reply %x-%x-%x-%x-%x-%x-%x-%x-%x-[%u]-%x-'%c%c%c%c'",
+                        hdr->proto, hdr->mac[0], hdr->mac[1], hdr->mac[2],
+                        hdr->mac[3], hdr->mac[4], hdr->mac[5], hdr->type,
+                        hdr->id, hdr->datalen, hdr->hsum,
+                        hdr->rpc[0], hdr->rpc[1], hdr->rpc[2], hdr->rpc[3]);
+                    for (i=0; i<=*datalen; i++)
+                        printf("-%x", buf[i]);
+                    printf("\n");
+                }
+                return 0;
+            }
+        }
+
+        /* Need more data. */
+        if (d->broken)
+            return 1;
+        if (d->rxpos > 0) {
+            memmove(d->rxbuf, d->rxbuf + d->rxpos, d->rxlen);
+            d->rxpos = 0;
+        }
+        now = _dyio_usec();
+        got = link_read(d, d->rxbuf + d->rxlen, sizeof(d->rxbuf) - d->rxlen,
+            (deadline > now) ? deadline - now : 0);
+        if (got < 0)
+            d->broken = 1;
+        if (got <= 0)
+            return 1;
+        d->rxlen += got;
+    }
+}
+
+/*
+ * Get number of leading query bytes, which are repeated in the reply:
+ * channel number for bcs.io, namespace and method index for bcs.rpc.
+ */
+static int echo_len(dyio_request_t *r)
+{
+    static const struct {
+        int     id;
+        char    rpc[4];
+        int     len;
+    } tab[] = {
+        { ID_BCS_IO,  "gchv", 1 },
+        { ID_BCS_IO,  "gchm", 1 },
+        { ID_BCS_IO,  "schv", 1 },
+        { ID_BCS_IO,  "strm", 1 },
+        { ID_BCS_RPC, "_rpc", 2 },
+        { ID_BCS_RPC, "args", 2 },
+    };
+    int i;
+
+    for (i=0; i<sizeof(tab)/sizeof(tab[0]); i++) {
+        if (r->id == tab[i].id && memcmp(r->rpc, tab[i].rpc, 4) == 0)
+            return (r->datalen < tab[i].len) ? r->datalen : tab[i].len;
     }
+    return 0;
+}
+
+/*
+ * Can the request be sent again, when its reply is lost?
+ * Only queries are idempotent: a post or critical command
+ * may have been executed, and sent twice, it would act twice
+ * (a strm post would duplicate the data).
+ */
+static int may_resend(dyio_request_t *r)
+{
+    return r->type == PKT_GET;
+}
 
-    /*
-     * Get header.
-     */
-next:
-    p = (uint8_t*) &hdr;
-    len = 0;
-    while (len < sizeof(hdr)) {
-        got = _dyio_serial_read(d, p, sizeof(hdr) - len);
-        if (! got) {
-            fprintf(stderr, "dyio: connection lost\n");
-            exit(-1);
+/*
+ * Packet type of a reply to the request.
+ * Posts to the PID namespace are acknowledged with a status,
+ * everything else is answered with a post.
+ */
+static int reply_type(dyio_request_t *r)
+{
+    if (r->type != PKT_GET && r->id == ID_BCS_PID)
+        return PKT_STATUS;
+    return PKT_POST;
+}
+
+/*
+ * Find a request for the given reply: the request in flight
+ * with the same namespace, RPC, reply type and echoed arguments,
+ * which was sent first.
+ * A late reply to the request, abandoned after timeout, is matched
+ * too: it is dropped. An error reply does not echo arguments:
+ * it goes to the first sent request of the same namespace.
+ */
+static dyio_request_t *match_reply(dyio_t *d, struct dyio_header *hdr,
+    uint8_t *buf, int len)
+{
+    dyio_request_t *r, *match = 0, *oldest = 0;
+    unsigned seq;
+    int n;
+
+    for (seq=d->head; seq!=d->tail; seq++) {
+        r = &d->queue[seq % MAX_INFLIGHT];
+        if (r->state != REQ_SENT && r->state != REQ_LATE)
+            continue;
+        if (r->id != (hdr->id & ~ID_RESPONSE))
+            continue;
+
+        if (! oldest || (int) (r->order - oldest->order) < 0)
+            oldest = r;
+
+        if (memcmp(r->rpc, hdr->rpc, sizeof(r->rpc)) != 0 ||
+            reply_type(r) != hdr->type)
+            continue;
+
+        n = echo_len(r);
+        if (n > len || memcmp(r->data, buf, n) != 0)
+            continue;
+
+        if (! match || (int) (r->order - match->order) < 0)
+            match = r;
+    }
+    if (! match && memcmp(hdr->rpc, "_err", 4) == 0)
+        return oldest;
+    return match;
+}
+
+/*
+ * Finish the request without reply.
+ */
+static void expire_request(dyio_t *d, dyio_request_t *r)
+{
+    r->state = REQ_TIMEOUT;
+    r->reply_len = 0;
+    d->inflight--;
+    d->timeouts++;
+}
+
+/*
+ * Free the collected request, and release the head of the queue.
+ * A request, abandoned after timeout, may still get its reply:
+ * the slot is kept for one more timeout, so the late reply
+ * is dropped instead of matching a later request.
+ * Zero deadline means that no reply is expected.
+ */
+static void release_request(dyio_t *d, dyio_request_t *r)
+{
+    if (r->state == REQ_TIMEOUT && r->deadline) {
+        r->state = REQ_LATE;
+        r->deadline = _dyio_usec() + r->timeout;
+    } else
+        r->state = REQ_FREE;
+
+    while (d->head != d->tail &&
+           d->queue[d->head % MAX_INFLIGHT].state == REQ_FREE)
+        d->head++;
+}
+
+/*
+ * The device replies in order of requests.
+ * Requests, sent before the given one and still waiting,
+ * have lost their replies: send queries again, and fail
+ * the commands, which cannot be repeated.
+ */
+static void resend_lost(dyio_t *d, dyio_request_t *done)
+{
+    dyio_request_t *r;
+    unsigned seq;
+    int lost = 0, failed = 0;
+
+    for (seq=d->head; seq!=d->tail; seq++) {
+        r = &d->queue[seq % MAX_INFLIGHT];
+        if ((int) (r->order - done->order) >= 0)
+            continue;
+        if (r->state == REQ_LATE) {
+            /* Abandoned request: the reply will not come. */
+            release_request(d, r);
+            continue;
         }
+        if (r->state != REQ_SENT)
+            continue;
 
-        p += got;
-        len += got;
+        if (! may_resend(r)) {
+            if (d->debug)
+                printf("dyio: reply '%.4s' lost, fail\n", r->rpc);
+            if (r->stat >= 0)
+                d->stats[r->stat].timeouts++;
+            expire_request(d, r);
+            r->deadline = 0;
+            failed++;
+            continue;
+        }
+        if (d->debug)
+            printf("dyio: reply '%.4s' lost, send again\n", r->rpc);
+        if (r->stat >= 0)
+            d->stats[r->stat].resends++;
+        r->resent++;
+        send_request(d, r);
+        lost++;
     }
-    if (hdr.proto != PROTO_VERSION) {
-        /* Skip all incoming data. */
-        unsigned char buf [300];
-
-        if (retry)
-            printf("got invalid header: %x-%x-%x-%x-%x-%x-%x-%x-%x-%x-%x-%x-%x-%x-%x\n",
-                hdr.proto, hdr.mac[0], hdr.mac[1], hdr.mac[2],
-                hdr.mac[3], hdr.mac[4], hdr.mac[5], hdr.type,
-                hdr.id, hdr.datalen, hdr.hsum,
-                hdr.rpc[0], hdr.rpc[1], hdr.rpc[2], hdr.rpc[3]);
-flush_input:
-        _dyio_serial_read(d, buf, sizeof(buf));
-        if (! retry) {
-            retry = 1;
-            goto again;
-        }
-        fprintf(stderr, "dyio: unable to synchronize\n");
-        exit(-1);
-    }
-    memcpy(d->reply_mac, hdr.mac, sizeof(hdr.mac));
-
-    /*
-     * Get response.
-     */
-    d->reply_len = hdr.datalen - sizeof(hdr.rpc);
-    p = d->reply;
-    len = 0;
-    while (len <= d->reply_len) {
-        got = _dyio_serial_read(d, p, d->reply_len + 1 - len);
-        if (! got) {
-            fprintf(stderr, "dyio: connection lost\n");
-            exit(-1);
-        }
-
-        p += got;
-        len += got;
+    if (lost)
+        flush_tx(d);
+    if (failed)
+        _dyio_wakeup(d);
+}
+
+/*
+ * Get the earliest deadline of requests in flight, or the time
+ * when a lane with rate limit opens, but not later than the given time.
+ */
+static unsigned long long next_deadline(dyio_t *d, unsigned long long deadline)
+{
+    unsigned long long now = _dyio_usec();
+    dyio_request_t *r;
+    unsigned seq;
+    int lane;
+
+    for (seq=d->head; seq!=d->tail; seq++) {
+        r = &d->queue[seq % MAX_INFLIGHT];
+        if ((r->state == REQ_SENT || r->state == REQ_LATE) &&
+            (! deadline || r->deadline < deadline))
+            deadline = r->deadline;
     }
-    if (d->debug) {
-        printf("-- reply %x-%x-%x-%x-%x-%x-%x-%x-%x-[%u]-%x-'%c%c%c%c'",
-            hdr.proto, hdr.mac[0], hdr.mac[1], hdr.mac[2],
-            hdr.mac[3], hdr.mac[4], hdr.mac[5], hdr.type,
-            hdr.id, hdr.datalen, hdr.hsum,
-            hdr.rpc[0], hdr.rpc[1], hdr.rpc[2], hdr.rpc[3]);
-        for (i=0; i<=d->reply_len; i++)
-            printf("-%x", d->reply[i]);
-        printf("\n");
+    for (lane=0; lane<NUM_LANES; lane++) {
+        if (d->lane[lane].period && d->lane[lane].next > now &&
+            (! deadline || d->lane[lane].next < deadline))
+            deadline = d->lane[lane].next;
     }
+    return deadline;
+}
 
-    /* Check header sum. */
-    sum = hdr.proto + hdr.mac[0] + hdr.mac[1] + hdr.mac[2] +
-          hdr.mac[3] + hdr.mac[4] + hdr.mac[5] + hdr.type +
-          hdr.id + hdr.datalen;
-    if (sum != hdr.hsum) {
-        printf("dyio: invalid reply header sum = %02x, expected %02x \n", sum, hdr.hsum);
-        goto flush_input;
+/*
+ * Get priority lane of the packet type.
+ */
+int _dyio_type_lane(int type)
+{
+    switch (type) {
+    case PKT_STATUS: return LANE_STATUS;
+    case PKT_POST:   return LANE_POST;
+    case PKT_GET:    return LANE_GET;
+    default:         return LANE_CRITICAL;
     }
+}
 
-    /* Check data sum. */
-    sum = hdr.rpc[0] + hdr.rpc[1] + hdr.rpc[2] + hdr.rpc[3];
-    for (i=0; i<d->reply_len; i++)
-        sum += d->reply[i];
-    if (sum != d->reply[d->reply_len]) {
-        printf("dyio: invalid reply data sum = %02x, expected %02x \n", sum, d->reply[d->reply_len]);
-        goto flush_input;
+/*
+ * Check whether a request of the lane may be sent now:
+ * the window has room, and the rate limit allows.
+ * A pipelined sequence passes its own window, when it is
+ * wider than the window of the connection.
+ * Critical requests have one slot above the window,
+ * so they never wait for bulk traffic to drain.
+ */
+static int lane_ready(dyio_t *d, int lane, int window, unsigned long long now)
+{
+    if (window < d->window)
+        window = d->window;
+    if (d->inflight >= window + (lane == LANE_CRITICAL))
+        return 0;
+    return ! d->lane[lane].period || now >= d->lane[lane].next;
+}
+
+/*
+ * Check whether a new request of the lane must wait:
+ * requests of the same or higher priority are waiting,
+ * or the lane is not ready.
+ */
+static int lane_blocked(dyio_t *d, int lane, int window, unsigned long long now)
+{
+    int i;
+
+    for (i=0; i<=lane; i++) {
+        if (d->lane[i].waiting > 0)
+            return 1;
     }
+    return ! lane_ready(d, lane, window, now);
+}
+
+/*
+ * Send the request, and start counting its timeout.
+ * Must be called with the device locked.
+ */
+static void start_request(dyio_t *d, dyio_request_t *r)
+{
+    unsigned long long now = _dyio_usec();
 
-    if (! (hdr.id & ID_RESPONSE)) {
-        printf("dyio: incorrect response flag\n");
-        goto next;
+    r->state = REQ_SENT;
+    d->inflight++;
+    r->sent = now;
+    r->resent = 0;
+    r->deadline = now + r->timeout;
+    if (d->lane[r->lane].period) {
+        /* Space requests of the lane evenly. */
+        if (d->lane[r->lane].next < now)
+            d->lane[r->lane].next = now;
+        d->lane[r->lane].next += d->lane[r->lane].period;
     }
+    send_request(d, r);
+}
 
-    if (hdr.type == PKT_ASYNC) {
-        /* For now, just ignore async incoming packets.
-         * TODO: use callbacks defined by user. */
-        goto next;
+/*
+ * Send waiting requests, while the window has room:
+ * higher priority lanes first, in order of queueing within a lane.
+ * Must be called with the device locked.
+ * Return number of requests sent.
+ */
+static int start_waiting(dyio_t *d)
+{
+    unsigned long long now;
+    dyio_request_t *r, *best;
+    unsigned seq;
+    int sent = 0;
+
+    if (d->waiting == 0)
+        return 0;
+    now = _dyio_usec();
+    while (d->waiting > 0) {
+        best = 0;
+        for (seq=d->head; seq!=d->tail; seq++) {
+            r = &d->queue[seq % MAX_INFLIGHT];
+            if (r->state != REQ_WAITING || (best && r->lane >= best->lane))
+                continue;
+            if (lane_ready(d, r->lane, r->window, now)) {
+                best = r;
+                if (r->lane == LANE_CRITICAL)
+                    break;
+            }
+        }
+        if (! best)
+            break;
+        d->waiting--;
+        d->lane[best->lane].waiting--;
+        start_request(d, best);
+        sent++;
     }
+    return sent;
 }
 
 /*
- * Establish a connection to the DyIO device.
+ * The link is broken: complete all requests in flight
+ * or waiting, with DYIO_ELINK status.
+ * Must be called with the device locked.
  */
-dyio_t *dyio_connect(const char *devname, int debug)
+static void fail_requests(dyio_t *d)
 {
-    dyio_t *d;
+    dyio_request_t *r;
+    unsigned seq;
+    int lane;
 
-    /* Open serial port */
-    d = _dyio_serial_open(devname, 115200);
-    if (! d) {
-        /* Failed to open serial port. */
+    for (seq=d->head; seq!=d->tail; seq++) {
+        r = &d->queue[seq % MAX_INFLIGHT];
+        if (r->state == REQ_SENT || r->state == REQ_WAITING) {
+            r->state = REQ_FAILED;
+            r->reply_len = 0;
+        }
+    }
+    d->inflight = 0;
+    d->waiting = 0;
+    for (lane=0; lane<NUM_LANES; lane++)
+        d->lane[lane].waiting = 0;
+    _dyio_wakeup(d);
+}
+
+/*
+ * Check whether the request is finished, and not yet collected.
+ */
+static int req_finished(dyio_request_t *r)
+{
+    return r->state == REQ_DONE || r->state == REQ_TIMEOUT ||
+           r->state == REQ_FAILED;
+}
+
+/*
+ * Get status of the finished request.
+ */
+static int req_status(dyio_request_t *r)
+{
+    switch (r->state) {
+    case REQ_TIMEOUT: return DYIO_ETIMEOUT;
+    case REQ_FAILED:  return DYIO_ELINK;
+    default:          return 0;
+    }
+}
+
+/*
+ * Handle requests, which have not got a reply until deadline:
+ * send them again while retries remain, otherwise complete
+ * them with timeout status. Free the slots of abandoned requests,
+ * when their replies did not come.
+ * Must be called with the device locked.
+ */
+static void check_deadlines(dyio_t *d)
+{
+    unsigned long long now = _dyio_usec();
+    dyio_request_t *r;
+    unsigned seq;
+    int resent = 0, expired = 0;
+
+    if (d->broken && d->inflight + d->waiting > 0)
+        fail_requests(d);
+
+    for (seq=d->head; seq!=d->tail; seq++) {
+        r = &d->queue[seq % MAX_INFLIGHT];
+        if (r->state == REQ_LATE && (d->broken || now >= r->deadline)) {
+            /* No late reply: the slot is free. */
+            release_request(d, r);
+            expired++;
+            continue;
+        }
+        if (r->state != REQ_SENT || now < r->deadline)
+            continue;
+
+        if (r->stat >= 0)
+            d->stats[r->stat].timeouts++;
+        if (r->retries > 0) {
+            if (d->debug)
+                printf("dyio: no reply '%.4s', send again\n", r->rpc);
+            if (r->stat >= 0)
+                d->stats[r->stat].resends++;
+            r->retries--;
+            r->resent++;
+            r->deadline = now + r->timeout;
+            send_request(d, r);
+            resent++;
+        } else {
+            if (d->debug)
+                printf("dyio: no reply '%.4s', timeout\n", r->rpc);
+            expire_request(d, r);
+            expired++;
+        }
+    }
+    if (expired)
+        resent += start_waiting(d);
+    if (resent)
+        flush_tx(d);
+    if (expired)
+        _dyio_wakeup(d);
+}
+
+/*
+ * Receive one packet: attach the reply to the matching request,
+ * or pass the asynchronous packet to user callbacks.
+ * Requests with damaged replies are sent again, as soon as
+ * a later reply arrives. Requests without replies are handled
+ * by the waiters, see check_deadlines().
+ * Queued frames are sent first: no reply comes for them otherwise.
+ * Must be called with the device locked.
+ * Return 1 when a packet was processed, or 0 when nothing was
+ * received until deadline.
+ */
+int _dyio_receive(dyio_t *d, unsigned long long deadline)
+{
+    struct dyio_header hdr;
+    uint8_t buf[256];
+    dyio_request_t *r;
+    int len, status, n;
+
+    for (;;) {
+        if (d->txlen > 0)
+            flush_tx(d);
+        _dyio_unlock(d);
+        status = receive_packet(d, &hdr, buf, &len, deadline);
+        _dyio_lock(d);
+
+        if (status != 0) {
+            if (d->broken && d->inflight + d->waiting > 0)
+                fail_requests(d);
+            return 0;
+        }
+
+        memcpy(d->reply_mac, hdr.mac, sizeof(hdr.mac));
+
+        if (hdr.type == PKT_ASYNC) {
+            _dyio_dispatch_async(d, hdr.id & ~ID_RESPONSE,
+                (char*) hdr.rpc, buf, len);
+            return 1;
+        }
+
+        if (! (hdr.id & ID_RESPONSE)) {
+            printf("dyio: incorrect response flag\n");
+            continue;
+        }
+
+        r = match_reply(d, &hdr, buf, len);
+        if (! r) {
+            if (d->debug)
+                printf("dyio: unexpected reply '%c%c%c%c'\n",
+                    hdr.rpc[0], hdr.rpc[1], hdr.rpc[2], hdr.rpc[3]);
+            continue;
+        }
+        if (r->state == REQ_LATE) {
+            if (d->debug)
+                printf("dyio: late reply '%.4s' dropped\n", r->rpc);
+            release_request(d, r);
+            _dyio_wakeup(d);
+            continue;
+        }
+        if (r->sink && len > r->sink_skip) {
+            /* Payload goes directly to the buffer of the caller. */
+            n = len - r->sink_skip;
+            if (n > r->sink->max - r->sink->len)
+                n = r->sink->max - r->sink->len;
+            memcpy(r->sink->buf + r->sink->len, buf + r->sink_skip, n);
+            r->sink->len += n;
+            len = r->sink_skip;
+        }
+        memcpy(r->reply, buf, len + 1);
+        r->reply_len = len;
+        r->state = REQ_DONE;
+        d->inflight--;
+        _dyio_stat_reply(d, r, sizeof(hdr) + len + 1);
+        resend_lost(d, r);
+        if (start_waiting(d))
+            flush_tx(d);
+        _dyio_wakeup(d);
+        return 1;
+    }
+}
+
+/*
+ * Send the command sequence without waiting for a response.
+ * Return a tag for dyio_wait_reply(), or -1 on error.
+ */
+int dyio_queue_call(dyio_t *d, int type, int namespace, char *rpc, uint8_t *data, int datalen)
+{
+    return _dyio_queue_sink(d, type, namespace, rpc, data, datalen, 0, 0, 0);
+}
+
+/*
+ * Send the request of a pipelined sequence, with its own window.
+ * Return a tag for dyio_wait_reply(), or -1 on error.
+ */
+int dyio_pipe_call(dyio_t *d, int window, int type, int namespace, char *rpc,
+    uint8_t *data, int datalen)
+{
+    return _dyio_queue_sink(d, type, namespace, rpc, data, datalen, 0, 0, window);
+}
+
+/*
+ * Allocate a slot for the request, and send it when the window
+ * has room. Otherwise it waits for the replies of older requests.
+ * Must be called with the device locked, and a free slot.
+ * Return the tag: sequence number, kept non-negative.
+ */
+static int new_request(dyio_t *d, int type, int namespace, char *rpc,
+    uint8_t *data, int datalen, dyio_sink_t *sink, int skip, int window,
+    dyio_complete_t *func, void *arg)
+{
+    dyio_request_t *r;
+    unsigned tag;
+
+    tag = d->tail++;
+    r = &d->queue[tag % MAX_INFLIGHT];
+    r->type = type;
+    r->lane = _dyio_type_lane(type);
+    r->id = namespace;
+    memcpy(r->rpc, rpc, sizeof(r->rpc));
+    if (datalen > 0)
+        memcpy(r->data, data, datalen);
+    r->datalen = datalen;
+    r->reply_len = 0;
+    r->deadline = 0;
+    r->stat = _dyio_stat_index(d, namespace, rpc, 1);
+    r->usec = _dyio_usec();
+    r->timeout = d->timeout;
+    r->retries = may_resend(r) ? d->retries : 0;
+    r->sink = sink;
+    r->sink_skip = skip;
+    r->window = window;
+    r->complete = func;
+    r->complete_arg = arg;
+    if (r->stat >= 0)
+        d->stats[r->stat].calls++;
+
+    if (d->broken) {
+        r->state = REQ_FAILED;
+    } else if (! lane_blocked(d, r->lane, window, r->usec)) {
+        start_request(d, r);
+    } else {
+        r->state = REQ_WAITING;
+        d->waiting++;
+        d->lane[r->lane].waiting++;
+    }
+    return tag & TAG_MASK;
+}
+
+/*
+ * Queue a request, with the payload of reply stored into the sink.
+ */
+int _dyio_queue_sink(dyio_t *d, int type, int namespace, char *rpc,
+    uint8_t *data, int datalen, dyio_sink_t *sink, int skip, int window)
+{
+    int tag, lane = _dyio_type_lane(type);
+
+    if (datalen < 0 || datalen > 251) {
+        fprintf(stderr, "dyio: too long request '%.4s': %u bytes\n", rpc, datalen);
+        return -1;
+    }
+
+    /* Wait for a room in the window, after older waiting requests
+     * of the same or higher priority. */
+    _dyio_lock(d);
+    for (;;) {
+        start_waiting(d);
+        if (! lane_blocked(d, lane, window, _dyio_usec()) &&
+            ! (d->tail - d->head >= MAX_INFLIGHT &&
+               d->queue[d->head % MAX_INFLIGHT].state == REQ_LATE))
+            break;
+        flush_tx(d);
+        _dyio_wait(d, next_deadline(d, 0));
+        check_deadlines(d);
+    }
+
+    if (d->tail - d->head >= MAX_INFLIGHT) {
+        fprintf(stderr, "dyio: too many uncollected replies\n");
+        _dyio_unlock(d);
+        return DYIO_EBUSY;
+    }
+    tag = new_request(d, type, namespace, rpc, data, datalen, sink, skip,
+        window, 0, 0);
+    _dyio_unlock(d);
+    return tag;
+}
+
+/*
+ * Queue a request without blocking, with a completion callback.
+ */
+int dyio_submit(dyio_t *d, int type, int namespace, char *rpc,
+    uint8_t *data, int datalen, dyio_complete_t *func, void *arg)
+{
+    int tag;
+
+    if (datalen < 0 || datalen > 251) {
+        fprintf(stderr, "dyio: too long request '%.4s': %u bytes\n", rpc, datalen);
+        return -1;
+    }
+    _dyio_lock(d);
+    if (d->tail - d->head >= MAX_INFLIGHT) {
+        _dyio_unlock(d);
+        return DYIO_EBUSY;
+    }
+    tag = new_request(d, type, namespace, rpc, data, datalen, 0, 0, 0, func, arg);
+    _dyio_unlock(d);
+    return tag;
+}
+
+/*
+ * Call completion callbacks of finished requests.
+ * The device is unlocked while the callback runs, so it can
+ * submit new requests. Then the scan starts again.
+ * Must be called with the device locked.
+ * Return number of callbacks called.
+ */
+static int run_completions(dyio_t *d)
+{
+    dyio_request_t *r;
+    dyio_complete_t *func;
+    void *arg;
+    unsigned seq;
+    int status, count = 0;
+
+    for (seq=d->head; seq!=d->tail; seq++) {
+        r = &d->queue[seq % MAX_INFLIGHT];
+        if (! r->complete || ! req_finished(r))
+            continue;
+
+        status = req_status(r);
+        func = r->complete;
+        arg = r->complete_arg;
+        memcpy(d->reply, r->reply, r->reply_len + 1);
+        d->reply_len = r->reply_len;
+        r->complete = 0;
+        release_request(d, r);
+
+        _dyio_unlock(d);
+        func(d, seq & TAG_MASK, status, arg);
+        _dyio_lock(d);
+        count++;
+        seq = d->head - 1;
+    }
+    return count;
+}
+
+/*
+ * Do all work, possible without blocking.
+ */
+int dyio_process_io(dyio_t *d)
+{
+    int count;
+
+    _dyio_lock(d);
+    flush_tx(d);
+
+    /* Receive replies, which are already available.
+     * With the background reader, it does the receiving. */
+    if (! _dyio_reader_running(d)) {
+        while (_dyio_receive(d, _dyio_usec()))
+            continue;
+    }
+    check_deadlines(d);
+    if (start_waiting(d))
+        flush_tx(d);
+    count = run_completions(d);
+    flush_tx(d);
+    _dyio_unlock(d);
+    return count;
+}
+
+/*
+ * Get the descriptor of the link.
+ */
+int dyio_get_fd(dyio_t *d)
+{
+    if (! d->transport->get_fd)
+        return -1;
+    return d->transport->get_fd(d);
+}
+
+/*
+ * Get time until the nearest deadline of requests in flight.
+ */
+int dyio_io_timeout(dyio_t *d)
+{
+    unsigned long long deadline, now = _dyio_usec();
+    dyio_request_t *r;
+    unsigned seq;
+    int msec = -1;
+
+    _dyio_lock(d);
+    for (seq=d->head; seq!=d->tail; seq++) {
+        r = &d->queue[seq % MAX_INFLIGHT];
+        if (r->complete && req_finished(r)) {
+            /* Callbacks are ready to run. */
+            msec = 0;
+            break;
+        }
+    }
+    if (msec < 0 && d->txlen > 0)
+        msec = 0;
+    for (seq=d->head; msec < 0 && seq!=d->tail; seq++) {
+        r = &d->queue[seq % MAX_INFLIGHT];
+        if (r->state == REQ_WAITING && lane_ready(d, r->lane, r->window, now))
+            msec = 0;
+    }
+    if (msec < 0 && d->head != d->tail) {
+        deadline = next_deadline(d, 0);
+        if (deadline)
+            msec = (deadline > now) ? (deadline - now + 999) / 1000 : 0;
+    }
+    _dyio_unlock(d);
+    return msec;
+}
+
+/*
+ * Wait for a response to the queued request, until the given
+ * absolute time in microseconds, or without limit when deadline is 0.
+ * A negative tag is an error of queueing: it is returned as is.
+ * Return 0 on success, or a negative error code.
+ */
+int dyio_wait_reply_until(dyio_t *d, int tag, unsigned long long deadline)
+{
+    dyio_request_t *r = &d->queue[(unsigned)tag % MAX_INFLIGHT];
+    int status;
+
+    if (tag < 0)
+        return tag;
+    _dyio_lock(d);
+    if ((((unsigned)tag - d->head) & TAG_MASK) >= d->tail - d->head ||
+        r->state == REQ_FREE || r->state == REQ_LATE) {
+        fprintf(stderr, "dyio: no request with tag %u\n", tag);
+        _dyio_unlock(d);
+        return -1;
+    }
+    while (r->state == REQ_SENT || r->state == REQ_WAITING) {
+        if (deadline && _dyio_usec() >= deadline) {
+            /* Give up: a late reply will be dropped. */
+            if (r->state == REQ_WAITING) {
+                d->waiting--;
+                d->lane[r->lane].waiting--;
+                d->inflight++;
+            }
+            expire_request(d, r);
+            start_waiting(d);
+            break;
+        }
+        start_waiting(d);
+        flush_tx(d);
+        _dyio_wait(d, next_deadline(d, deadline));
+        check_deadlines(d);
+    }
+    status = req_status(r);
+
+    memcpy(d->reply, r->reply, r->reply_len + 1);
+    d->reply_len = r->reply_len;
+    release_request(d, r);
+    _dyio_unlock(d);
+    return status;
+}
+
+/*
+ * Wait for a response to the queued request.
+ * Return 0 on success, or a negative error code.
+ */
+int dyio_wait_reply(dyio_t *d, int tag)
+{
+    return dyio_wait_reply_until(d, tag, 0);
+}
+
+/*
+ * Send the command sequence and get back a response.
+ * Return 0 on success, or a negative error code.
+ */
+int dyio_call(dyio_t *d, int type, int namespace, char *rpc, uint8_t *data, int datalen)
+{
+#if !defined(__WIN32__) && !defined(WIN32)
+    if (d->shared) {
+        /* The link is safe, but d->reply is shared by all threads. */
+        return _dyio_shared_call(d, type, namespace, rpc, data, datalen,
+            d->reply, &d->reply_len);
+    }
+#endif
+    return dyio_wait_reply(d, dyio_queue_call(d, type, namespace, rpc, data, datalen));
+}
+
+/*
+ * Send the command sequence, and copy the response
+ * into the buffer of the caller.
+ */
+int dyio_call_reply(dyio_t *d, int type, int namespace, char *rpc,
+    uint8_t *data, int datalen, uint8_t *reply, int *reply_len)
+{
+    int status;
+
+#if !defined(__WIN32__) && !defined(WIN32)
+    if (d->shared)
+        return _dyio_shared_call(d, type, namespace, rpc, data, datalen,
+            reply, reply_len);
+#endif
+    status = dyio_call(d, type, namespace, rpc, data, datalen);
+    memcpy(reply, d->reply, d->reply_len + 1);
+    *reply_len = d->reply_len;
+    return status;
+}
+
+/*
+ * Set time to wait for every reply, in microseconds,
+ * and number of retries before the call fails with timeout.
+ * Only queries are sent again.
+ */
+void dyio_set_timeout(dyio_t *d, unsigned long usec, int retries)
+{
+    _dyio_lock(d);
+    d->timeout = usec;
+    d->retries = (retries > 0) ? retries : 0;
+    _dyio_unlock(d);
+}
+
+/*
+ * Get current time in microseconds, from a monotonic clock.
+ */
+unsigned long long dyio_usec()
+{
+    return _dyio_usec();
+}
+
+/*
+ * Send all queued frames to the device.
+ */
+void dyio_flush(dyio_t *d)
+{
+    _dyio_lock(d);
+    flush_tx(d);
+    _dyio_unlock(d);
+}
+
+/*
+ * Set max number of requests in flight.
+ */
+void dyio_set_window(dyio_t *d, int window)
+{
+    if (window < 1)
+        window = 1;
+    if (window > MAX_INFLIGHT)
+        window = MAX_INFLIGHT;
+    _dyio_lock(d);
+    d->window = window;
+    _dyio_unlock(d);
+}
+
+/*
+ * Limit the rate of requests of the lane.
+ */
+void dyio_set_rate(dyio_t *d, int type, int rate)
+{
+    int lane = _dyio_type_lane(type);
+
+    _dyio_lock(d);
+    d->lane[lane].period = (rate > 0) ? 1000000 / rate : 0;
+    if (start_waiting(d))
+        flush_tx(d);
+    _dyio_unlock(d);
+}
+
+/*
+ * Get current time of monotonic clock, in microseconds.
+ */
+unsigned long long _dyio_usec()
+{
+#if defined(__WIN32__) || defined(WIN32)
+    return GetTickCount64() * 1000ULL;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+}
+
+/*
+ * Send a stream of pings through the request queue, with the given
+ * window, and wait for all replies.
+ * Return the throughput in bytes per second, or 0 when the link failed.
+ */
+static long probe_link(dyio_t *d, int count, int window)
+{
+    int tag[MAX_INFLIGHT], i, failed = 0;
+    long nbytes = 0;
+    unsigned long long usec;
+
+    usec = _dyio_usec();
+    for (i=0; i<count+window; i++) {
+        if (i >= window) {
+            /* Collect the reply of an older ping. */
+            int t = tag[i % window];
+            if (t < 0 || dyio_wait_reply(d, t) < 0)
+                failed = 1;
+        }
+        if (i < count) {
+            tag[i % window] = failed ? -1 :
+                dyio_pipe_call(d, window, PKT_GET, ID_BCS_CORE, "_png", 0, 0);
+
+            /* Ping and its reply: header and checksum. */
+            nbytes += 2 * (sizeof(struct dyio_header) + 1);
+        }
+    }
+    if (failed)
         return 0;
+    usec = _dyio_usec() - usec;
+    return nbytes * 1000000LL / (usec ? usec : 1);
+}
+
+/*
+ * Find the fastest speed, the link sustains.
+ * The device side must follow the line rate: USB CDC, or autobaud.
+ * Return the selected baud rate.
+ */
+int dyio_probe_speed(dyio_t *d, int baud)
+{
+    static const int speed[] = {
+        4000000, 3000000, 2000000, 1500000, 1000000,
+        921600, 460800, 230400, 115200, 0
+    };
+    long rate, best_rate = 0;
+    int i, best = 0;
+
+    if (! d->transport->set_baud) {
+        /* No line speed: loopback, socket or replay. */
+        return baud;
+    }
+    for (i=0; speed[i]; i++) {
+        if (d->transport->set_baud(d, speed[i]) < 0)
+            continue;
+        rate = probe_link(d, 256, 16);
+        if (d->debug)
+            printf("dyio-probe: %d baud: %ld bytes/sec\n", speed[i], rate);
+        if (rate > best_rate) {
+            best_rate = rate;
+            best = speed[i];
+        }
     }
 
+    /* When nothing works, restore the original speed. */
+    if (! best)
+        best = baud;
+    d->transport->set_baud(d, best);
+    return best;
+}
+
+/*
+ * Fill the options with default values.
+ */
+void dyio_init_opts(dyio_opts_t *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->baud = 115200;
+    opts->vmin = 1;
+    opts->vtime = 0;
+}
+
+/*
+ * Initialize the device object and ping the device.
+ */
+static int setup(dyio_t *d, const dyio_opts_t *opts)
+{
+    const char *capture = getenv("DYIO_CAPTURE");
+
     /*  debug option. */
-    d->debug = debug;
+    d->debug = opts->debug;
+    d->window = 1;
+    d->timeout = 1000000;
+    d->retries = 1;
+
+    /* Select the link speed. */
+    if (opts->probe && d->transport->set_baud) {
+        int baud = dyio_probe_speed(d, opts->baud);
+        if (d->debug)
+            printf("dyio-connect: %d baud\n", baud);
+    }
+
+    /* Capture all traffic when requested. */
+    if (capture && ! d->replay)
+        dyio_capture_start(d, capture);
 
     /* Ping the device. */
-    dyio_call(d, PKT_GET, ID_BCS_CORE, "_png", 0, 0);
+    if (dyio_call(d, PKT_GET, ID_BCS_CORE, "_png", 0, 0) < 0) {
+        fprintf(stderr, "dyio: device is not responding\n");
+        return -1;
+    }
+
+    /* Load descriptors of this device. */
+    _dyio_load_cache(d);
     if (d->debug)
         printf("dyio-connect: OK\n");
+    return 0;
+}
+
+/*
+ * Establish a connection to the DyIO device, with given options.
+ */
+dyio_t *dyio_connect_opts(const char *devname, const dyio_opts_t *opts)
+{
+    dyio_t *d;
+
+    /* Select the transport by prefix of the name. */
+#if !defined(__WIN32__) && !defined(WIN32)
+    if (strncmp(devname, "loop:", 5) == 0)
+        d = _dyio_loop_open(devname, opts);
+    else if (strncmp(devname, "unix:", 5) == 0 ||
+             strncmp(devname, "tcp:", 4) == 0)
+        d = _dyio_socket_open(devname, opts);
+    else
+#endif
+        d = _dyio_serial_open(devname, opts);
+    if (! d) {
+        /* Failed to open the link. */
+        return 0;
+    }
+    if (setup(d, opts) < 0) {
+        dyio_close(d);
+        return 0;
+    }
+    return d;
+}
+
+/*
+ * Establish a connection to the DyIO device.
+ */
+dyio_t *dyio_connect(const char *devname, int debug)
+{
+    dyio_opts_t opts;
+
+    dyio_init_opts(&opts);
+    opts.debug = debug;
+    return dyio_connect_opts(devname, &opts);
+}
+
+/*
+ * Replay the traffic from a capture file, instead of the real device.
+ */
+dyio_t *dyio_replay(const char *filename, int debug)
+{
+    dyio_opts_t opts;
+    dyio_t *d;
+
+    d = _dyio_replay_open(filename);
+    if (! d)
+        return 0;
+    dyio_init_opts(&opts);
+    opts.debug = debug;
+    if (setup(d, &opts) < 0) {
+        dyio_close(d);
+        return 0;
+    }
     return d;
 }
 
@@ -199,5 +1315,13 @@ dyio_t *dyio_connect(const char *devname, int debug)
  */
 void dyio_close(dyio_t *d)
 {
-    _dyio_serial_close(d);
+    dyio_play_stop(d, 0);
+#if !defined(__WIN32__) && !defined(WIN32)
+    _dyio_close_shared(d);
+#endif
+    _dyio_close_reader(d);
+    free(d->samples);
+    free(d->rpc_table);
+    dyio_capture_stop(d);
+    d->transport->close(d);
 }
@@ -8,51 +8,698 @@
  */
 
 #define MAX_CHANNELS    64          /* Max channels per device */
+#define MAX_INFLIGHT    64          /* Max pipelined requests per device */
+#define TXBUF_SIZE      4096        /* Size of transmit buffer */
+#define NUM_LANES       4           /* Priority lanes of requests */
+#define RXBUF_SIZE      4096        /* Size of receive buffer */
 
 /*
- * Data structure describing a connection to a DyIO device.
+ * Caller's buffer, which receives payload of replies directly,
+ * see _dyio_queue_sink(). Replies are appended in order of arrival.
+ */
+typedef struct {
+    unsigned char   *buf;           /* Buffer of the caller */
+    int             len;            /* Bytes already stored */
+    int             max;            /* Size of buffer */
+} dyio_sink_t;
+
+typedef struct _dyio_t dyio_t;
+typedef void dyio_complete_t(dyio_t *d, int tag, int status, void *arg);
+
+/*
+ * Request, queued by dyio_queue_call() and waiting for the reply.
+ */
+typedef struct {
+    int             state;          /* REQ_FREE, REQ_SENT, REQ_DONE, ... */
+    unsigned char   type;           /* Packet type */
+    unsigned char   lane;           /* Priority lane, LANE_xxx */
+    unsigned char   id;             /* Namespace index */
+    char            rpc[4];         /* RPC call identifier */
+    unsigned char   data[256];      /* Query, kept for retransmission */
+    int             datalen;        /* Query length */
+    unsigned char   reply[256];     /* Bytes of reply */
+    int             reply_len;      /* Number of bytes */
+    unsigned        order;          /* Order of sending */
+    int             stat;           /* Index of statistics entry, or -1 */
+    unsigned long long usec;        /* Time of queueing */
+    unsigned long long sent;        /* Time of first sending */
+    int             resent;         /* Number of times sent again */
+    unsigned long   timeout;        /* Time to wait for reply, usec */
+    int             retries;        /* Retries left */
+    unsigned long long deadline;    /* Time to send again or give up */
+    dyio_sink_t     *sink;          /* Destination of reply payload, or 0 */
+    int             sink_skip;      /* Reply bytes kept before the payload */
+    int             window;         /* Window of the sequence, or 0 */
+    dyio_complete_t *complete;      /* Completion callback, see dyio_submit() */
+    void            *complete_arg;  /* Argument of callback */
+} dyio_request_t;
+
+#define REQ_FREE        0           /* Slot is not used */
+#define REQ_SENT        1           /* Query sent, waiting for reply */
+#define REQ_DONE        2           /* Reply received, not yet collected */
+#define REQ_TIMEOUT     3           /* No reply until deadline, not yet collected */
+#define REQ_WAITING     4           /* Not yet sent: the window is full */
+#define REQ_FAILED      5           /* Link is broken, not yet collected */
+#define REQ_LATE        6           /* Collected after timeout, reply may come */
+
+/*
+ * Priority lanes, by packet type. Waiting requests of a higher
+ * priority lane are sent first; order is kept within a lane.
+ */
+#define LANE_CRITICAL   0           /* PKT_CRITICAL: may exceed the window by one */
+#define LANE_STATUS     1           /* PKT_STATUS */
+#define LANE_POST       2           /* PKT_POST */
+#define LANE_GET        3           /* PKT_GET: bulk polling */
+
+/*
+ * Error codes. Calls return -1 on invalid arguments or when
+ * the reply cannot be decoded.
+ */
+#define DYIO_ETIMEOUT   (-2)        /* No reply until deadline */
+#define DYIO_EBUSY      (-3)        /* No free slot for a request */
+#define DYIO_ELINK      (-4)        /* Link to the device is broken */
+
+#define DYIO_STREAM_FRAME 249       /* Max data bytes in strm frame */
+#define DYIO_STREAM_WINDOW 8        /* Min strm frames in flight */
+
+#define MAX_NAMESPACES  16          /* Max namespaces per device */
+
+/*
+ * Asynchronous packet, passed to user callback.
+ */
+typedef struct {
+    int             namespace;      /* Namespace index */
+    char            rpc[4];         /* RPC call identifier */
+    int             ch;             /* Channel number, or -1 */
+    int             value;          /* Channel value, when ch >= 0 */
+    unsigned char   *data;          /* Bytes of the packet */
+    int             datalen;        /* Number of bytes */
+} dyio_event_t;
+
+/*
+ * Channel sample, received asynchronously.
+ */
+typedef struct {
+    int             ch;             /* Channel number */
+    int             value;          /* Channel value */
+    unsigned long long usec;        /* Host monotonic time, microseconds */
+} dyio_sample_t;
+
+/*
+ * Descriptor of a method, as reported by bcs.rpc namespace.
+ */
+#define MAX_METHODS     128         /* Max methods per device */
+#define MAX_ARGS        16          /* Max arguments per method */
+
+typedef struct {
+    unsigned char   ns;             /* Namespace index */
+    char            rpc[4];         /* RPC call identifier */
+    unsigned char   query_type;     /* Packet type of query */
+    unsigned char   nargs;          /* Number of query arguments */
+    unsigned char   args[MAX_ARGS]; /* Types of query arguments */
+    unsigned char   resp_type;      /* Packet type of response */
+    unsigned char   nresp;          /* Number of response values */
+    unsigned char   resp[MAX_ARGS]; /* Types of response values */
+} dyio_method_t;
+
+/*
+ * Table of namespaces and methods of the device.
+ */
+typedef struct {
+    unsigned char   mac[6];         /* Address of the device */
+    unsigned char   rev[6];         /* Firmware revision, from _rev */
+    int             verified;       /* Revision checked with the device */
+    int             num_spaces;     /* Number of namespaces */
+    char            space_name[MAX_NAMESPACES][64];
+    int             num_methods;    /* Number of methods */
+    dyio_method_t   method[MAX_METHODS];
+} dyio_rpc_table_t;
+
+/*
+ * Statistics of one method.
+ */
+#define MAX_STATS       64          /* Max methods with statistics */
+#define STAT_BUCKETS    24          /* Histogram buckets, log2 of microseconds */
+
+typedef struct {
+    unsigned char   ns;             /* Namespace index */
+    char            rpc[4];         /* RPC call identifier */
+    unsigned long   calls;          /* Number of requests */
+    unsigned long   bytes_tx;       /* Bytes sent, including resends */
+    unsigned long   bytes_rx;       /* Bytes received */
+    unsigned long   bad_sums;       /* Replies with bad data sum */
+    unsigned long   resends;        /* Requests sent again */
+    unsigned long   timeouts;       /* Requests in flight on timeout */
+    unsigned long   retried;        /* Replies after resend, not in latency */
+    unsigned long   max_usec;       /* Max round-trip time */
+    unsigned long long total_usec;  /* Sum of round-trip times */
+    unsigned long   hist[STAT_BUCKETS]; /* Histogram of round-trip times */
+} dyio_stat_t;
+
+/*
+ * Options of connection, see dyio_connect_opts().
+ */
+typedef struct {
+    int             debug;          /* Trace the protocol */
+    int             baud;           /* Line speed, bits per second */
+    int             vmin;           /* Min bytes for read: termios VMIN */
+    int             vtime;          /* Read timeout in 0.1 sec: termios VTIME */
+    int             low_latency;    /* Set ASYNC_LOW_LATENCY (Linux) */
+    int             busy_poll;      /* Spin on non-blocking read up to 50 usec, then select */
+    int             probe;          /* Find the fastest speed, the link sustains */
+} dyio_opts_t;
+
+/*
+ * Setpoint of a trajectory, see dyio_play().
+ */
+typedef struct {
+    unsigned long   msec;           /* Time from start of the trajectory */
+    int             ch;             /* Channel number */
+    int             value;          /* Value of the channel at this time */
+} dyio_setpoint_t;
+
+/*
+ * Statistics of the trajectory player.
  */
 typedef struct {
+    unsigned long   ticks;          /* Frames sent */
+    unsigned long   overruns;       /* Ticks missed */
+    unsigned long   lost;           /* Frames without reply until next tick */
+    unsigned long   max_late;       /* Max lateness of a tick, usec */
+} dyio_play_stats_t;
+
+/*
+ * Configuration of a PID group, see dyio_set_pid_config().
+ */
+typedef struct {
+    int             group;          /* Group number */
+    int             enabled;        /* Control loop is running */
+    int             inverted;       /* Output is inverted */
+    int             async;          /* Report position asynchronously */
+    double          kp, ki, kd;     /* Gains, with 0.01 resolution */
+    int             latch;          /* Position, set on the index pulse */
+    int             use_latch;      /* Use the index latch */
+    int             stop_on_latch;  /* Stop at the index pulse */
+    double          stop;           /* Output value to stop the motor */
+    double          upper;          /* Upper limit of the output */
+    double          lower;          /* Lower limit of the output */
+} dyio_pid_config_t;
+
+/*
+ * State of the device, exported by dyiod daemon in shared memory.
+ * The daemon increments seq before and after every update,
+ * so it is odd while the state is being written.
+ */
+typedef struct {
+    unsigned        magic;          /* DYIOD_MAGIC */
+    unsigned        seq;            /* Sequence lock */
+    unsigned long long usec;        /* Time of last update */
+    unsigned long   updates;        /* Number of updates */
+    unsigned long   requests;       /* Client requests served */
+    unsigned long   batches;        /* Writes to the device */
+    int             clients;        /* Clients connected */
+    int             num_channels;   /* Number of channels */
+    unsigned char   mode[MAX_CHANNELS]; /* Channel modes */
+    int             value[MAX_CHANNELS]; /* Channel values */
+} dyio_state_t;
+
+#define MAX_GROUP       64          /* Max devices in a group */
+
+/*
+ * Latency of one device in a group, see dyio_group_stat().
+ */
+typedef struct {
+    unsigned long   calls;          /* Calls with reply */
+    unsigned long   timeouts;       /* Calls without reply */
+    unsigned long   errors;         /* Calls failed otherwise: broken link, bad reply */
+    unsigned long   last_usec;      /* Round-trip time of last call */
+    unsigned long   min_usec;       /* Min round-trip time */
+    unsigned long   max_usec;       /* Max round-trip time */
+    unsigned long long total_usec;  /* Sum of round-trip times */
+} dyio_group_stat_t;
+
+#define DYIOD_MAGIC     0x44796f64  /* "Dyod" */
+#define DYIOD_SOCKET    "/tmp/dyiod.%s" /* Unix socket of daemon */
+#define DYIOD_SHM       "/dyiod.%s" /* Shared memory of daemon */
+
+/*
+ * Message from a client to dyiod daemon: one RPC call.
+ */
+typedef struct {
+    unsigned char   type;           /* Packet type */
+    unsigned char   id;             /* Namespace index */
+    char            rpc[4];         /* RPC call identifier */
+    unsigned char   datalen;        /* Query length */
+    unsigned char   data[255];      /* Query */
+} dyio_client_query_t;
+
+/*
+ * Reply of dyiod daemon to the client.
+ */
+typedef struct {
+    int             status;         /* 0, DYIO_ETIMEOUT or -1 */
+    int             reply_len;      /* Number of bytes */
+    unsigned char   reply[256];     /* Bytes of reply */
+} dyio_client_reply_t;
+
+typedef struct _dyio_client_t dyio_client_t;
+typedef struct _dyio_group_t dyio_group_t;
+typedef struct _dyio_player_t dyio_player_t;
+typedef struct _dyio_capture_t dyio_capture_t;
+typedef struct _dyio_replay_t dyio_replay_t;
+typedef void dyio_callback_t(dyio_t *d, dyio_event_t *ev, void *arg);
+
+/*
+ * Transport: the link to the device.
+ * Serial port, replay of capture, loopback to a software model,
+ * or a socket.
+ */
+typedef struct {
+    const char      *name;
+    int (*write)(dyio_t *d, unsigned char *data, int len);
+    int (*read)(dyio_t *d, unsigned char *data, int len, unsigned long usec);
+    int (*set_baud)(dyio_t *d, int baud_rate); /* Or 0, when no line speed */
+    void (*close)(dyio_t *d);       /* Close the link and free the object */
+    int (*get_fd)(dyio_t *d);       /* Or 0, when nothing to poll */
+} dyio_transport_t;
+
+typedef struct {
+    dyio_callback_t *func;          /* User function */
+    void            *arg;           /* User argument */
+} dyio_handler_t;
+
+/*
+ * Data structure describing a connection to a DyIO device.
+ */
+struct _dyio_t {
     /* User visible part. */
     unsigned char   mac[6];         /* Inique address of the device */
     unsigned char   reply[256];     /* Bytes of last reply */
     int             reply_len;      /* Number of bytes */
     unsigned char   reply_mac[6];   /* Address extracted from reply */
     int             debug;          /* Trace USB protocol */
+    int             num_channels;   /* Number of channels, or 0 when unknown */
+
+    /* Pipelined requests, see dyio_queue_call(). */
+    int             window;         /* Max number of requests in flight */
+    int             inflight;       /* Number of requests in REQ_SENT state */
+    int             waiting;        /* Number of requests in REQ_WAITING state */
+    unsigned        head;           /* Sequence number of oldest request */
+    unsigned        tail;           /* Sequence number of next request */
+    dyio_request_t  queue[MAX_INFLIGHT];
+    unsigned char   txbuf[TXBUF_SIZE]; /* Frames, not yet sent */
+    int             txlen;          /* Number of bytes in txbuf */
+    unsigned        order;          /* Counter of sent requests */
+    int             broken;         /* Link failed: calls return DYIO_ELINK */
+    struct {
+        int         waiting;        /* Requests in REQ_WAITING state */
+        unsigned long period;       /* Min interval of requests, usec, or 0 */
+        unsigned long long next;    /* Time when next request may go */
+    } lane[NUM_LANES];
+    int             timeouts;       /* Number of requests, failed with timeout */
+    unsigned long   timeout;        /* Time to wait for every reply, usec */
+    int             retries;        /* Number of retries on timeout */
+
+    /* Receive buffer, see receive_packet(). */
+    unsigned char   rxbuf[RXBUF_SIZE]; /* Input bytes, not yet parsed */
+    int             rxpos;          /* Offset of unparsed input */
+    int             rxlen;          /* Number of unparsed bytes */
+    unsigned long   resyncs;        /* Number of damaged frames skipped */
+
+    /* Per-RPC statistics, see dyio_get_stats(). */
+    int             num_stats;      /* Number of entries */
+    dyio_stat_t     stats[MAX_STATS];
+
+    /* Callbacks for asynchronous packets, see dyio_set_callback(). */
+    dyio_handler_t  ns_handler[MAX_NAMESPACES];
+    dyio_handler_t  ch_handler[MAX_CHANNELS];
+    void            *reader;        /* Background reader thread */
+    void            *shared;        /* I/O owner thread, see dyio_start_shared() */
+    void            *samples;       /* Ring of samples, see dyio_enable_samples() */
+    dyio_rpc_table_t *rpc_table;    /* Namespaces and methods, or 0 */
+    unsigned char   rev[6];         /* Firmware revision */
+    int             rev_valid;      /* Revision is known */
+
+    /* Matrix of channel capabilities, see dyio_channel_supports(). */
+    unsigned long   chan_modes[MAX_CHANNELS]; /* Bit mask of supported modes */
+    unsigned char   chan_modes_rev[6]; /* Firmware revision of the matrix */
+    int             chan_modes_count; /* Number of channels in the matrix */
+    int             chan_modes_state; /* 0 - unknown, 1 - from cache, 2 - valid */
+
+    /* Shadow of channel state, see dyio_enable_shadow(). */
+    int             shadow;         /* Shadow is enabled */
+    int             shadow_modes_known; /* Modes are known */
+    unsigned long long shadow_known; /* Bit mask of channels with known values */
+    unsigned char   shadow_mode[MAX_CHANNELS];
+    int             shadow_value[MAX_CHANNELS];
+    unsigned long   frames_saved;   /* Redundant writes, not sent */
+
+    /* Rate of last stream transfer, see dyio_stream_rate(). */
+    unsigned long long stream_bytes; /* Bytes transferred */
+    unsigned long long stream_usec; /* Time of transfer */
+
+    /* Trajectory player, see dyio_play(). */
+    dyio_player_t   *player;
+
+    /* Binary capture and replay of traffic, see dyio_capture_start(). */
+    dyio_capture_t  *capture;       /* Capture buffer, or 0 */
+    dyio_replay_t   *replay;        /* Replay data instead of device, or 0 */
+
+    /* Link to the device. */
+    const dyio_transport_t *transport;
 
     /* Actually more data are allocated.
      * Here comes an OS-dependent stuff, hidden from the user. */
-} dyio_t;
+};
 
 /*
  * Establish a connection to the DyIO device.
+ * Device name selects the transport: "loop:" for the software model
+ * in memory, "unix:path" or "tcp:host:port" for a socket,
+ * otherwise it is the name of a serial port.
  */
 dyio_t *dyio_connect(const char *devname, int debug);
 
+/*
+ * Fill the options with default values: 115200 baud, VMIN=1, VTIME=0.
+ */
+void dyio_init_opts(dyio_opts_t *opts);
+
+/*
+ * Establish a connection to the DyIO device, with given options.
+ */
+dyio_t *dyio_connect_opts(const char *devname, const dyio_opts_t *opts);
+
+/*
+ * Find the fastest speed, the link sustains, by streams of pings.
+ * All speeds from 4 Mbaud down are tried, and the one with the best
+ * throughput is selected: a rate, which loses replies, is not used.
+ * Return the selected baud rate, or the given one when nothing works.
+ */
+int dyio_probe_speed(dyio_t *d, int baud);
+
+/*
+ * Create a device object, which replays the traffic from a capture file.
+ * Replies are fed back in the same order, as received from the device,
+ * and with the same delay after the request, up to the read timeout.
+ * For identical traffic, the disk cache must be in the same state
+ * as at the time of capture.
+ */
+dyio_t *dyio_replay(const char *filename, int debug);
+
 /*
  * Close the connection and deallocate device object.
  */
 void dyio_close(dyio_t *d);
 
+/*
+ * Capture raw sent and received data, with timestamps, to a binary file.
+ * Capture is also started by dyio_connect(), when DYIO_CAPTURE
+ * environment variable contains a file name.
+ * Return 0 on success, -1 on error.
+ */
+int dyio_capture_start(dyio_t *d, const char *filename);
+
+/*
+ * Stop the capture and close the file.
+ */
+void dyio_capture_stop(dyio_t *d);
+
+/*
+ * Calls below return a negative error code on failure:
+ * DYIO_ETIMEOUT when the device did not reply, DYIO_ELINK when
+ * the link is broken, or -1 when the reply cannot be decoded.
+ * The process is never terminated on errors of the device.
+ */
+
 /*
  * Set channel mode.
+ * Return 0 on success, -1 when the mode is not supported
+ * by the channel (then nothing is sent to the device),
+ * or an error code.
+ */
+int dyio_set_mode(dyio_t *d, int ch, int mode);
+
+/*
+ * Check whether the channel supports the given mode.
+ * The matrix of channel capabilities is queried once, or loaded
+ * from the cache file in the same way as dyio_get_rpc_table().
+ * Return 1 or 0, or an error code when the query failed.
+ */
+int dyio_channel_supports(dyio_t *d, int ch, int mode);
+
+/*
+ * Enable (on=1) or disable (on=0) the host-side shadow of channel
+ * modes and output values. The shadow is seeded with gacm and gacv,
+ * and kept current from replies. With the shadow enabled,
+ * dyio_set_mode() and dyio_set_value() skip writes which would not
+ * change anything, and count them in d->frames_saved. Writes with
+ * a nonzero msec are always sent, and the value becomes unknown.
+ * Return 0 on success, or an error code of the seeding.
+ */
+int dyio_enable_shadow(dyio_t *d, int on);
+
+/*
+ * Read current channel value into *value.
+ * Return 0 on success, or a negative error code.
  */
-void dyio_set_mode(dyio_t *d, int ch, int mode);
+int dyio_read_value(dyio_t *d, int ch, int *value);
 
 /*
  * Get current channel value.
+ * Return the value, or an error code. Values of counters can be
+ * negative: use dyio_read_value() to tell them from errors.
  */
 int dyio_get_value(dyio_t *d, int ch);
 
 /*
  * Set channel value.
+ * Return 0 on success, or an error code.
  */
-void dyio_set_value(dyio_t *d, int ch, int value);
+int dyio_set_value(dyio_t *d, int ch, int value);
 
 /*
  * Set channel value with additional timing parameter.
+ * Return 0 on success, or an error code.
+ */
+int dyio_set_value_msec(dyio_t *d, int ch, int value, int msec);
+
+/*
+ * Get current values of several channels.
+ * All requests are pipelined, so it costs about one round-trip.
+ * Return 0 on success, or error code of the first failed channel.
+ */
+int dyio_get_values(dyio_t *d, int nchan, const int *chan, int *value);
+
+/*
+ * Get number of i/o channels.
+ * Return the number, or an error code.
+ */
+int dyio_num_channels(dyio_t *d);
+
+/*
+ * Get current values of all channels, in one request.
+ * Return number of channels, or an error code.
+ */
+int dyio_get_all_values(dyio_t *d, int *value);
+
+/*
+ * Set values of all channels, in one request.
+ * Time in milliseconds is used for servo and counter outputs.
+ * Return 0 on success, or an error code.
+ */
+int dyio_set_all_values(dyio_t *d, int msec, const int *value);
+
+/*
+ * Get current modes of all channels, in one request.
+ * Return number of channels, or an error code.
+ */
+int dyio_get_all_modes(dyio_t *d, int *mode);
+
+/*
+ * Set modes of all channels, in one request.
+ * Use MODE_NO_CHANGE to leave a channel as is.
+ * Return 0 on success, or an error code.
+ */
+int dyio_set_all_modes(dyio_t *d, const int *mode);
+
+/*
+ * Write data to the output stream of the channel: UART transmit,
+ * SPI transmit or PPM configuration. The buffer is split into
+ * strm frames of at most DYIO_STREAM_FRAME bytes, and up to
+ * DYIO_STREAM_WINDOW frames (or the window, when wider) are kept
+ * in flight. Frames are never sent twice, so a lost reply fails
+ * the transfer instead of duplicating data: no more frames are
+ * sent, and the frames in flight are collected.
+ * Return number of bytes in acknowledged frames, or an error code
+ * when nothing was acknowledged.
+ */
+int dyio_stream_write(dyio_t *d, int ch, const unsigned char *buf, int len);
+
+/*
+ * Read data from the input stream of the channel: UART receive,
+ * SPI receive or PPM input. Several strm queries are kept in flight,
+ * and received bytes are stored directly into the buffer.
+ * Return when the buffer has no room for another frame, when
+ * the line becomes idle after some data, or after msec milliseconds.
+ * Length must be at least DYIO_STREAM_FRAME.
+ * Return number of bytes read, or an error code when nothing was read.
+ */
+int dyio_stream_read(dyio_t *d, int ch, unsigned char *buf, int len, int msec);
+
+/*
+ * Get rate of the last stream transfer, in bytes per second.
+ */
+double dyio_stream_rate(dyio_t *d);
+
+/*
+ * Get number of PID groups.
+ * Return the count, or -1 on error.
+ */
+int dyio_pid_count(dyio_t *d);
+
+/*
+ * Get or set configuration of the PID group.
+ * Return 0 on success, or -1 on error.
+ */
+int dyio_get_pid_config(dyio_t *d, int group, dyio_pid_config_t *cfg);
+int dyio_set_pid_config(dyio_t *d, const dyio_pid_config_t *cfg);
+
+/*
+ * Read current position of the PID group into *position.
+ * Return 0 on success, or -1 on error.
+ */
+int dyio_read_pid(dyio_t *d, int group, int *position);
+
+/*
+ * Get current position of the PID group.
+ * Return the position, or -1 on error. Positions can be negative:
+ * use dyio_read_pid() to tell them from errors.
+ */
+int dyio_get_pid(dyio_t *d, int group);
+
+/*
+ * Move the PID group to the setpoint, in given time.
+ * Return 0 on success, or -1 on error.
+ */
+int dyio_set_pid(dyio_t *d, int group, int setpoint, int msec);
+
+/*
+ * Run the PID group at given velocity, for given time.
+ * Return 0 on success, or -1 on error.
+ */
+int dyio_set_pid_velocity(dyio_t *d, int group, int velocity, int msec);
+
+/*
+ * Get current positions of all PID groups, in one request.
+ * Return number of groups, or -1 on error.
+ */
+int dyio_get_all_pid(dyio_t *d, int *position);
+
+/*
+ * Set setpoints of all PID groups, in one request.
+ * Return 0 on success, or -1 on error.
+ */
+int dyio_set_all_pid(dyio_t *d, int msec, int ngroups, const int *setpoint);
+
+/*
+ * One cycle of closed-loop supervision: send new setpoints of all
+ * groups and read back their positions. Both frames are pipelined,
+ * so the cycle costs one round-trip.
+ * Return number of groups, or -1 on error.
+ */
+int dyio_pid_cycle(dyio_t *d, int msec, int ngroups, const int *setpoint,
+    int *position);
+
+/*
+ * Reset the position counter of the PID group.
+ * Return 0 on success, or -1 on error.
+ */
+int dyio_reset_pid(dyio_t *d, int group, int position);
+
+/*
+ * Stop all PID loops immediately.
+ * Return 0 on success, or -1 on error.
+ */
+int dyio_kill_all_pid(dyio_t *d);
+
+/*
+ * Start calibration of the PID group.
+ * Return 0 on success, or -1 on error.
+ */
+int dyio_calibrate_pid(dyio_t *d, int group);
+
+/*
+ * Get the table of namespaces and methods of the device.
+ * The table is kept in a cache file, named by device address
+ * in $DYIO_CACHE or ~/.dyio directory. It is loaded on connect
+ * without any bus traffic, and verified against the firmware
+ * revision on first use.
+ * Return 0 when the device did not reply.
+ */
+dyio_rpc_table_t *dyio_get_rpc_table(dyio_t *d);
+
+/*
+ * Watch the channel: configure the device to push its value
+ * asynchronously, and call func(d, ev, arg) on every event.
+ * Mode is one of ASYN_xxx:
+ *  ASYN_AUTOSAMP  - send the value every msec milliseconds
+ *  ASYN_NOTEQUAL  - send the value when it changes
+ *  ASYN_DEADBAND  - send when the value changes by more than value
+ *  ASYN_THRESHOLD - send when the value crosses value, on given edge
+ * The background reader is started when needed.
+ * Return 0 on success, or -1 on error.
+ */
+int dyio_watch_channel(dyio_t *d, int ch, int mode, int msec, int value,
+    int edge, dyio_callback_t *func, void *arg);
+
+/*
+ * Play the trajectory: setpoints of one or many channels, in any order.
+ * A dedicated thread sends values every tick, at the given rate
+ * (1 to 1000 ticks per second), on an absolute schedule: one sacv
+ * frame when all channels are played, otherwise one schv frame per
+ * played channel. The frames of a tick are sent together, with
+ * their own window, see dyio_pipe_call(). Values are
+ * interpolated linearly between setpoints, and the firmware moves
+ * the outputs during the tick period. Ticks, missed by the thread,
+ * are skipped and counted as overruns.
+ * The background reader is started. Return 0, or -1 on error.
+ */
+int dyio_play(dyio_t *d, const dyio_setpoint_t *points, int npoints, int rate);
+
+/*
+ * Wait until the trajectory is finished, or stop it immediately.
+ * Statistics are returned when st is not null.
  */
-void dyio_set_value_msec(dyio_t *d, int ch, int value, int msec);
+void dyio_play_wait(dyio_t *d, dyio_play_stats_t *st);
+void dyio_play_stop(dyio_t *d, dyio_play_stats_t *st);
+
+/*
+ * Check whether the player is still running.
+ * Current statistics are returned when st is not null.
+ */
+int dyio_play_active(dyio_t *d, dyio_play_stats_t *st);
+
+/*
+ * Get per-RPC statistics: number of calls, bytes, errors and
+ * a histogram of round-trip times. Set count of entries.
+ */
+const dyio_stat_t *dyio_get_stats(dyio_t *d, int *count);
+
+/*
+ * Clear all statistics.
+ */
+void dyio_reset_stats(dyio_t *d);
+
+/*
+ * Estimate a percentile (0...100) of round-trip time, in microseconds.
+ */
+unsigned long dyio_stat_percentile(const dyio_stat_t *s, int percent);
+
+/*
+ * Display statistics of the link.
+ */
+void dyio_print_stats(dyio_t *d);
 
 /*
  * Query and display generic information about the DyIO device.
@@ -76,10 +723,295 @@ void dyio_print_channels(dyio_t *d);
 
 /*
  * Send the command sequence and get back a response.
+ * Return 0 on success, or DYIO_ETIMEOUT when no reply came
+ * after all retries.
+ */
+int dyio_call(dyio_t *d, int type, int namespace, char *rpc,
+    unsigned char *data, int datalen);
+
+/*
+ * Send the command sequence without waiting for a response.
+ * Frames are collected in the transmit buffer, and sent together
+ * in one write: when the buffer is full, when any call waits for
+ * a reply, or by dyio_flush(). The timeout of a request runs from
+ * queueing, so a caller which does not wait must call dyio_flush().
+ * When the window of requests in flight is full, the oldest
+ * reply is received first.
+ * Return a tag for dyio_wait_reply().
  */
-void dyio_call(dyio_t *d, int type, int namespace, char *rpc,
+int dyio_queue_call(dyio_t *d, int type, int namespace, char *rpc,
     unsigned char *data, int datalen);
 
+/*
+ * Send a request of a pipelined sequence, like dyio_queue_call().
+ * It may go while less than the given number of requests are
+ * in flight, even when the window of the connection is narrower.
+ * The window of the connection is not changed, so other threads
+ * are not affected.
+ */
+int dyio_pipe_call(dyio_t *d, int window, int type, int namespace, char *rpc,
+    unsigned char *data, int datalen);
+
+/*
+ * Send all queued frames to the device.
+ */
+void dyio_flush(dyio_t *d);
+
+/*
+ * Wait for a response to the queued request.
+ * The reply is placed into d->reply and d->reply_len.
+ * Return 0 on success, or DYIO_ETIMEOUT when no reply came
+ * after all retries; then d->reply_len is 0.
+ */
+int dyio_wait_reply(dyio_t *d, int tag);
+
+/*
+ * Wait for a response, but not later than the given deadline:
+ * absolute time in microseconds, see dyio_usec(). A request without
+ * reply is abandoned at deadline, and DYIO_ETIMEOUT is returned.
+ * Its slot is kept for one more timeout: a late reply is dropped.
+ * With deadline 0, same as dyio_wait_reply().
+ */
+int dyio_wait_reply_until(dyio_t *d, int tag, unsigned long long deadline);
+
+/*
+ * Set time to wait for every reply, in microseconds, and number
+ * of retries on timeout. Default is 1 second and one retry.
+ * Only GET requests are sent again: a command without reply
+ * fails with DYIO_ETIMEOUT.
+ */
+void dyio_set_timeout(dyio_t *d, unsigned long usec, int retries);
+
+/*
+ * Event loop interface. Nothing here blocks: the application
+ * polls the descriptor of the link, and calls dyio_process_io()
+ * when it is readable, or when the timeout expires.
+ * Not to be mixed with the background reader.
+ *
+ *      fd = dyio_get_fd(d);
+ *      dyio_submit(d, PKT_GET, ID_BCS_IO, "gacv", 0, 0, done, arg);
+ *      for (;;) {
+ *          poll fd for input, with dyio_io_timeout(d) msec;
+ *          dyio_process_io(d);
+ *      }
+ */
+
+/*
+ * Get the descriptor of the link, which becomes readable
+ * when replies arrive. Return -1 when the transport has none.
+ */
+int dyio_get_fd(dyio_t *d);
+
+/*
+ * Queue a request without blocking. When the window is full,
+ * the request waits, and is sent later by dyio_process_io(),
+ * in order of priority lanes, see LANE_xxx.
+ * On completion, func(d, tag, status, arg) is called from
+ * dyio_process_io(), with the reply in d->reply and d->reply_len,
+ * and status 0 or DYIO_ETIMEOUT. With func=0, the tag is a future:
+ * collect the reply with dyio_wait_reply().
+ * Return a tag, or DYIO_EBUSY when all MAX_INFLIGHT slots are used.
+ */
+int dyio_submit(dyio_t *d, int type, int namespace, char *rpc,
+    unsigned char *data, int datalen, dyio_complete_t *func, void *arg);
+
+/*
+ * Send queued frames, receive available replies without waiting,
+ * handle timeouts, and call completion callbacks.
+ * Return number of callbacks called.
+ */
+int dyio_process_io(dyio_t *d);
+
+/*
+ * Get time until dyio_process_io() has work to do
+ * without input, in milliseconds: for poll() or epoll_wait().
+ * Return -1 when no requests are pending.
+ */
+int dyio_io_timeout(dyio_t *d);
+
+/*
+ * Group of devices, served by one thread in one epoll loop.
+ * No device blocks the others: the replies are processed
+ * as they arrive, and a fan-out call to all devices takes
+ * the time of the slowest one.
+ */
+typedef void dyio_group_complete_t(dyio_t *d, int index, int status, void *arg);
+
+/*
+ * Create an empty group.
+ * Return 0 on error.
+ */
+dyio_group_t *dyio_group_create(void);
+
+/*
+ * Add the connected device to the group.
+ * The device must not run the background reader.
+ * Return index of the device, or -1 on error.
+ */
+int dyio_group_add(dyio_group_t *g, dyio_t *d);
+
+/*
+ * Deallocate the group. Devices are not closed.
+ */
+void dyio_group_destroy(dyio_group_t *g);
+
+/*
+ * Get number of devices, and the device by index.
+ */
+int dyio_group_size(dyio_group_t *g);
+dyio_t *dyio_group_device(dyio_group_t *g, int index);
+
+/*
+ * Send the same request to all devices, and wait for all replies.
+ * As each reply arrives, func(d, index, status, arg) is called
+ * with the reply in d->reply, and status 0 or an error code.
+ * Only requests of this call are waited for.
+ * Return number of devices, which replied, or -1 on error.
+ */
+int dyio_group_call(dyio_group_t *g, int type, int namespace, char *rpc,
+    unsigned char *data, int datalen, dyio_group_complete_t *func, void *arg);
+
+/*
+ * Run the loop until requests of all devices are complete,
+ * for example submitted by dyio_submit(), but not longer
+ * than msec milliseconds; msec < 0 means no limit.
+ * Return number of requests, still pending.
+ */
+int dyio_group_run(dyio_group_t *g, int msec);
+
+/*
+ * Get latency statistics of the device, measured by dyio_group_call().
+ */
+const dyio_group_stat_t *dyio_group_stat(dyio_group_t *g, int index);
+
+/*
+ * Print latency statistics of all devices.
+ */
+void dyio_group_print_stats(dyio_group_t *g);
+
+/*
+ * Attach to dyiod daemon, which owns the device port.
+ * Name is the base name of the port, like ttyACM0.
+ * Return 0 on error.
+ */
+dyio_client_t *dyio_client_open(const char *name);
+
+/*
+ * Detach from the daemon.
+ */
+void dyio_client_close(dyio_client_t *c);
+
+/*
+ * Get consistent snapshot of the device state from shared memory,
+ * without any communication with the daemon.
+ */
+void dyio_client_state(dyio_client_t *c, dyio_state_t *st);
+
+/*
+ * Pass the call to the device through the daemon.
+ * Requests of all clients are batched by the daemon.
+ * The reply is placed into buffer of 256 bytes, when not null.
+ * Return length of the reply, DYIO_ETIMEOUT when the device
+ * did not reply, or -1 on error.
+ */
+int dyio_client_call(dyio_client_t *c, int type, int namespace, char *rpc,
+    unsigned char *data, int datalen, unsigned char *reply);
+
+/*
+ * Get current time in microseconds, from a monotonic clock.
+ */
+unsigned long long dyio_usec(void);
+
+/*
+ * Set max number of requests in flight (1 to MAX_INFLIGHT).
+ * Default is 1, which means strict stop-and-wait.
+ */
+void dyio_set_window(dyio_t *d, int window);
+
+/*
+ * Limit the rate of requests of given packet type, per second.
+ * Requests of the lane are sent evenly spaced, and others pass
+ * them by. Use it to keep bulk polling with PKT_GET from loading
+ * the link. Use rate=0 to remove the limit.
+ */
+void dyio_set_rate(dyio_t *d, int type, int rate);
+
+/*
+ * Set a callback for asynchronous packets.
+ * With ch >= 0, the callback gets values of the given channel
+ * in bcs.io namespace. With ch < 0, the callback gets all
+ * asynchronous packets of the namespace, not handled otherwise.
+ * Use func=0 to remove the callback.
+ */
+void dyio_set_callback(dyio_t *d, int namespace, int ch,
+    dyio_callback_t *func, void *arg);
+
+/*
+ * Start a background thread, receiving packets from the device.
+ * Asynchronous packets are passed to callbacks as soon as they arrive,
+ * and synchronous calls continue to work from any thread.
+ * Return 0 on success, or -1 on error.
+ */
+int dyio_start_reader(dyio_t *d);
+
+/*
+ * Stop the background reader thread.
+ * The first start of the reader must happen before other threads
+ * use the device; after that, start and stop are safe from any thread.
+ */
+void dyio_stop_reader(dyio_t *d);
+
+/*
+ * Start thread-safe mode: one thread owns the link and performs
+ * all calls. Callers in any thread pass requests through a lock-free
+ * queue, and get replies in their own buffers. With the window
+ * above 1, requests of different threads are in flight together.
+ * Asynchronous packets are passed to callbacks in the owner thread.
+ * Functions, built on dyio_call_reply() and dyio_rpc_xxx(), are
+ * safe to call concurrently. Library functions with pipelined
+ * requests hold the link for the whole sequence. Pipelined calls
+ * with tags by the application are not safe: d->reply is shared.
+ * Cannot be combined with the background reader.
+ * Return 0 on success, or -1 on error.
+ */
+int dyio_start_shared(dyio_t *d);
+
+/*
+ * Stop the owner thread. Queued calls fail with -1,
+ * later calls go directly to the link.
+ */
+void dyio_stop_shared(dyio_t *d);
+
+/*
+ * Send the command sequence and get back a response into
+ * the buffer of the caller, of 256 bytes.
+ * Unlike dyio_call(), d->reply is not used.
+ * Return 0 on success, DYIO_ETIMEOUT when no reply came,
+ * or -1 when the owner thread is stopped.
+ */
+int dyio_call_reply(dyio_t *d, int type, int namespace, char *rpc,
+    unsigned char *data, int datalen, unsigned char *reply, int *reply_len);
+
+/*
+ * Allocate a ring for channel values, received asynchronously.
+ * Size is rounded up to a power of two, up to 1<<20 entries.
+ * The ring has a single producer (the receiving thread) and
+ * a single consumer, and needs no locking.
+ * Return 0 on success, or -1 on error.
+ */
+int dyio_enable_samples(dyio_t *d, int size);
+
+/*
+ * Fetch up to max samples from the ring, oldest first.
+ * Return number of samples.
+ */
+int dyio_drain_samples(dyio_t *d, dyio_sample_t *buf, int max);
+
+/*
+ * Get number of samples, lost due to ring overflow.
+ */
+unsigned long dyio_sample_overflows(dyio_t *d);
+
 /*
  * Packet types.
  */
@@ -89,6 +1021,18 @@ void dyio_call(dyio_t *d, int type, int namespace, char *rpc,
 #define PKT_CRITICAL    0x30    /* Synchronous, high priority, state changing */
 #define PKT_ASYNC       0x40    /* Asynchronous, high priority, state changing */
 
+/*
+ * Modes of asynchronous channel events, for dyio_watch_channel().
+ */
+#define ASYN_AUTOSAMP   0x01    /* Periodic samples */
+#define ASYN_NOTEQUAL   0x02    /* Value changed */
+#define ASYN_DEADBAND   0x04    /* Value changed more than a band */
+#define ASYN_THRESHOLD  0x08    /* Value crossed a threshold */
+
+#define ASYN_RISING     0x00    /* Edge of threshold crossing */
+#define ASYN_FALLING    0x01
+#define ASYN_BOTH       0x02
+
 /*
  * Method IDs.
  */
@@ -146,14 +1090,25 @@ void dyio_call(dyio_t *d, int type, int namespace, char *rpc,
 #define MODE_PPM_IN                 0x16
 #define MAX_MODES                   0x17    /* limit */
 
+/*
+ * Typed RPC stubs: dyio_rpc_xxx(), dyio_queue_xxx() and dyio_decode_xxx().
+ */
+#include "schema.h"
+
 /*
  * Open the serial port.
- * Return -1 on error.
+ * Return 0 on error.
+ */
+dyio_t *_dyio_serial_open(const char *devname, const dyio_opts_t *opts);
+
+/*
+ * Change speed of the serial port.
+ * Return -1 when the speed is not supported.
  */
-dyio_t *_dyio_serial_open(const char *devname, int baud_rate);
+int _dyio_serial_set_baud(dyio_t *device, int baud_rate);
 
 /*
- * Close the serial port.
+ * Close the serial port and deallocate the device object.
  */
 void _dyio_serial_close(dyio_t *device);
 
@@ -165,6 +1120,136 @@ int _dyio_serial_write(dyio_t *device, unsigned char *data, int len);
 
 /*
  * Receive data from device.
- * Return number of bytes, or -1 on error.
+ * Wait at most usec microseconds.
+ * Return number of bytes, or 0 on timeout.
+ */
+int _dyio_serial_read(dyio_t *device, unsigned char *data, int len,
+    unsigned long usec);
+
+/*
+ * Receive and process one packet from the device.
+ * Deadline is an absolute time in microseconds.
+ * Return 0 when nothing was received until deadline.
+ */
+int _dyio_receive(dyio_t *d, unsigned long long deadline);
+
+/*
+ * Get priority lane of the packet type, LANE_xxx.
+ */
+int _dyio_type_lane(int type);
+
+/*
+ * Queue a request, like dyio_pipe_call(). Reply bytes after
+ * the first skip are appended to the sink instead of the reply.
+ */
+int _dyio_queue_sink(dyio_t *d, int type, int namespace, char *rpc,
+    unsigned char *data, int datalen, dyio_sink_t *sink, int skip, int window);
+
+/*
+ * Pass the call to the owner thread, see dyio_start_shared().
+ */
+int _dyio_shared_call(dyio_t *d, int type, int namespace, char *rpc,
+    unsigned char *data, int datalen, unsigned char *reply, int *reply_len);
+
+#if defined(__WIN32__) || defined(WIN32)
+#   define _dyio_hold(d)
+#   define _dyio_release(d)
+#   define _dyio_shared_running(d) 0
+#else
+/*
+ * In thread-safe mode, hold the link for a sequence of pipelined
+ * requests, against the owner thread and other callers.
+ * Calls may nest. No-op in other modes.
+ */
+void _dyio_hold(dyio_t *d);
+void _dyio_release(dyio_t *d);
+
+/*
+ * Check whether the owner thread of thread-safe mode is running.
+ */
+int _dyio_shared_running(dyio_t *d);
+
+/*
+ * Stop thread-safe mode, and deallocate its state.
+ */
+void _dyio_close_shared(dyio_t *d);
+#endif
+
+/*
+ * Pass an asynchronous packet to user callbacks.
+ */
+void _dyio_dispatch_async(dyio_t *d, int namespace, char *rpc,
+    unsigned char *data, int datalen);
+
+/*
+ * Lock the device against the background reader, or
+ * against the owner thread in thread-safe mode.
+ * No-op otherwise.
+ */
+void _dyio_lock(dyio_t *d);
+void _dyio_unlock(dyio_t *d);
+
+/*
+ * Check whether the background reader is running.
+ * Stop it and free the reader state.
+ */
+int _dyio_reader_running(dyio_t *d);
+void _dyio_close_reader(dyio_t *d);
+
+/*
+ * Wait until some packet is received, or the deadline passes,
+ * with the device locked. Wake up all waiters.
+ */
+void _dyio_wait(dyio_t *d, unsigned long long deadline);
+void _dyio_wakeup(dyio_t *d);
+
+/*
+ * Put a sample into the ring, when enabled.
+ */
+void _dyio_put_sample(dyio_t *d, int ch, int value, unsigned long long usec);
+
+/*
+ * Get current time of monotonic clock, in microseconds.
+ */
+unsigned long long _dyio_usec(void);
+
+/*
+ * Load descriptors of the device from the cache, when available.
+ */
+void _dyio_load_cache(dyio_t *d);
+
+/*
+ * Find statistics entry for the method; create it when needed.
+ * Return index, or -1.
+ */
+int _dyio_stat_index(dyio_t *d, int ns, const char *rpc, int create);
+
+/*
+ * Account the reply to the request.
+ */
+void _dyio_stat_reply(dyio_t *d, dyio_request_t *r, int nbytes);
+
+/*
+ * Append a record to the capture: 'T' for sent data, 'R' for received.
+ */
+void _dyio_capture(dyio_t *d, int dir, const unsigned char *data, int len);
+
+/*
+ * Replay transport.
+ */
+dyio_t *_dyio_replay_open(const char *filename);
+void _dyio_replay_close(dyio_t *d);
+int _dyio_replay_write(dyio_t *d, unsigned char *data, int len);
+int _dyio_replay_read(dyio_t *d, unsigned char *data, int len,
+    unsigned long usec);
+
+/*
+ * Loopback transport: the software model of the device in memory.
+ * Name is "loop:".
+ */
+dyio_t *_dyio_loop_open(const char *devname, const dyio_opts_t *opts);
+
+/*
+ * Socket transport: "unix:path" or "tcp:host:port".
  */
-int _dyio_serial_read(dyio_t *device, unsigned char *data, int len);
+dyio_t *_dyio_socket_open(const char *devname, const dyio_opts_t *opts);
@@ -0,0 +1,507 @@
+/*
+ * DyIO daemon.
+ * Owns the port of the device, and shares it with many local clients.
+ * Current modes and values of all channels are exported in shared
+ * memory under a sequence lock, so clients read them without any
+ * communication. Calls of clients come through a Unix socket;
+ * requests of all clients, received at the same time, are sent
+ * to the device in one write, and kept in flight together.
+ * Replies are collected by completion callbacks and passed back
+ * as they arrive, so a slow request does not hold the others.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "dyio.h"
+
+#define MAX_CLIENTS     32          /* Max clients connected */
+#define MAX_BATCH       (MAX_INFLIGHT - 2) /* Max client requests in flight */
+#define CLIENT_BATCH    8           /* Max requests of one client per write */
+
+const char version[] = "1.0."GITVERSION;
+const char copyright[] = "Copyright (C) 2015 Serge Vakulenko";
+
+char *progname;
+int verbose;
+volatile int terminated;
+
+dyio_t *device;
+dyio_state_t *state;                /* Shared memory */
+char shm_name[256];
+struct sockaddr_un addr;
+
+#define PFD_CLIENT      2           /* Index of first client in pfd[] */
+struct pollfd pfd[PFD_CLIENT + MAX_CLIENTS]; /* Listening socket, device and clients */
+int nclients;
+
+/*
+ * Client request, waiting for reply of the device.
+ */
+typedef struct {
+    int             busy;           /* Slot is used */
+    int             fd;             /* Socket of the client, or -1 when gone */
+    unsigned        seq;            /* Order of arrival */
+    int             done;           /* Reply received */
+    unsigned        refresh;        /* Refresh to finish before the reply, or 0 */
+    dyio_client_reply_t reply;      /* Reply of the device */
+} client_request_t;
+
+client_request_t request[MAX_BATCH];
+int nrequests;                      /* Requests in flight */
+unsigned request_seq;               /* Counter of requests */
+
+/*
+ * Refresh of the state: gacm and gacv in flight, one at a time.
+ */
+int refreshing;                     /* Refresh in flight */
+int refresh_wanted;                 /* Channels modified during the refresh */
+unsigned refresh_queued;            /* Counter of queued refreshes */
+unsigned refresh_done;              /* Counter of finished refreshes */
+int period = 20;                    /* Period of refresh, msec */
+unsigned long long next_refresh;    /* Time of periodic refresh */
+int mode[MAX_CHANNELS], num_modes;  /* Modes of last refresh */
+
+void usage()
+{
+    printf("DyIO daemon, Version %s, %s\n", version, copyright);
+    printf("Usage:\n\t%s [-vd] [-p msec] [-n name] portname\n", progname);
+    printf("Options:\n");
+    printf("\t-v\tverbose mode\n");
+    printf("\t-d\tprint debug trace of the USB protocol\n");
+    printf("\t-p msec\tperiod of state refresh, default 20\n");
+    printf("\t-n name\tname of the daemon, default is base name of the port\n");
+    printf("Clients attach with dyio_client_open(name).\n");
+    exit(-1);
+}
+
+static void terminate(int sig)
+{
+    terminated = 1;
+}
+
+/*
+ * Create the shared memory with the state.
+ */
+static void create_state(const char *name)
+{
+    int fd;
+
+    snprintf(shm_name, sizeof(shm_name), DYIOD_SHM, name);
+    fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(shm_name);
+        exit(-1);
+    }
+    if (ftruncate(fd, sizeof(dyio_state_t)) < 0) {
+        perror(shm_name);
+        exit(-1);
+    }
+    state = mmap(0, sizeof(dyio_state_t), PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    close(fd);
+    if (state == MAP_FAILED) {
+        perror(shm_name);
+        exit(-1);
+    }
+    state->magic = DYIOD_MAGIC;
+}
+
+/*
+ * Create the listening socket.
+ */
+static void create_socket(const char *name)
+{
+    int sock;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), DYIOD_SOCKET, name);
+    unlink(addr.sun_path);
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0) {
+        perror("socket");
+        exit(-1);
+    }
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(sock, MAX_CLIENTS) < 0) {
+        perror(addr.sun_path);
+        exit(-1);
+    }
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    pfd[0].fd = sock;
+    pfd[0].events = POLLIN;
+}
+
+/*
+ * Accept new clients.
+ */
+static void accept_clients()
+{
+    int fd;
+
+    for (;;) {
+        fd = accept(pfd[0].fd, 0, 0);
+        if (fd < 0)
+            return;
+        if (nclients >= MAX_CLIENTS) {
+            fprintf(stderr, "%s: too many clients\n", progname);
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        pfd[PFD_CLIENT + nclients].fd = fd;
+        pfd[PFD_CLIENT + nclients].events = POLLIN;
+        pfd[PFD_CLIENT + nclients].revents = 0;
+        nclients++;
+        if (verbose)
+            printf("--- client %u connected\n", fd);
+    }
+}
+
+/*
+ * Store the reply of the device, with given status.
+ */
+static void store_reply(dyio_client_reply_t *r, int status)
+{
+    r->status = status;
+    r->reply_len = (status < 0) ? 0 : device->reply_len;
+    memcpy(r->reply, device->reply, r->reply_len);
+}
+
+/*
+ * Send the reply to the client.
+ */
+static void send_reply(int fd, dyio_client_reply_t *r)
+{
+    int n = offsetof(dyio_client_reply_t, reply) + r->reply_len;
+
+    if (send(fd, r, n, MSG_NOSIGNAL) != n && verbose)
+        printf("--- client %u: cannot send reply\n", fd);
+}
+
+/*
+ * Pass finished replies to clients: in order of requests
+ * of every client, and after the refresh of the state,
+ * when the request has modified the channels.
+ */
+static void send_replies()
+{
+    int i, k;
+
+    for (i=0; i<MAX_BATCH; i++) {
+        if (! request[i].busy || ! request[i].done ||
+            (int) (request[i].refresh - refresh_done) > 0)
+            continue;
+        for (k=0; k<MAX_BATCH; k++) {
+            if (request[k].busy && request[k].fd == request[i].fd &&
+                (int) (request[k].seq - request[i].seq) < 0)
+                break;
+        }
+        if (k < MAX_BATCH)
+            continue;
+        if (request[i].fd >= 0)
+            send_reply(request[i].fd, &request[i].reply);
+        request[i].busy = 0;
+        nrequests--;
+
+        /* Later requests of the client may be ready: scan again. */
+        i = -1;
+    }
+}
+
+/*
+ * Forget requests of the disconnected client:
+ * replies still in flight are dropped.
+ */
+static void drop_requests(int fd)
+{
+    int i;
+
+    for (i=0; i<MAX_BATCH; i++) {
+        if (request[i].busy && request[i].fd == fd)
+            request[i].fd = -1;
+    }
+}
+
+/*
+ * Reply of the device to the client request.
+ */
+static void request_done(dyio_t *d, int tag, int status, void *arg)
+{
+    client_request_t *r = arg;
+
+    store_reply(&r->reply, status);
+    r->done = 1;
+}
+
+/*
+ * Receive requests of the client, and submit them to the device.
+ * Return number of requests, or -1 when the client is gone.
+ */
+static int receive_requests(int fd, int *modified)
+{
+    dyio_client_query_t q;
+    dyio_client_reply_t q_reply;
+    client_request_t *r;
+    int n, tag, count = 0;
+
+    while (count < CLIENT_BATCH && nrequests < MAX_BATCH) {
+        n = recv(fd, &q, sizeof(q), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            return -1;
+
+        if (n < offsetof(dyio_client_query_t, data) ||
+            n != offsetof(dyio_client_query_t, data) + q.datalen ||
+            q.datalen > 255 - sizeof(q.rpc)) {
+            if (verbose)
+                printf("--- client %u: bad request\n", fd);
+            store_reply(&q_reply, -1);
+            send_reply(fd, &q_reply);
+            continue;
+        }
+        if (verbose > 1)
+            printf("--- client %u: '%.4s'\n", fd, q.rpc);
+        for (r=request; r->busy; r++)
+            continue;
+        r->busy = 1;
+        r->fd = fd;
+        r->seq = request_seq++;
+        r->done = 0;
+        r->refresh = 0;
+        nrequests++;
+        count++;
+
+        /* After writes to channels, reply when the state is refreshed. */
+        if (q.type != PKT_GET && (q.id == ID_BCS_IO || q.id == ID_BCS_SETMODE)) {
+            r->refresh = refresh_queued + 1;
+            *modified = 1;
+        }
+        tag = dyio_submit(device, q.type, q.id, q.rpc, q.data, q.datalen,
+            request_done, r);
+        if (tag < 0)
+            request_done(device, tag, tag, r);
+    }
+    return count;
+}
+
+/*
+ * Update the shared state under the sequence lock.
+ */
+static void update_state(int num_channels, const int *mode, const int *value)
+{
+    int c;
+
+    __atomic_store_n(&state->seq, state->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    state->usec = dyio_usec();
+    state->updates++;
+    state->clients = nclients;
+    state->num_channels = num_channels;
+    for (c=0; c<num_channels; c++) {
+        state->mode[c] = mode[c];
+        state->value[c] = value[c];
+    }
+
+    __atomic_store_n(&state->seq, state->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Modes of channels are received: values come next.
+ */
+static void modes_done(dyio_t *d, int tag, int status, void *arg)
+{
+    num_modes = 0;
+    if (status == 0)
+        dyio_decode_get_all_modes(d, &num_modes, mode);
+}
+
+/*
+ * Values of channels are received: the refresh is finished.
+ */
+static void values_done(dyio_t *d, int tag, int status, void *arg)
+{
+    int value[MAX_CHANNELS], num_values = 0, n;
+
+    if (status == 0)
+        dyio_decode_get_all_values(d, &num_values, value);
+    n = (num_modes < num_values) ? num_modes : num_values;
+    if (n > 0)
+        update_state(n, mode, value);
+
+    refresh_done++;
+    refreshing = 0;
+    next_refresh = dyio_usec() + period * 1000ULL;
+}
+
+/*
+ * Queue the refresh of the state: gacm and gacv.
+ * Slots for them are kept free by MAX_BATCH.
+ */
+static void queue_refresh()
+{
+    int tag;
+
+    refreshing = 1;
+    refresh_wanted = 0;
+    refresh_queued++;
+    tag = dyio_submit(device, PKT_GET, ID_BCS_IO, "gacm", 0, 0, modes_done, 0);
+    if (tag < 0)
+        modes_done(device, tag, tag, 0);
+    tag = dyio_submit(device, PKT_GET, ID_BCS_IO, "gacv", 0, 0, values_done, 0);
+    if (tag < 0)
+        values_done(device, tag, tag, 0);
+}
+
+int main(int argc, char **argv)
+{
+    char *devname, *name = 0;
+    int debug = 0, modified, timeout, nfds, nbatch, n, i;
+    unsigned long long now;
+
+    progname = *argv;
+    for (;;) {
+        switch (getopt(argc, argv, "vdp:n:")) {
+        case EOF:
+            break;
+        case 'v':
+            verbose++;
+            continue;
+        case 'd':
+            debug++;
+            continue;
+        case 'p':
+            period = strtol(optarg, 0, 0);
+            if (period <= 0)
+                usage();
+            continue;
+        case 'n':
+            name = optarg;
+            continue;
+        default:
+            usage();
+        }
+        break;
+    }
+    if (optind != argc - 1)
+        usage();
+    devname = argv[optind];
+    if (! name) {
+        name = strrchr(devname, '/');
+        name = name ? name+1 : devname;
+    }
+
+    device = dyio_connect(devname, debug);
+    if (! device) {
+        printf("Failed to open port %s\n", devname);
+        exit(-1);
+    }
+
+    /* Requests of clients and the refresh are all in flight together. */
+    dyio_set_window(device, MAX_BATCH + 2);
+    pfd[1].fd = dyio_get_fd(device);
+    pfd[1].events = POLLIN;
+
+    create_state(name);
+    create_socket(name);
+    printf("%s: serving %s as '%s'\n", progname, devname, name);
+    fflush(stdout);
+
+    signal(SIGINT, terminate);
+    signal(SIGTERM, terminate);
+    signal(SIGHUP, terminate);
+
+    next_refresh = dyio_usec();
+    while (! terminated) {
+        /* Wait for clients, for replies of the device,
+         * or for the next refresh. */
+        timeout = dyio_io_timeout(device);
+        if (timeout != 0 && ! refreshing) {
+            now = dyio_usec();
+            i = (next_refresh > now) ? (next_refresh - now + 999) / 1000 : 0;
+            if (timeout < 0 || i < timeout)
+                timeout = i;
+        }
+        if (timeout != 0 && pfd[1].fd < 0 && nrequests + refreshing > 0)
+            timeout = 1;
+
+        /* Do not take new requests, when all slots are in flight. */
+        nfds = (nrequests < MAX_BATCH) ? PFD_CLIENT + nclients : PFD_CLIENT;
+        if (poll(pfd, nfds, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        if (pfd[0].revents & POLLIN)
+            accept_clients();
+
+        /* Submit requests of all clients. */
+        nbatch = 0;
+        modified = 0;
+        for (i=PFD_CLIENT; i<nfds; i++) {
+            if (! (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            pfd[i].revents = 0;
+            n = receive_requests(pfd[i].fd, &modified);
+            if (n > 0)
+                nbatch += n;
+            if (n < 0) {
+                if (verbose)
+                    printf("--- client %u disconnected\n", pfd[i].fd);
+                drop_requests(pfd[i].fd);
+                close(pfd[i].fd);
+                pfd[i] = pfd[PFD_CLIENT + nclients - 1];
+                nclients--;
+                nfds--;
+                i--;
+            }
+        }
+        if (modified)
+            refresh_wanted = 1;
+
+        /* Queue the state refresh into the same write. */
+        if (! refreshing && (refresh_wanted || dyio_usec() >= next_refresh)) {
+            queue_refresh();
+            state->batches++;
+        } else if (nbatch > 0) {
+            state->batches++;
+        }
+        state->requests += nbatch;
+
+        /* Send the frames, collect replies, and pass them
+         * to clients, when the state is already updated.
+         * Writes, which came during the refresh, need another one. */
+        dyio_process_io(device);
+        if (refresh_wanted && ! refreshing) {
+            queue_refresh();
+            state->batches++;
+            dyio_process_io(device);
+        }
+        send_replies();
+    }
+
+    close(pfd[0].fd);
+    unlink(addr.sun_path);
+    shm_unlink(shm_name);
+    dyio_close(device);
+    return 0;
+}
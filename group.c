@@ -0,0 +1,310 @@
+/*
+ * DyIO library: group of devices, served by one thread.
+ *
+ * Descriptors of all devices are watched by one epoll instance.
+ * Reads never wait on a single device: every ready device is
+ * processed by dyio_process_io(), and timeouts of requests
+ * are handled by the earliest deadline of the whole group.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include "dyio.h"
+
+typedef struct {
+    dyio_t          *d;             /* Device */
+    dyio_group_t    *group;         /* Back pointer */
+    int             index;          /* Index in the group */
+    int             fd;             /* Descriptor of the link, or -1 */
+    unsigned long long start;       /* Time of fan-out call */
+    dyio_group_stat_t stat;         /* Latency statistics */
+} dyio_member_t;
+
+struct _dyio_group_t {
+    int             epfd;           /* Epoll instance */
+    int             ndevices;       /* Number of devices */
+    dyio_member_t   member[MAX_GROUP];
+
+    /* Current fan-out call. */
+    int             pending;        /* Devices without reply */
+    int             replied;        /* Devices with reply */
+    dyio_group_complete_t *func;    /* User callback, or 0 */
+    void            *arg;           /* User argument */
+};
+
+/*
+ * Create an empty group.
+ */
+dyio_group_t *dyio_group_create()
+{
+    dyio_group_t *g;
+
+    g = calloc(1, sizeof(dyio_group_t));
+    if (! g) {
+        fprintf(stderr, "dyio: Out of memory\n");
+        return 0;
+    }
+    g->epfd = epoll_create1(0);
+    if (g->epfd < 0) {
+        perror("epoll_create");
+        free(g);
+        return 0;
+    }
+    return g;
+}
+
+/*
+ * Add the device to the group.
+ */
+int dyio_group_add(dyio_group_t *g, dyio_t *d)
+{
+    struct epoll_event ev;
+    dyio_member_t *m;
+
+    if (g->ndevices >= MAX_GROUP) {
+        fprintf(stderr, "dyio: too many devices in group\n");
+        return -1;
+    }
+    if (_dyio_reader_running(d)) {
+        fprintf(stderr, "dyio: device of group must not run reader\n");
+        return -1;
+    }
+    m = &g->member[g->ndevices];
+    memset(m, 0, sizeof(*m));
+    m->d = d;
+    m->group = g;
+    m->index = g->ndevices;
+    m->fd = dyio_get_fd(d);
+    if (m->fd >= 0) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = m->index;
+        if (epoll_ctl(g->epfd, EPOLL_CTL_ADD, m->fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
+    return g->ndevices++;
+}
+
+/*
+ * Deallocate the group.
+ */
+void dyio_group_destroy(dyio_group_t *g)
+{
+    close(g->epfd);
+    free(g);
+}
+
+int dyio_group_size(dyio_group_t *g)
+{
+    return g->ndevices;
+}
+
+dyio_t *dyio_group_device(dyio_group_t *g, int index)
+{
+    if (index < 0 || index >= g->ndevices)
+        return 0;
+    return g->member[index].d;
+}
+
+/*
+ * Get time until the earliest deadline of all devices, in msec.
+ * Devices without descriptor are polled without sleeping.
+ * Return -1 when nothing is pending.
+ */
+static int group_timeout(dyio_group_t *g)
+{
+    dyio_member_t *m;
+    int i, msec, timeout = -1;
+
+    for (i=0; i<g->ndevices; i++) {
+        m = &g->member[i];
+        msec = dyio_io_timeout(m->d);
+        if (msec < 0)
+            continue;
+        if (m->fd < 0)
+            msec = 0;
+        if (timeout < 0 || msec < timeout)
+            timeout = msec;
+    }
+    return timeout;
+}
+
+/*
+ * Count requests of all devices, which are sent or waiting.
+ */
+static int group_pending(dyio_group_t *g)
+{
+    dyio_t *d;
+    int i, n = 0;
+
+    for (i=0; i<g->ndevices; i++) {
+        d = g->member[i].d;
+        n += d->inflight + d->waiting;
+    }
+    return n;
+}
+
+/*
+ * Send all queued frames of all devices, and complete what is ready.
+ */
+static void group_process(dyio_group_t *g)
+{
+    int i;
+
+    for (i=0; i<g->ndevices; i++)
+        dyio_process_io(g->member[i].d);
+}
+
+/*
+ * Sleep until a device is ready, or the earliest deadline
+ * of requests, but not later than the given deadline (when nonzero).
+ * Return -1 on error.
+ */
+static int group_wait(dyio_group_t *g, unsigned long long deadline)
+{
+    struct epoll_event ev[MAX_GROUP];
+    unsigned long long now = _dyio_usec();
+    int timeout;
+
+    timeout = group_timeout(g);
+    if (deadline && (timeout < 0 || now + timeout * 1000ULL > deadline))
+        timeout = (deadline - now + 999) / 1000;
+
+    if (epoll_wait(g->epfd, ev, MAX_GROUP, timeout) < 0 && errno != EINTR) {
+        perror("epoll_wait");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Run the loop.
+ */
+int dyio_group_run(dyio_group_t *g, int msec)
+{
+    unsigned long long deadline = 0;
+    int pending;
+
+    if (msec >= 0)
+        deadline = _dyio_usec() + msec * 1000ULL;
+    for (;;) {
+        group_process(g);
+
+        pending = group_pending(g);
+        if (pending == 0)
+            break;
+        if (deadline && _dyio_usec() >= deadline)
+            break;
+        if (group_wait(g, deadline) < 0)
+            break;
+    }
+    return pending;
+}
+
+/*
+ * Reply of one device to the fan-out call.
+ */
+static void member_complete(dyio_t *d, int tag, int status, void *arg)
+{
+    dyio_member_t *m = arg;
+    dyio_group_t *g = m->group;
+    unsigned long usec = _dyio_usec() - m->start;
+
+    g->pending--;
+    if (status == DYIO_ETIMEOUT) {
+        m->stat.timeouts++;
+    } else if (status < 0) {
+        m->stat.errors++;
+    } else {
+        g->replied++;
+        m->stat.calls++;
+        m->stat.last_usec = usec;
+        m->stat.total_usec += usec;
+        if (usec > m->stat.max_usec)
+            m->stat.max_usec = usec;
+        if (m->stat.calls == 1 || usec < m->stat.min_usec)
+            m->stat.min_usec = usec;
+    }
+    if (g->func)
+        g->func(d, m->index, status, g->arg);
+}
+
+/*
+ * Send the request to all devices, and collect the replies.
+ */
+int dyio_group_call(dyio_group_t *g, int type, int namespace, char *rpc,
+    unsigned char *data, int datalen, dyio_group_complete_t *func, void *arg)
+{
+    dyio_member_t *m;
+    int i;
+
+    g->func = func;
+    g->arg = arg;
+    g->pending = 0;
+    g->replied = 0;
+    for (i=0; i<g->ndevices; i++) {
+        m = &g->member[i];
+        m->start = _dyio_usec();
+        if (dyio_submit(m->d, type, namespace, rpc, data, datalen,
+                member_complete, m) < 0) {
+            printf("dyio: device %u of group is busy\n", i);
+            continue;
+        }
+        g->pending++;
+    }
+
+    /* Every request completes, at least by timeout.
+     * Other requests of the devices make progress meanwhile,
+     * but are not waited for. */
+    for (;;) {
+        group_process(g);
+        if (g->pending == 0)
+            break;
+        if (group_wait(g, 0) < 0) {
+            g->func = 0;
+            return -1;
+        }
+    }
+    g->func = 0;
+    return g->replied;
+}
+
+/*
+ * Get latency statistics of the device.
+ */
+const dyio_group_stat_t *dyio_group_stat(dyio_group_t *g, int index)
+{
+    if (index < 0 || index >= g->ndevices)
+        return 0;
+    return &g->member[index].stat;
+}
+
+/*
+ * Print latency statistics of all devices.
+ */
+void dyio_group_print_stats(dyio_group_t *g)
+{
+    dyio_group_stat_t *s;
+    int i;
+
+    printf("Group Latency:\n");
+    printf("   Dev Transport  Calls Tmout Error   last us    min us    avg us    max us\n");
+    for (i=0; i<g->ndevices; i++) {
+        s = &g->member[i].stat;
+        printf("   %3u %-9s %6lu %5lu %5lu %9lu %9lu %9lu %9lu\n", i,
+            g->member[i].d->transport->name, s->calls, s->timeouts, s->errors,
+            s->last_usec, s->min_usec,
+            s->calls ? (unsigned long) (s->total_usec / s->calls) : 0,
+            s->max_usec);
+    }
+}
@@ -0,0 +1,810 @@
+/*
+ * DyIO library: software model of the DyIO device.
+ * Speaks the DyIO protocol: takes bytes of queries, and produces
+ * replies, scheduled with optional latency, jitter and damage.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "dyio.h"
+#include "model.h"
+
+#define PROTO_VERSION   3           /* Revision of the current protocol */
+#define STREAM_FRAME    249         /* Max data bytes in strm frame */
+
+struct dyio_header {
+    uint8_t proto;          /* Protocol revision */
+    uint8_t mac[6];         /* MAC address of the device */
+    uint8_t type;           /* Packet type */
+    uint8_t id;             /* Namespace index; high bit is response flag */
+    uint8_t datalen;        /* The length of data including the RPC */
+    uint8_t hsum;           /* Sum of previous bytes */
+    uint8_t rpc[4];         /* RPC call identifier */
+};
+
+/*
+ * Description of a method, for _rpc and args queries.
+ */
+typedef struct {
+    int             ns;             /* Namespace index */
+    const char      *rpc;           /* RPC call identifier */
+    int             query_type;     /* Packet type of the query */
+    int             nargs;          /* Number of query arguments */
+    uint8_t         args[13];       /* Types of query arguments */
+    int             resp_type;      /* Packet type of the response */
+    int             nresp;          /* Number of response values */
+    uint8_t         resp[13];       /* Types of response values */
+} method_t;
+
+static const char *namespace_name[] = {
+    "bcs.core",
+    "bcs.rpc",
+    "bcs.io",
+    "bcs.io.setmode",
+    "neuronrobotics.dyio",
+    "bcs.pid",
+};
+#define NNAMESPACES (sizeof(namespace_name) / sizeof(namespace_name[0]))
+
+static const method_t method_tab[] = {
+    { ID_BCS_CORE,    "_png", PKT_GET,  0, {},
+                              PKT_POST, 0, {} },
+    { ID_BCS_CORE,    "_nms", PKT_GET,  1, { TYPE_I08 },
+                              PKT_POST, 2, { TYPE_ASCII, TYPE_I08 } },
+    { ID_BCS_RPC,     "_rpc", PKT_GET,  2, { TYPE_I08, TYPE_I08 },
+                              PKT_POST, 4, { TYPE_I08, TYPE_I08, TYPE_I08, TYPE_ASCII } },
+    { ID_BCS_RPC,     "args", PKT_GET,  2, { TYPE_I08, TYPE_I08 },
+                              PKT_POST, 6, { TYPE_I08, TYPE_I08, TYPE_I08, TYPE_STR, TYPE_I08, TYPE_STR } },
+    { ID_BCS_IO,      "gchc", PKT_GET,  0, {},
+                              PKT_POST, 1, { TYPE_I32 } },
+    { ID_BCS_IO,      "gcml", PKT_GET,  1, { TYPE_I08 },
+                              PKT_POST, 1, { TYPE_STR } },
+    { ID_BCS_IO,      "gchm", PKT_GET,  1, { TYPE_I08 },
+                              PKT_POST, 2, { TYPE_I08, TYPE_I08 } },
+    { ID_BCS_IO,      "gacm", PKT_GET,  0, {},
+                              PKT_POST, 1, { TYPE_STR } },
+    { ID_BCS_IO,      "gchv", PKT_GET,  1, { TYPE_I08 },
+                              PKT_POST, 2, { TYPE_I08, TYPE_I32 } },
+    { ID_BCS_IO,      "gacv", PKT_GET,  0, {},
+                              PKT_POST, 1, { TYPE_I32STR } },
+    { ID_BCS_IO,      "schv", PKT_POST, 3, { TYPE_I08, TYPE_I32, TYPE_I32 },
+                              PKT_POST, 2, { TYPE_I08, TYPE_I08 } },
+    { ID_BCS_IO,      "sacv", PKT_POST, 2, { TYPE_I32, TYPE_I32STR },
+                              PKT_POST, 1, { TYPE_I32STR } },
+    { ID_BCS_IO,      "strm", PKT_GET,  1, { TYPE_I08 },
+                              PKT_POST, 2, { TYPE_I08, TYPE_STR } },
+    { ID_BCS_IO,      "strm", PKT_POST, 2, { TYPE_I08, TYPE_STR },
+                              PKT_POST, 2, { TYPE_I08, TYPE_I08 } },
+    { ID_BCS_IO,      "asyn", PKT_CRITICAL, 5, { TYPE_I08, TYPE_I08, TYPE_I32, TYPE_I32, TYPE_I08 },
+                              PKT_POST, 0, {} },
+    { ID_BCS_SETMODE, "schm", PKT_POST, 3, { TYPE_I08, TYPE_I08, TYPE_I08 },
+                              PKT_POST, 1, { TYPE_STR } },
+    { ID_BCS_SETMODE, "sacm", PKT_POST, 1, { TYPE_STR },
+                              PKT_POST, 1, { TYPE_STR } },
+    { ID_DYIO,        "_rev", PKT_GET,  0, {},
+                              PKT_POST, 6, { TYPE_I08, TYPE_I08, TYPE_I08, TYPE_I08, TYPE_I08, TYPE_I08 } },
+    { ID_DYIO,        "_pwr", PKT_GET,  0, {},
+                              PKT_POST, 4, { TYPE_I08, TYPE_I08, TYPE_I16, TYPE_BOOL } },
+    { ID_BCS_PID,     "apid", PKT_GET,  0, {},
+                              PKT_POST, 1, { TYPE_I32STR } },
+    { ID_BCS_PID,     "_pid", PKT_GET,  1, { TYPE_I08 },
+                              PKT_POST, 2, { TYPE_I08, TYPE_I32 } },
+    { ID_BCS_PID,     "cpid", PKT_GET,  1, { TYPE_I08 },
+                              PKT_POST, 13, { TYPE_I08, TYPE_I08, TYPE_I08, TYPE_I08,
+                                              TYPE_FIXED100, TYPE_FIXED100, TYPE_FIXED100,
+                                              TYPE_I32, TYPE_I08, TYPE_I08,
+                                              TYPE_FIXED1K, TYPE_FIXED1K, TYPE_FIXED1K } },
+    { ID_BCS_PID,     "gpdc", PKT_GET,  0, {},
+                              PKT_POST, 1, { TYPE_I32 } },
+    { ID_BCS_PID,     "apid", PKT_POST, 2, { TYPE_I32, TYPE_I32STR },
+                              PKT_STATUS, 2, { TYPE_I08, TYPE_I08 } },
+    { ID_BCS_PID,     "_pid", PKT_POST, 3, { TYPE_I08, TYPE_I32, TYPE_I32 },
+                              PKT_STATUS, 2, { TYPE_I08, TYPE_I08 } },
+    { ID_BCS_PID,     "_vpd", PKT_POST, 3, { TYPE_I08, TYPE_I32, TYPE_I32 },
+                              PKT_STATUS, 2, { TYPE_I08, TYPE_I08 } },
+    { ID_BCS_PID,     "rpid", PKT_POST, 2, { TYPE_I08, TYPE_I32 },
+                              PKT_STATUS, 2, { TYPE_I08, TYPE_I08 } },
+    { ID_BCS_PID,     "kpid", PKT_CRITICAL, 0, {},
+                              PKT_STATUS, 2, { TYPE_I08, TYPE_I08 } },
+    { ID_BCS_PID,     "cpid", PKT_CRITICAL, 13, { TYPE_I08, TYPE_I08, TYPE_I08, TYPE_I08,
+                                              TYPE_FIXED100, TYPE_FIXED100, TYPE_FIXED100,
+                                              TYPE_I32, TYPE_I08, TYPE_I08,
+                                              TYPE_FIXED1K, TYPE_FIXED1K, TYPE_FIXED1K },
+                              PKT_STATUS, 2, { TYPE_I08, TYPE_I08 } },
+    { ID_BCS_PID,     "acal", PKT_CRITICAL, 1, { TYPE_I08 },
+                              PKT_STATUS, 2, { TYPE_I08, TYPE_I08 } },
+};
+#define NMETHODS (sizeof(method_tab) / sizeof(method_tab[0]))
+
+/*
+ * Channels, supporting every mode.
+ * Same as the real DyIO device.
+ */
+static const unsigned long mode_mask[MAX_MODES] = {
+    [MODE_DI]                  = 0xffffff,
+    [MODE_DO]                  = 0xffffff,
+    [MODE_ANALOG_IN]           = 0x00ff00,
+    [MODE_PWM]                 = 0x0000f0,
+    [MODE_SERVO]               = 0xffffff,
+    [MODE_UART_TX]             = 0x010000,
+    [MODE_UART_RX]             = 0x020000,
+    [MODE_SPI_MOSI]            = 0x000004,
+    [MODE_SPI_MISO]            = 0x000002,
+    [MODE_SPI_SCK]             = 0x000001,
+    [MODE_COUNTER_INPUT_INT]   = 0xaa0000,
+    [MODE_COUNTER_INPUT_DIR]   = 0x550000,
+    [MODE_COUNTER_INPUT_HOME]  = 0x00000f,
+    [MODE_COUNTER_OUTPUT_INT]  = 0xaa0000,
+    [MODE_COUNTER_OUTPUT_DIR]  = 0x550000,
+    [MODE_COUNTER_OUTPUT_HOME] = 0x00000f,
+    [MODE_DC_MOTOR_VEL]        = 0x0000f0,
+    [MODE_DC_MOTOR_DIR]        = 0x000ff0,
+    [MODE_PPM_IN]              = 0x800000,
+};
+
+/*
+ * Get current time of monotonic clock, in microseconds.
+ */
+static unsigned long long now_usec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void put_int(uint8_t *p, int value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static int get_int(uint8_t *p)
+{
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint8_t header_sum(struct dyio_header *hdr)
+{
+    return hdr->proto + hdr->mac[0] + hdr->mac[1] + hdr->mac[2] +
+           hdr->mac[3] + hdr->mac[4] + hdr->mac[5] + hdr->type +
+           hdr->id + hdr->datalen;
+}
+
+/*
+ * Build a frame and schedule it for transmission.
+ * Replies are never reordered: every frame is due
+ * not earlier than the previous one.
+ */
+static void send_frame(dyio_model_t *m, int type, int ns, const char *rpc, uint8_t *data, int datalen)
+{
+    dyio_model_frame_t *p;
+    struct dyio_header *hdr;
+    uint8_t sum;
+    unsigned long long due;
+    int i, delay;
+
+    if (m->pending_tail - m->pending_head >= MODEL_PENDING) {
+        fprintf(stderr, "%s: too many pending replies, frame dropped\n", "dyio-model");
+        return;
+    }
+    p = &m->pending[m->pending_tail++ % MODEL_PENDING];
+    hdr = (struct dyio_header*) p->frame;
+    hdr->proto   = PROTO_VERSION;
+    hdr->type    = type;
+    hdr->id      = ns | ID_RESPONSE;
+    hdr->datalen = datalen + sizeof(hdr->rpc);
+    memcpy(hdr->mac, m->mac, sizeof(hdr->mac));
+    memcpy(hdr->rpc, rpc, sizeof(hdr->rpc));
+    hdr->hsum = header_sum(hdr);
+    memcpy(p->frame + sizeof(*hdr), data, datalen);
+    sum = hdr->rpc[0] + hdr->rpc[1] + hdr->rpc[2] + hdr->rpc[3];
+    for (i=0; i<datalen; i++)
+        sum += data[i];
+    p->frame[sizeof(*hdr) + datalen] = sum;
+    p->len = sizeof(*hdr) + datalen + 1;
+
+    /* Damage one byte. */
+    if (m->corrupt_rate > 0 && drand48() < m->corrupt_rate) {
+        i = lrand48() % p->len;
+        p->frame[i] ^= 1 + lrand48() % 255;
+        if (m->verbose)
+            printf("--- corrupt byte %u of '%.4s'\n", i, rpc);
+    }
+
+    delay = m->latency;
+    if (m->jitter > 0)
+        delay += lrand48() % (2*m->jitter + 1) - m->jitter;
+    if (delay < 0)
+        delay = 0;
+    due = now_usec() + delay;
+    if (due < m->last_due)
+        due = m->last_due;
+    p->due = m->last_due = due;
+}
+
+/*
+ * Reply with an error.
+ */
+static void send_error(dyio_model_t *m, int ns, uint8_t code0, uint8_t code1)
+{
+    uint8_t data[2];
+
+    data[0] = code0;
+    data[1] = code1;
+    send_frame(m, PKT_POST, ID_BCS_CORE, "_err", data, 2);
+}
+
+/*
+ * Store the list of all channel modes.
+ */
+static int all_modes(dyio_model_t *m, uint8_t *data)
+{
+    int c;
+
+    data[0] = MODEL_CHANNELS;
+    for (c=0; c<MODEL_CHANNELS; c++)
+        data[1 + c] = m->chan_mode[c];
+    return 1 + MODEL_CHANNELS;
+}
+
+/*
+ * Store the list of all channel values.
+ */
+static int all_values(dyio_model_t *m, uint8_t *data)
+{
+    int c;
+
+    data[0] = MODEL_CHANNELS;
+    for (c=0; c<MODEL_CHANNELS; c++)
+        put_int(&data[1 + c*4], m->chan_value[c]);
+    return 1 + MODEL_CHANNELS*4;
+}
+
+/*
+ * Change mode of the channel.
+ * Return 0 when the mode is not supported.
+ */
+static int set_mode(dyio_model_t *m, int ch, int mode)
+{
+    if (mode == MODE_NO_CHANGE)
+        return 1;
+    if (ch < 0 || ch >= MODEL_CHANNELS || mode >= MAX_MODES ||
+        ! (mode_mask[mode] & (1UL << ch)))
+        return 0;
+
+    m->chan_mode[ch] = mode;
+    switch (mode) {
+    case MODE_DI:
+        m->chan_value[ch] = 1;
+        break;
+    case MODE_ANALOG_IN:
+        m->chan_value[ch] = 512;
+        break;
+    default:
+        m->chan_value[ch] = 0;
+        break;
+    }
+    return 1;
+}
+
+/*
+ * Compute current position of the PID group.
+ */
+static int pid_position(dyio_model_t *m, int g)
+{
+    unsigned long long now = now_usec();
+
+    if (now >= m->pid_group[g].end)
+        now = m->pid_group[g].end;
+    if (m->pid_group[g].velocity != 0)
+        return m->pid_group[g].from + (long long) m->pid_group[g].velocity *
+            (long long) (now - m->pid_group[g].start) / 1000000;
+    if (now >= m->pid_group[g].end)
+        return m->pid_group[g].to;
+    return m->pid_group[g].from + (long long) (m->pid_group[g].to - m->pid_group[g].from) *
+        (long long) (now - m->pid_group[g].start) /
+        (long long) (m->pid_group[g].end - m->pid_group[g].start);
+}
+
+/*
+ * Start motion of the PID group to the setpoint,
+ * or with given velocity.
+ */
+static void pid_move(dyio_model_t *m, int g, int setpoint, int velocity, int msec)
+{
+    int position = pid_position(m, g);
+
+    m->pid_group[g].from = position;
+    m->pid_group[g].to = setpoint;
+    m->pid_group[g].velocity = velocity;
+    m->pid_group[g].start = now_usec();
+    m->pid_group[g].end = m->pid_group[g].start + (msec > 0 ? msec : 0) * 1000ULL;
+}
+
+/*
+ * Packet type of the response, as declared in the method table.
+ */
+static int resp_type(int ns, const char *rpc, int query_type)
+{
+    int i;
+
+    for (i=0; i<NMETHODS; i++) {
+        if (method_tab[i].ns == ns && method_tab[i].query_type == query_type &&
+            memcmp(method_tab[i].rpc, rpc, 4) == 0)
+            return method_tab[i].resp_type;
+    }
+    return PKT_POST;
+}
+
+/*
+ * Process the query and send a reply.
+ */
+static void handle(dyio_model_t *m, struct dyio_header *hdr, uint8_t *query, int qlen)
+{
+    uint8_t data[256];
+    const method_t *meth;
+    int ns = hdr->id & ~ID_RESPONSE;
+    int len = 0, i, n, ch;
+    char rpc[5];
+
+    memcpy(rpc, hdr->rpc, 4);
+    rpc[4] = 0;
+    if (m->verbose)
+        printf("--- %s %u '%s' [%u]\n", (hdr->type == PKT_GET) ? "get" : "post",
+            ns, rpc, qlen);
+
+    switch (ns) {
+    case ID_BCS_CORE:
+        if (strcmp(rpc, "_png") == 0)
+            break;
+        if (strcmp(rpc, "_nms") == 0) {
+            if (qlen < 1) {
+                data[len++] = NNAMESPACES;
+                break;
+            }
+            if (query[0] >= NNAMESPACES)
+                goto bad_args;
+            strcpy((char*) data, namespace_name[query[0]]);
+            len = strlen((char*) data) + 1;
+            data[len++] = NNAMESPACES;
+            break;
+        }
+        goto unknown;
+
+    case ID_BCS_RPC:
+        if (qlen < 2)
+            goto bad_args;
+
+        /* Find m-th method of the namespace. */
+        n = 0;
+        meth = 0;
+        for (i=0; i<NMETHODS; i++) {
+            if (method_tab[i].ns != query[0])
+                continue;
+            if (n == query[1])
+                meth = &method_tab[i];
+            n++;
+        }
+        if (! meth)
+            goto bad_args;
+
+        data[len++] = query[0];
+        data[len++] = query[1];
+        if (strcmp(rpc, "_rpc") == 0) {
+            data[len++] = n;
+            memcpy(&data[len], meth->rpc, 4);
+            len += 4;
+            data[len++] = 0;
+            break;
+        }
+        if (strcmp(rpc, "args") == 0) {
+            data[len++] = meth->query_type;
+            data[len++] = meth->nargs;
+            memcpy(&data[len], meth->args, meth->nargs);
+            len += meth->nargs;
+            data[len++] = meth->resp_type;
+            data[len++] = meth->nresp;
+            memcpy(&data[len], meth->resp, meth->nresp);
+            len += meth->nresp;
+            break;
+        }
+        goto unknown;
+
+    case ID_BCS_IO:
+        if (strcmp(rpc, "gchc") == 0) {
+            put_int(data, MODEL_CHANNELS);
+            len = 4;
+            break;
+        }
+        if (strcmp(rpc, "gacm") == 0) {
+            len = all_modes(m, data);
+            break;
+        }
+        if (strcmp(rpc, "gacv") == 0) {
+            len = all_values(m, data);
+            break;
+        }
+        if (strcmp(rpc, "sacv") == 0) {
+            if (qlen < 5 || qlen < 5 + query[4]*4)
+                goto bad_args;
+            n = query[4];
+            for (ch=0; ch<n && ch<MODEL_CHANNELS; ch++)
+                m->chan_value[ch] = get_int(&query[5 + ch*4]);
+            len = all_values(m, data);
+            break;
+        }
+        if (qlen < 1 || query[0] >= MODEL_CHANNELS)
+            goto bad_args;
+        ch = query[0];
+
+        if (strcmp(rpc, "gcml") == 0) {
+            data[len++] = 0;
+            for (i=0; i<MAX_MODES; i++) {
+                if (mode_mask[i] & (1UL << ch)) {
+                    data[len++] = i;
+                    data[0]++;
+                }
+            }
+            break;
+        }
+        if (strcmp(rpc, "gchm") == 0) {
+            data[len++] = ch;
+            data[len++] = m->chan_mode[ch];
+            break;
+        }
+        if (strcmp(rpc, "gchv") == 0) {
+            data[len++] = ch;
+            put_int(&data[len], m->chan_value[ch]);
+            len += 4;
+            break;
+        }
+        if (strcmp(rpc, "strm") == 0 && hdr->type == PKT_GET) {
+            data[len++] = ch;
+            data[len++] = 0;
+            while (data[1] < STREAM_FRAME &&
+                   m->chan_stream[ch].head != m->chan_stream[ch].tail) {
+                data[len++] = m->chan_stream[ch].data[m->chan_stream[ch].head++ % MODEL_STREAM];
+                data[1]++;
+            }
+            break;
+        }
+        if (strcmp(rpc, "strm") == 0) {
+            if (qlen < 2 || qlen < 2 + query[1])
+                goto bad_args;
+            n = (m->chan_mode[ch] == MODE_UART_TX && ch+1 < MODEL_CHANNELS) ? ch+1 : ch;
+            for (i=0; i<query[1]; i++) {
+                if (m->chan_stream[n].tail - m->chan_stream[n].head >= MODEL_STREAM)
+                    break;
+                m->chan_stream[n].data[m->chan_stream[n].tail++ % MODEL_STREAM] = query[2 + i];
+            }
+            data[len++] = ch;
+            data[len++] = 0;
+            break;
+        }
+        if (strcmp(rpc, "asyn") == 0) {
+            if (qlen < 11)
+                goto bad_args;
+            m->chan_async[ch].mode  = query[1];
+            m->chan_async[ch].msec  = get_int(&query[2]);
+            m->chan_async[ch].value = get_int(&query[6]);
+            m->chan_async[ch].edge  = query[10];
+            m->chan_async[ch].last  = m->chan_value[ch];
+            m->chan_async[ch].next  = now_usec();
+            break;
+        }
+        if (strcmp(rpc, "schv") == 0) {
+            if (qlen < 5)
+                goto bad_args;
+            m->chan_value[ch] = get_int(&query[1]);
+            data[len++] = ch;
+            data[len++] = 0;
+            break;
+        }
+        goto unknown;
+
+    case ID_BCS_SETMODE:
+        if (strcmp(rpc, "schm") == 0) {
+            if (qlen < 2 || ! set_mode(m, query[0], query[1]))
+                goto bad_args;
+            len = all_modes(m, data);
+            break;
+        }
+        if (strcmp(rpc, "sacm") == 0) {
+            if (qlen < 1 || qlen < 1 + query[0])
+                goto bad_args;
+            for (ch=0; ch<query[0] && ch<MODEL_CHANNELS; ch++)
+                set_mode(m, ch, query[1 + ch]);
+            len = all_modes(m, data);
+            break;
+        }
+        goto unknown;
+
+    case ID_DYIO:
+        if (strcmp(rpc, "_rev") == 0) {
+            data[len++] = 3;
+            data[len++] = 13;
+            data[len++] = 5;
+            data[len++] = 0;
+            data[len++] = 0;
+            data[len++] = 0;
+            break;
+        }
+        if (strcmp(rpc, "_pwr") == 0) {
+            data[len++] = 0;
+            data[len++] = 0;
+            data[len++] = 0;
+            data[len++] = 0;
+            data[len++] = 1;
+            break;
+        }
+        goto unknown;
+
+    case ID_BCS_PID:
+        if (strcmp(rpc, "gpdc") == 0) {
+            put_int(data, MODEL_GROUPS);
+            len = 4;
+            break;
+        }
+        if (strcmp(rpc, "apid") == 0 && hdr->type == PKT_GET) {
+            data[len++] = MODEL_GROUPS;
+            for (i=0; i<MODEL_GROUPS; i++, len+=4)
+                put_int(&data[len], pid_position(m, i));
+            break;
+        }
+        if (strcmp(rpc, "apid") == 0) {
+            if (qlen < 5 || qlen < 5 + query[4]*4)
+                goto bad_args;
+            for (i=0; i<query[4] && i<MODEL_GROUPS; i++)
+                pid_move(m, i, get_int(&query[5 + i*4]), 0, get_int(query));
+            data[len++] = 0;
+            data[len++] = 0;
+            break;
+        }
+        if (strcmp(rpc, "kpid") == 0) {
+            for (i=0; i<MODEL_GROUPS; i++) {
+                pid_move(m, i, pid_position(m, i), 0, 0);
+                m->pid_group[i].config[1] = 0;
+            }
+            data[len++] = 0;
+            data[len++] = 0;
+            break;
+        }
+        if (qlen < 1 || query[0] >= MODEL_GROUPS)
+            goto bad_args;
+        i = query[0];
+
+        if (strcmp(rpc, "_pid") == 0 && hdr->type == PKT_GET) {
+            data[len++] = i;
+            put_int(&data[len], pid_position(m, i));
+            len += 4;
+            break;
+        }
+        if (strcmp(rpc, "cpid") == 0 && hdr->type == PKT_GET) {
+            memcpy(data, m->pid_group[i].config, MODEL_CPID_LEN);
+            data[0] = i;
+            len = MODEL_CPID_LEN;
+            break;
+        }
+        if (strcmp(rpc, "cpid") == 0) {
+            if (qlen < MODEL_CPID_LEN)
+                goto bad_args;
+            memcpy(m->pid_group[i].config, query, MODEL_CPID_LEN);
+        } else if (strcmp(rpc, "_pid") == 0 || strcmp(rpc, "_vpd") == 0) {
+            if (qlen < 9)
+                goto bad_args;
+            if (rpc[1] == 'p')
+                pid_move(m, i, get_int(&query[1]), 0, get_int(&query[5]));
+            else
+                pid_move(m, i, 0, get_int(&query[1]), get_int(&query[5]));
+        } else if (strcmp(rpc, "rpid") == 0) {
+            if (qlen < 5)
+                goto bad_args;
+            pid_move(m, i, get_int(&query[1]), 0, 0);
+        } else if (strcmp(rpc, "acal") != 0) {
+            goto unknown;
+        }
+        data[len++] = 0;
+        data[len++] = 0;
+        break;
+
+    default:
+    unknown:
+        if (m->verbose)
+            printf("--- unknown method %u '%s'\n", ns, rpc);
+        send_error(m, ns, 0x7f, 0);
+        return;
+    }
+    send_frame(m, resp_type(ns, rpc, hdr->type), ns, rpc, data, len);
+    return;
+
+bad_args:
+    if (m->verbose)
+        printf("--- bad arguments for %u '%s'\n", ns, rpc);
+    send_error(m, ns, 0x7f, 1);
+}
+
+/*
+ * Toggle the input channel, and send asynchronous packets
+ * for the channels, configured by asyn.
+ * Return 1 when some timers are active.
+ */
+static int run_timers(dyio_model_t *m, unsigned long long now)
+{
+    uint8_t data[5];
+    int c, v, last, send, active = 0;
+
+    if (m->toggle_chan >= 0) {
+        if (now >= m->toggle_next) {
+            m->chan_value[m->toggle_chan] = ! m->chan_value[m->toggle_chan];
+            m->toggle_next = now + m->toggle_msec * 1000ULL;
+        }
+        active = 1;
+    }
+
+    for (c=0; c<MODEL_CHANNELS; c++) {
+        v = m->chan_value[c];
+        last = m->chan_async[c].last;
+        send = 0;
+        switch (m->chan_async[c].mode) {
+        default:
+            continue;
+        case ASYN_AUTOSAMP:
+            if (now >= m->chan_async[c].next) {
+                m->chan_async[c].next = now + m->chan_async[c].msec * 1000ULL;
+                send = 1;
+            }
+            break;
+        case ASYN_NOTEQUAL:
+            send = (v != last);
+            break;
+        case ASYN_DEADBAND:
+            send = (v > last + m->chan_async[c].value || v < last - m->chan_async[c].value);
+            break;
+        case ASYN_THRESHOLD:
+            if (last < m->chan_async[c].value && v >= m->chan_async[c].value)
+                send = (m->chan_async[c].edge != ASYN_FALLING);
+            else if (last >= m->chan_async[c].value && v < m->chan_async[c].value)
+                send = (m->chan_async[c].edge != ASYN_RISING);
+            m->chan_async[c].last = v;
+            break;
+        }
+        active = 1;
+        if (send) {
+            data[0] = c;
+            put_int(&data[1], v);
+            send_frame(m, PKT_ASYNC, ID_BCS_IO, "gchv", data, 5);
+            m->chan_async[c].last = v;
+        }
+    }
+    return active;
+}
+
+/*
+ * Extract and process all complete frames from the input buffer.
+ * On a bad header, skip one byte and look for the next frame.
+ * Return number of bytes consumed.
+ */
+static int parse_input(dyio_model_t *m, uint8_t *buf, int len)
+{
+    struct dyio_header *hdr;
+    int pos = 0, qlen, i;
+    uint8_t sum;
+
+    while (len - pos >= sizeof(*hdr)) {
+        hdr = (struct dyio_header*) (buf + pos);
+        if (hdr->proto != PROTO_VERSION || hdr->hsum != header_sum(hdr) ||
+            hdr->datalen < sizeof(hdr->rpc)) {
+            pos++;
+            continue;
+        }
+        qlen = hdr->datalen - sizeof(hdr->rpc);
+        if (len - pos < sizeof(*hdr) + qlen + 1)
+            break;
+
+        sum = hdr->rpc[0] + hdr->rpc[1] + hdr->rpc[2] + hdr->rpc[3];
+        for (i=0; i<qlen; i++)
+            sum += buf[pos + sizeof(*hdr) + i];
+        if (sum != buf[pos + sizeof(*hdr) + qlen]) {
+            if (m->verbose)
+                printf("--- bad data sum\n");
+            pos++;
+            continue;
+        }
+        handle(m, hdr, buf + pos + sizeof(*hdr), qlen);
+        pos += sizeof(*hdr) + qlen + 1;
+    }
+    return pos;
+}
+
+/*
+ * Create the model in initial state.
+ */
+dyio_model_t *_dyio_model_create()
+{
+    static const uint8_t mac[6] = { 0x74, 0xf7, 0x26, 0x00, 0x00, 0x01 };
+    dyio_model_t *m;
+    int c;
+
+    m = calloc(1, sizeof(dyio_model_t));
+    if (! m)
+        return 0;
+    memcpy(m->mac, mac, sizeof(mac));
+    m->toggle_chan = -1;
+    for (c=0; c<MODEL_CHANNELS; c++)
+        set_mode(m, c, MODE_DI);
+    return m;
+}
+
+/*
+ * Process bytes, sent to the device.
+ */
+void _dyio_model_input(dyio_model_t *m, const unsigned char *data, int len)
+{
+    int n;
+
+    while (len > 0) {
+        n = MODEL_INBUF - m->inlen;
+        if (n > len)
+            n = len;
+        memcpy(m->inbuf + m->inlen, data, n);
+        m->inlen += n;
+        data += n;
+        len -= n;
+
+        n = parse_input(m, m->inbuf, m->inlen);
+        memmove(m->inbuf, m->inbuf + n, m->inlen - n);
+        m->inlen -= n;
+        if (m->inlen == MODEL_INBUF) {
+            /* Garbage: drop it. */
+            m->inlen = 0;
+        }
+    }
+}
+
+/*
+ * Get replies, which are due at the given time.
+ */
+int _dyio_model_output(dyio_model_t *m, unsigned char *buf, int len,
+    unsigned long long now)
+{
+    dyio_model_frame_t *p;
+    int n = 0;
+
+    while (m->pending_head != m->pending_tail) {
+        p = &m->pending[m->pending_head % MODEL_PENDING];
+        if (p->due > now || n + p->len > len)
+            break;
+        memcpy(buf + n, p->frame, p->len);
+        n += p->len;
+        m->pending_head++;
+    }
+    return n;
+}
+
+/*
+ * Run timers, and get time of the next event.
+ * Active timers are polled every millisecond.
+ */
+unsigned long long _dyio_model_run(dyio_model_t *m, unsigned long long now)
+{
+    unsigned long long next = 0, due;
+
+    if (run_timers(m, now))
+        next = now + 1000;
+    if (m->pending_head != m->pending_tail) {
+        due = m->pending[m->pending_head % MODEL_PENDING].due;
+        if (! next || due < next)
+            next = due;
+    }
+    return next;
+}
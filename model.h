@@ -0,0 +1,104 @@
+/*
+ * DyIO library: software model of the DyIO device.
+ * Used by the simulator on a pseudo-terminal, and by the loopback
+ * transport inside the library.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#define MODEL_CHANNELS  24          /* Number of simulated channels */
+#define MODEL_PENDING   256         /* Max replies waiting for transmission */
+#define MODEL_GROUPS    8           /* Number of simulated PID groups */
+#define MODEL_STREAM    65536       /* Size of stream buffer per channel */
+#define MODEL_INBUF     4096        /* Size of input buffer */
+#define MODEL_FRAME     (15 + 256)  /* Max length of frame */
+#define MODEL_CPID_LEN  34          /* Length of cpid arguments */
+
+/*
+ * Reply, scheduled for transmission at given time.
+ */
+typedef struct {
+    unsigned long long due;         /* Time of transmission, microseconds */
+    int             len;            /* Length of frame */
+    unsigned char   frame[MODEL_FRAME];
+} dyio_model_frame_t;
+
+typedef struct {
+    /* Options, set by the user of the model. */
+    int             verbose;        /* Trace queries */
+    int             latency;        /* Reply delay, microseconds */
+    int             jitter;         /* Random variation of delay */
+    double          corrupt_rate;   /* Probability of corrupted frame */
+    int             toggle_chan;    /* Input channel, toggled periodically, or -1 */
+    int             toggle_msec;    /* Period of toggling */
+    unsigned long long toggle_next; /* Time of next toggle */
+
+    unsigned char   mac[6];
+    unsigned char   chan_mode[MODEL_CHANNELS];
+    int             chan_value[MODEL_CHANNELS];
+
+    /* Asynchronous mode of every channel. */
+    struct {
+        int         mode;           /* ASYN_xxx, or 0 when disabled */
+        int         msec;           /* Period for ASYN_AUTOSAMP */
+        int         value;          /* Band or threshold */
+        int         edge;           /* Edge for ASYN_THRESHOLD */
+        int         last;           /* Last reported value */
+        unsigned long long next;    /* Time of next sample */
+    } chan_async[MODEL_CHANNELS];
+
+    /* PID groups. Position moves linearly from the start point
+     * to the setpoint, or with constant velocity. */
+    struct {
+        unsigned char config[MODEL_CPID_LEN]; /* Arguments of last cpid */
+        int         from;           /* Position at start of motion */
+        int         to;             /* Setpoint */
+        int         velocity;       /* Units per second, or 0 */
+        unsigned long long start;   /* Time of start of motion */
+        unsigned long long end;     /* Time of end of motion */
+    } pid_group[MODEL_GROUPS];
+
+    /* Input streams of channels. Data, written to the UART transmit
+     * channel, come back on the receive channel; other outputs are
+     * looped back to the same channel. */
+    struct {
+        unsigned char data[MODEL_STREAM];
+        unsigned    head;           /* Offset of first byte */
+        unsigned    tail;           /* Offset of next byte */
+    } chan_stream[MODEL_CHANNELS];
+
+    /* Replies, waiting for transmission. */
+    dyio_model_frame_t pending[MODEL_PENDING];
+    unsigned        pending_head, pending_tail;
+    unsigned long long last_due;
+
+    /* Input bytes, not yet parsed. */
+    unsigned char   inbuf[MODEL_INBUF];
+    int             inlen;
+} dyio_model_t;
+
+/*
+ * Create the model in initial state: all channels are digital inputs.
+ * Return 0 when out of memory.
+ */
+dyio_model_t *_dyio_model_create(void);
+
+/*
+ * Process bytes, sent to the device.
+ */
+void _dyio_model_input(dyio_model_t *m, const unsigned char *data, int len);
+
+/*
+ * Get replies, which are due at the given time: whole frames,
+ * as many as fit into the buffer. Return number of bytes.
+ */
+int _dyio_model_output(dyio_model_t *m, unsigned char *buf, int len,
+    unsigned long long now);
+
+/*
+ * Run timers: toggle the input channel, and queue asynchronous
+ * packets. Return time of the next event, or 0 when idle.
+ */
+unsigned long long _dyio_model_run(dyio_model_t *m, unsigned long long now);
@@ -0,0 +1,238 @@
+/*
+ * DyIO library: API of bcs.pid namespace.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dyio.h"
+
+/*
+ * Report the failure of a call.
+ */
+static void report(int result, const char *rpc)
+{
+    if (result == DYIO_ETIMEOUT)
+        printf("dyio: no reply to %s\n", rpc);
+    else if (result == -1)
+        printf("dyio: incorrect %s reply\n", rpc);
+    else
+        printf("dyio: %s failed, error %d\n", rpc, result);
+}
+
+/*
+ * Check the result of a call, which replies with status and code.
+ * Return 0 on success, or -1 on error.
+ */
+static int check_status(dyio_t *d, int result, const char *rpc,
+    int status, int code)
+{
+    if (result < 0) {
+        report(result, rpc);
+        return -1;
+    }
+    if (status != 0) {
+        printf("dyio: %s failed: status %u, code %u\n", rpc, status, code);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Get number of PID groups.
+ */
+int dyio_pid_count(dyio_t *d)
+{
+    int count, result;
+
+    result = dyio_rpc_get_pid_count(d, &count);
+    if (result < 0) {
+        report(result, "gpdc");
+        return -1;
+    }
+    if (count < 0)
+        count = 0;
+    if (count > RPC_MAX_GROUPS)
+        count = RPC_MAX_GROUPS;
+    return count;
+}
+
+/*
+ * Get configuration of the PID group.
+ */
+int dyio_get_pid_config(dyio_t *d, int group, dyio_pid_config_t *cfg)
+{
+    int result;
+
+    result = dyio_rpc_get_pid_config(d, group, &cfg->group, &cfg->enabled,
+        &cfg->inverted, &cfg->async, &cfg->kp, &cfg->ki, &cfg->kd,
+        &cfg->latch, &cfg->use_latch, &cfg->stop_on_latch,
+        &cfg->stop, &cfg->upper, &cfg->lower);
+    if (result < 0) {
+        report(result, "cpid");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Set configuration of the PID group.
+ */
+int dyio_set_pid_config(dyio_t *d, const dyio_pid_config_t *cfg)
+{
+    int status = 0, code = 0, result;
+
+    result = dyio_rpc_set_pid_config(d, cfg->group, cfg->enabled,
+        cfg->inverted, cfg->async, cfg->kp, cfg->ki, cfg->kd,
+        cfg->latch, cfg->use_latch, cfg->stop_on_latch,
+        cfg->stop, cfg->upper, cfg->lower, &status, &code);
+    return check_status(d, result, "cpid", status, code);
+}
+
+/*
+ * Read current position of the PID group into *position.
+ */
+int dyio_read_pid(dyio_t *d, int group, int *position)
+{
+    int result;
+
+    result = dyio_rpc_get_pid(d, group, 0, position);
+    if (result < 0) {
+        report(result, "_pid");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Get current position of the PID group.
+ */
+int dyio_get_pid(dyio_t *d, int group)
+{
+    int position;
+
+    if (dyio_read_pid(d, group, &position) < 0)
+        return -1;
+    return position;
+}
+
+/*
+ * Move the PID group to the setpoint, in given time.
+ */
+int dyio_set_pid(dyio_t *d, int group, int setpoint, int msec)
+{
+    int status = 0, code = 0, result;
+
+    result = dyio_rpc_set_pid(d, group, setpoint, msec, &status, &code);
+    return check_status(d, result, "_pid", status, code);
+}
+
+/*
+ * Run the PID group at given velocity, for given time.
+ */
+int dyio_set_pid_velocity(dyio_t *d, int group, int velocity, int msec)
+{
+    int status = 0, code = 0, result;
+
+    result = dyio_rpc_set_pid_velocity(d, group, velocity, msec, &status, &code);
+    return check_status(d, result, "_vpd", status, code);
+}
+
+/*
+ * Get current positions of all PID groups, in one request.
+ * Return number of groups, or -1 on error.
+ */
+int dyio_get_all_pid(dyio_t *d, int *position)
+{
+    int ngroups, result;
+
+    result = dyio_rpc_get_all_pid(d, &ngroups, position);
+    if (result < 0) {
+        report(result, "apid");
+        return -1;
+    }
+    return ngroups;
+}
+
+/*
+ * Set setpoints of all PID groups, in one request.
+ */
+int dyio_set_all_pid(dyio_t *d, int msec, int ngroups, const int *setpoint)
+{
+    int status = 0, code = 0, result;
+
+    result = dyio_rpc_set_all_pid(d, msec, ngroups, setpoint, &status, &code);
+    return check_status(d, result, "apid", status, code);
+}
+
+/*
+ * One cycle of closed-loop supervision: post new setpoints
+ * and get positions of all groups. Both queries are sent
+ * in one write, and the replies come back-to-back.
+ */
+int dyio_pid_cycle(dyio_t *d, int msec, int ngroups, const int *setpoint,
+    int *position)
+{
+    int status = 0, code = 0, set_tag, get_tag, result;
+
+    /* Both requests are in flight together: one round-trip. */
+    _dyio_hold(d);
+    set_tag = dyio_pipe_set_all_pid(d, 2, msec, ngroups, setpoint);
+    get_tag = dyio_pipe_get_all_pid(d, 2);
+
+    result = dyio_wait_reply(d, set_tag);
+    if (result >= 0)
+        result = dyio_decode_set_all_pid(d, &status, &code);
+    if (check_status(d, result, "apid", status, code) < 0) {
+        dyio_wait_reply(d, get_tag);
+        _dyio_release(d);
+        return -1;
+    }
+
+    result = dyio_wait_reply(d, get_tag);
+    if (result >= 0)
+        result = dyio_decode_get_all_pid(d, &ngroups, position);
+    if (result < 0)
+        report(result, "apid");
+    _dyio_release(d);
+    if (result < 0)
+        return -1;
+    return ngroups;
+}
+
+/*
+ * Reset the position counter of the PID group.
+ */
+int dyio_reset_pid(dyio_t *d, int group, int position)
+{
+    int status = 0, code = 0, result;
+
+    result = dyio_rpc_reset_pid(d, group, position, &status, &code);
+    return check_status(d, result, "rpid", status, code);
+}
+
+/*
+ * Stop all PID loops immediately.
+ */
+int dyio_kill_all_pid(dyio_t *d)
+{
+    int status = 0, code = 0, result;
+
+    result = dyio_rpc_kill_all_pid(d, &status, &code);
+    return check_status(d, result, "kpid", status, code);
+}
+
+/*
+ * Start calibration of the PID group.
+ */
+int dyio_calibrate_pid(dyio_t *d, int group)
+{
+    int status = 0, code = 0, result;
+
+    result = dyio_rpc_calibrate_pid(d, group, &status, &code);
+    return check_status(d, result, "acal", status, code);
+}
@@ -0,0 +1,312 @@
+/*
+ * DyIO library: timer-driven player of channel trajectories.
+ *
+ * A dedicated thread wakes up on an absolute schedule of the
+ * monotonic clock, and sends values of the played channels every
+ * tick: one sacv frame when all channels are played, otherwise
+ * schv frames in one write, so other channels are not touched.
+ * The firmware interpolates every output over the tick period,
+ * so the motion is smooth.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "dyio.h"
+
+#if defined(__WIN32__) || defined(WIN32)
+#   include <windows.h>
+#endif
+
+struct _dyio_player_t {
+    pthread_t           thread;
+    dyio_setpoint_t     *point;         /* Setpoints, sorted by channel and time */
+    int                 first[MAX_CHANNELS]; /* Index of first setpoint of channel */
+    int                 count[MAX_CHANNELS]; /* Number of setpoints of channel */
+    int                 value[MAX_CHANNELS]; /* Values of all channels */
+    int                 num_channels;
+    unsigned long long  mask;           /* Channels in the trajectory */
+    int                 nplayed;        /* Number of channels in the trajectory */
+    unsigned long       period;         /* Tick period, usec */
+    unsigned long       duration;       /* Time of last setpoint, msec */
+    volatile int        stop;           /* Request to stop */
+    volatile int        done;           /* Trajectory finished */
+    dyio_play_stats_t   stats;
+};
+
+/*
+ * Sort setpoints by channel, then by time.
+ */
+static int compare_points(const void *a, const void *b)
+{
+    const dyio_setpoint_t *p = a, *q = b;
+
+    if (p->ch != q->ch)
+        return p->ch - q->ch;
+    if (p->msec != q->msec)
+        return (p->msec < q->msec) ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Sleep until the given time of the monotonic clock.
+ */
+static void sleep_until(unsigned long long usec)
+{
+#if defined(__WIN32__) || defined(WIN32)
+    unsigned long long now = _dyio_usec();
+
+    if (usec > now)
+        Sleep((usec - now) / 1000);
+#else
+    struct timespec ts;
+
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = usec % 1000000 * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+        continue;
+#endif
+}
+
+/*
+ * Compute values of all channels at the given time.
+ * Setpoints of every channel are interpolated linearly.
+ * Before the first setpoint, the channel keeps its value.
+ */
+static void compute_values(dyio_player_t *p, unsigned long msec)
+{
+    dyio_setpoint_t *a, *b;
+    int c, i;
+
+    for (c=0; c<p->num_channels; c++) {
+        if (p->count[c] == 0)
+            continue;
+        a = &p->point[p->first[c]];
+        if (msec < a->msec)
+            continue;
+
+        /* Find the segment. */
+        for (i=1; i<p->count[c] && a[i].msec <= msec; i++)
+            continue;
+        if (i >= p->count[c]) {
+            p->value[c] = a[i-1].value;
+            continue;
+        }
+        b = &a[i];
+        a = &a[i-1];
+        p->value[c] = a->value + (long long) (b->value - a->value) *
+            (long) (msec - a->msec) / (long) (b->msec - a->msec);
+    }
+}
+
+/*
+ * Send values of the played channels, and wait for replies
+ * until the end of the tick.
+ * Return 0 on success, or -1 when a reply was lost.
+ */
+static int send_values(dyio_t *d, dyio_player_t *p, unsigned long long deadline)
+{
+    int tag[MAX_CHANNELS], period_msec = p->period / 1000;
+    int status = 0, n = 0, c;
+
+    _dyio_hold(d);
+    if (p->nplayed == p->num_channels) {
+        tag[n++] = dyio_queue_set_all_values(d, period_msec,
+            p->num_channels, p->value);
+    } else {
+        for (c=0; c<p->num_channels; c++) {
+            if (p->mask & (1ULL << c))
+                tag[n++] = dyio_pipe_set_value(d, p->nplayed,
+                    c, p->value[c], period_msec);
+        }
+    }
+    for (c=0; c<n; c++) {
+        if (dyio_wait_reply_until(d, tag[c], deadline) < 0)
+            status = -1;
+    }
+    _dyio_release(d);
+    return status;
+}
+
+/*
+ * Thread of the player.
+ */
+static void *player_loop(void *arg)
+{
+    dyio_t *d = arg;
+    dyio_player_t *p = d->player;
+    unsigned long long start, next, now;
+    unsigned long msec;
+    int lost, overruns;
+
+    start = _dyio_usec();
+    next = start;
+    while (! p->stop) {
+        /* Values at the end of this tick: the firmware
+         * moves the outputs there during the period. */
+        msec = (next - start + p->period) / 1000;
+        compute_values(p, msec);
+        lost = (send_values(d, p, next + p->period) < 0);
+
+        if (msec >= p->duration) {
+            _dyio_lock(d);
+            p->stats.lost += lost;
+            p->stats.ticks++;
+            _dyio_unlock(d);
+            break;
+        }
+
+        /* Keep the schedule: skip the ticks, which are missed. */
+        next += p->period;
+        now = _dyio_usec();
+        for (overruns=0; next < now; overruns++)
+            next += p->period;
+        sleep_until(next);
+
+        /* Statistics are read by other threads, with the device locked. */
+        now = _dyio_usec();
+        _dyio_lock(d);
+        p->stats.lost += lost;
+        p->stats.ticks++;
+        p->stats.overruns += overruns;
+        if (now > next && now - next > p->stats.max_late)
+            p->stats.max_late = now - next;
+        _dyio_unlock(d);
+    }
+
+    /* Values of played channels in the shadow are not valid anymore. */
+    _dyio_lock(d);
+    d->shadow_known &= ~p->mask;
+    p->done = 1;
+    _dyio_unlock(d);
+    return 0;
+}
+
+/*
+ * Start playing the trajectory at given rate of ticks per second.
+ */
+int dyio_play(dyio_t *d, const dyio_setpoint_t *points, int npoints, int rate)
+{
+    dyio_player_t *p;
+    int c, i;
+
+    if (d->player) {
+        printf("dyio: player is already running\n");
+        return -1;
+    }
+    if (rate < 1 || rate > 1000) {
+        printf("dyio: bad player rate %d ticks/sec\n", rate);
+        return -1;
+    }
+    if (npoints < 1) {
+        printf("dyio: no setpoints to play\n");
+        return -1;
+    }
+    p = calloc(1, sizeof(dyio_player_t));
+    if (p)
+        p->point = calloc(npoints, sizeof(dyio_setpoint_t));
+    if (! p || ! p->point) {
+        fprintf(stderr, "dyio: Out of memory\n");
+        free(p);
+        return -1;
+    }
+    memcpy(p->point, points, npoints * sizeof(dyio_setpoint_t));
+    qsort(p->point, npoints, sizeof(dyio_setpoint_t), compare_points);
+    p->period = 1000000 / rate;
+
+    /* Start from current values of all channels. */
+    p->num_channels = dyio_get_all_values(d, p->value);
+    if (p->num_channels < 0) {
+        printf("dyio: cannot get channel values, status %d\n", p->num_channels);
+        free(p->point);
+        free(p);
+        return -1;
+    }
+    for (i=0; i<npoints; i++) {
+        c = p->point[i].ch;
+        if (c < 0 || c >= p->num_channels) {
+            printf("dyio: bad channel %d in trajectory\n", c);
+            free(p->point);
+            free(p);
+            return -1;
+        }
+        if (p->count[c]++ == 0)
+            p->first[c] = i;
+        if (p->point[i].msec > p->duration)
+            p->duration = p->point[i].msec;
+        if (! (p->mask & (1ULL << c)))
+            p->nplayed++;
+        p->mask |= 1ULL << c;
+    }
+
+    /* Calls from the player thread need locking. */
+    if (dyio_start_reader(d) < 0) {
+        free(p->point);
+        free(p);
+        return -1;
+    }
+    d->player = p;
+    if (pthread_create(&p->thread, 0, player_loop, d) != 0) {
+        fprintf(stderr, "dyio: cannot create player thread\n");
+        d->player = 0;
+        free(p->point);
+        free(p);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Wait until the trajectory is finished, or stop it immediately.
+ * Get statistics of the player, when st is not null.
+ */
+static void finish(dyio_t *d, int stop, dyio_play_stats_t *st)
+{
+    dyio_player_t *p = d->player;
+
+    if (! p)
+        return;
+    p->stop = stop;
+    pthread_join(p->thread, 0);
+    if (st)
+        *st = p->stats;
+    d->player = 0;
+    free(p->point);
+    free(p);
+}
+
+void dyio_play_wait(dyio_t *d, dyio_play_stats_t *st)
+{
+    finish(d, 0, st);
+}
+
+void dyio_play_stop(dyio_t *d, dyio_play_stats_t *st)
+{
+    finish(d, 1, st);
+}
+
+/*
+ * Check whether the player is still running.
+ * Get current statistics, when st is not null.
+ */
+int dyio_play_active(dyio_t *d, dyio_play_stats_t *st)
+{
+    dyio_player_t *p = d->player;
+    int active;
+
+    if (! p)
+        return 0;
+    _dyio_lock(d);
+    if (st)
+        *st = p->stats;
+    active = ! p->done;
+    _dyio_unlock(d);
+    return active;
+}
@@ -82,29 +82,25 @@ static const char *mode_name(int mode)
  */
 void dyio_info(dyio_t *d)
 {
-    int voltage;
+    int major, minor, build, right, left, voltage, override;
 
     /* Print firmware revision. */
-    dyio_call(d, PKT_GET, ID_DYIO, "_rev", 0, 0);
-    if (d->reply_len < 6) {
+    if (dyio_rpc_get_revision(d, &major, &minor, &build, 0, 0, 0) < 0) {
         printf("dyio-info: incorrect _rev reply: length %u bytes\n", d->reply_len);
         exit(-1);
     }
-    printf("Firmware Revision: %u.%u.%u\n",
-        d->reply[0], d->reply[1], d->reply[2]);
+    printf("Firmware Revision: %u.%u.%u\n", major, minor, build);
 
     /* Print voltage and power status. */
-    dyio_call(d, PKT_GET, ID_DYIO, "_pwr", 0, 0);
-    if (d->reply_len < 5) {
+    if (dyio_rpc_get_power(d, &right, &left, &voltage, &override) < 0) {
         printf("dyio-info: incorrect _pwr reply: length %u bytes\n", d->reply_len);
         exit(-1);
     }
-    voltage = (d->reply[2] << 8) | d->reply[3];
     printf("Power Input: %.1fV, Override=%u\n",
-        voltage / 1000.0, d->reply[4]);
+        voltage / 1000.0, override);
     printf("Rail Power Source: Right=%s, Left=%s\n",
-        d->reply[0] ? "Internal" : "External",
-        d->reply[1] ? "Internal" : "External");
+        right ? "Internal" : "External",
+        left ? "Internal" : "External");
 }
 
 /*
@@ -112,66 +108,27 @@ void dyio_info(dyio_t *d)
  */
 void dyio_print_namespaces(dyio_t *d)
 {
-    int query_type, resp_type, num_args, num_resp;
-    int num_spaces, ns, num_methods, m;
-    uint8_t query[2], *args, *resp;
-    char rpc[5];
+    dyio_rpc_table_t *t = dyio_get_rpc_table(d);
+    dyio_method_t *mt;
+    int ns, m;
 
-    /* Query the number of namespaces. */
-    dyio_call(d, PKT_GET, ID_BCS_CORE, "_nms", 0, 0);
-    if (d->reply_len < 1) {
-        printf("dyio-info: incorrect _nms reply: length %u bytes\n", d->reply_len);
-        exit(-1);
-    }
-    num_spaces = d->reply[0];
+    if (! t)
+        return;
 
     /* Print info about every namespace. */
-    for (ns=0; ns<num_spaces; ns++) {
-        query[0] = ns;
-        dyio_call(d, PKT_GET, ID_BCS_CORE, "_nms", query, 1);
-        if (d->reply_len < 1) {
-            printf("dyio-info: incorrect _nms[%u] reply\n", ns);
-            exit(-1);
-        }
-        printf("Namespace %u: %s\n", ns, d->reply);
+    for (ns=0; ns<t->num_spaces; ns++) {
+        printf("Namespace %u: %s\n", ns, t->space_name[ns]);
 
         /* Print available methods. */
-        num_methods = 1;
-        for (m=0; m<num_methods; m++) {
-            /* Get method name (RPC). */
-            query[0] = ns;
-            query[1] = m;
-            dyio_call(d, PKT_GET, ID_BCS_RPC, "_rpc", query, 2);
-            if (d->reply_len < 7) {
-                printf("dyio-info: incorrect _rpc[%u] reply\n", ns);
-                exit(-1);
-            }
-            num_methods = d->reply[2];
-            rpc[0] = d->reply[3];
-            rpc[1] = d->reply[4];
-            rpc[2] = d->reply[5];
-            rpc[3] = d->reply[6];
-            rpc[4] = 0;
-
-            /* Get method args. */
-            query[0] = ns;
-            query[1] = m;
-            dyio_call(d, PKT_GET, ID_BCS_RPC, "args", query, 2);
-            if (d->reply_len < 6) {
-                printf("dyio-info: incorrect args[%u] reply\n", ns);
-                exit(-1);
-            }
-            query_type = d->reply[2];
-            num_args = d->reply[3];
-            args = &d->reply[4];
-            resp_type = d->reply[4 + num_args];
-            num_resp = d->reply[5 + num_args];
-            resp = &d->reply[6 + num_args];
-
-            printf("    %s %s(", rpc, pkt_name(query_type));
-            print_args(num_args, args);
-            printf(") -> %s(", pkt_name(resp_type));
-            print_args(num_resp, resp);
+        for (m=0; m<t->num_methods; m++) {
+            mt = &t->method[m];
+            if (mt->ns != ns)
+                continue;
+
+            printf("    %.4s %s(", mt->rpc, pkt_name(mt->query_type));
+            print_args(mt->nargs, mt->args);
+            printf(") -> %s(", pkt_name(mt->resp_type));
+            print_args(mt->nresp, mt->resp);
             printf(")\n");
         }
     }
@@ -182,34 +139,11 @@ void dyio_print_namespaces(dyio_t *d)
  */
 void dyio_print_channel_features(dyio_t *d)
 {
-    int num_channels, c, num_modes, i, m;
-    uint8_t query[1], chan_feature[MAX_CHANNELS][MAX_MODES];
-
-    /* Get number of channels. */
-    dyio_call(d, PKT_GET, ID_BCS_IO, "gchc", 0, 0);
-    if (d->reply_len < 4) {
-        printf("dyio-info: incorrect gchc reply: length %u bytes\n", d->reply_len);
-        exit(-1);
-    }
-    num_channels = d->reply[3];
-    memset(chan_feature, 0, sizeof(chan_feature));
-
-    /* Build a matrix of channel features. */
-    for (c=0; c<num_channels; c++) {
-        /* Get a list of channel modes. */
-        query[0] = c;
-        dyio_call(d, PKT_GET, ID_BCS_IO, "gcml", query, 1);
-        if (d->reply_len < 1) {
-            printf("dyio-info: incorrect gcml[%u] reply\n", c);
-            exit(-1);
-        }
-        num_modes = d->reply[0];
+    int num_channels, c, m;
 
-        for (i=0; i<num_modes; i++) {
-            m = d->reply[1+i];
-            chan_feature[c][m] = 1;
-        }
-    }
+    /* Get number of channels and build the matrix of features. */
+    num_channels = dyio_num_channels(d);
+    dyio_channel_supports(d, 0, MODE_NO_CHANGE);
 
     printf("\n");
     printf("Channel Features:                             1 1 1 1 1 1 1 1 1 1 2 2 2 2\n");
@@ -220,7 +154,7 @@ void dyio_print_channel_features(dyio_t *d)
 
         printf("    %-22s", mode_name(m));
         for (c=0; c<num_channels; c++) {
-            printf("%c ", chan_feature[c][m] ? '+' : '.');
+            printf("%c ", (dyio_channel_supports(d, c, m) > 0) ? '+' : '.');
         }
         printf("\n");
     }
@@ -232,28 +166,14 @@ void dyio_print_channel_features(dyio_t *d)
 void dyio_print_channels(dyio_t *d)
 {
     int num_channels, c;
-    uint8_t chan_mode[MAX_CHANNELS], *p;
-    int chan_value[MAX_CHANNELS];
-
-    /* Get current channel modes. */
-    dyio_call(d, PKT_GET, ID_BCS_IO, "gacm", 0, 0);
-    if (d->reply_len < 1) {
-        printf("dyio-info: incorrect gacm reply: length %u bytes\n", d->reply_len);
-        exit(-1);
-    }
-    num_channels = d->reply[0];
-    memcpy(chan_mode, &d->reply[1], num_channels);
+    int chan_mode[MAX_CHANNELS], chan_value[MAX_CHANNELS];
 
-    /* Get current pin values. */
-    dyio_call(d, PKT_GET, ID_BCS_IO, "gacv", 0, 0);
-    if (d->reply_len < 1) {
+    /* Get current channel modes and pin values. */
+    num_channels = dyio_get_all_modes(d, chan_mode);
+    if (num_channels < 0 || dyio_get_all_values(d, chan_value) < num_channels) {
         printf("dyio-info: incorrect gacv reply: length %u bytes\n", d->reply_len);
         exit(-1);
     }
-    for (c=0; c<num_channels; c++) {
-        p = &d->reply[1 + c*4];
-        chan_value[c] = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
-    }
 
     printf("\nChannel Status:\n");
     for (c=0; c<num_channels; c++) {
@@ -261,3 +181,23 @@ void dyio_print_channels(dyio_t *d)
             mode_name(chan_mode[c]), chan_value[c]);
     }
 }
+
+/*
+ * Display statistics of the link.
+ */
+void dyio_print_stats(dyio_t *d)
+{
+    const dyio_stat_t *s;
+    int count, i;
+
+    s = dyio_get_stats(d, &count);
+    printf("\nLink Statistics: %lu resyncs\n", d->resyncs);
+    printf("    NS RPC   Calls   Tx bytes   Rx bytes BadSum Resend Retry Tmout   p50us   p99us   max us\n");
+    for (i=0; i<count; i++, s++) {
+        printf("    %2u %.4s %7lu %10lu %10lu %6lu %6lu %5lu %5lu %7lu %7lu %8lu\n",
+            s->ns, s->rpc, s->calls, s->bytes_tx, s->bytes_rx,
+            s->bad_sums, s->resends, s->retried, s->timeouts,
+            dyio_stat_percentile(s, 50), dyio_stat_percentile(s, 99),
+            s->max_usec);
+    }
+}
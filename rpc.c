@@ -0,0 +1,284 @@
+/*
+ * DyIO library: typed RPC stubs, generated from schema.h.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "dyio.h"
+
+/*
+ * Encoders: put a value into the buffer, return next position.
+ * Arrays return 0 when the count does not fit.
+ */
+static inline uint8_t *put_U8(uint8_t *p, int v)
+{
+    p[0] = v;
+    return p + 1;
+}
+
+static inline uint8_t *put_I16(uint8_t *p, int v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+    return p + 2;
+}
+
+static inline uint8_t *put_I32(uint8_t *p, int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+static inline uint8_t *put_F100(uint8_t *p, double v)
+{
+    return put_I32(p, (int) (v * 100 + (v < 0 ? -0.5 : 0.5)));
+}
+
+static inline uint8_t *put_F1K(uint8_t *p, double v)
+{
+    return put_I32(p, (int) (v * 1000 + (v < 0 ? -0.5 : 0.5)));
+}
+
+static inline uint8_t *put_U8A(uint8_t *p, int count, const int *v, int max)
+{
+    int i;
+
+    if (count < 0 || count > max) {
+        fprintf(stderr, "dyio: incorrect array length %d, max %d\n", count, max);
+        return 0;
+    }
+    *p++ = count;
+    for (i=0; i<count; i++)
+        *p++ = v[i];
+    return p;
+}
+
+static inline uint8_t *put_I32A(uint8_t *p, int count, const int *v, int max)
+{
+    int i;
+
+    if (count < 0 || count > max) {
+        fprintf(stderr, "dyio: incorrect array length %d, max %d\n", count, max);
+        return 0;
+    }
+    *p++ = count;
+    for (i=0; i<count; i++)
+        p = put_I32(p, v[i]);
+    return p;
+}
+
+/*
+ * Decoders: get a value from the reply, return next position.
+ * Return 0 when the reply is too short, or the position is 0 already.
+ * Values are stored only when the pointer is not null.
+ */
+static inline const uint8_t *get_U8(const uint8_t *p, const uint8_t *end, int *v)
+{
+    if (! p || p + 1 > end)
+        return 0;
+    if (v)
+        *v = p[0];
+    return p + 1;
+}
+
+static inline const uint8_t *get_I16(const uint8_t *p, const uint8_t *end, int *v)
+{
+    if (! p || p + 2 > end)
+        return 0;
+    if (v)
+        *v = (int16_t) (p[0] << 8 | p[1]);
+    return p + 2;
+}
+
+static inline const uint8_t *get_I32(const uint8_t *p, const uint8_t *end, int *v)
+{
+    if (! p || p + 4 > end)
+        return 0;
+    if (v)
+        *v = (int32_t) ((uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]);
+    return p + 4;
+}
+
+static inline const uint8_t *get_F100(const uint8_t *p, const uint8_t *end, double *v)
+{
+    int i;
+
+    p = get_I32(p, end, &i);
+    if (p && v)
+        *v = i / 100.0;
+    return p;
+}
+
+static inline const uint8_t *get_F1K(const uint8_t *p, const uint8_t *end, double *v)
+{
+    int i;
+
+    p = get_I32(p, end, &i);
+    if (p && v)
+        *v = i / 1000.0;
+    return p;
+}
+
+static inline const uint8_t *get_U8A(const uint8_t *p, const uint8_t *end,
+    int *count, int *v, int max)
+{
+    int n, i;
+
+    if (! p || p + 1 > end || p + 1 + p[0] > end)
+        return 0;
+    n = *p++;
+    if (count)
+        *count = (n < max) ? n : max;
+    for (i=0; i<n; i++, p++) {
+        if (v && i < max)
+            v[i] = *p;
+    }
+    return p;
+}
+
+static inline const uint8_t *get_I32A(const uint8_t *p, const uint8_t *end,
+    int *count, int *v, int max)
+{
+    int n, i;
+
+    if (! p || p + 1 > end || p + 1 + p[0]*4 > end)
+        return 0;
+    n = *p++;
+    if (count)
+        *count = (n < max) ? n : max;
+    for (i=0; i<n; i++)
+        p = get_I32(p, end, (v && i < max) ? &v[i] : 0);
+    return p;
+}
+
+static inline const uint8_t *get_ASCIIZ(const uint8_t *p, const uint8_t *end,
+    char *v, int max)
+{
+    int n;
+
+    if (! p)
+        return 0;
+    n = strnlen((const char*) p, end - p);
+    if (v) {
+        memcpy(v, p, (n < max) ? n : max-1);
+        v[(n < max) ? n : max-1] = 0;
+    }
+    p += n;
+    if (p < end)
+        p++;
+    return p;
+}
+
+/*
+ * Size of fields.
+ */
+#define SIZE_U8             1
+#define SIZE_I16            2
+#define SIZE_I32            4
+#define SIZE_F100           4
+#define SIZE_F1K            4
+#define SIZE_U8A(max)       (1 + (max))
+#define SIZE_I32A(max)      (1 + 4*(max))
+#define SIZE_ASCIIZ(max)    (max)
+
+#define MAX_DATA            251 /* Data of packet, without rpc */
+
+#define SIZE_S(type, f)         + SIZE_##type
+#define SIZE_A(type, f, max)    + SIZE_##type(max)
+
+/*
+ * Encode and decode fields.
+ */
+#define ENCODE_S(type, f)       p = put_##type(p, f);
+#define ENCODE_A(type, f, max)  p = put_##type(p, f##_count, f, max); \
+                                if (! p) return -1;
+
+#define DECODE_S(type, f)       p = get_##type(p, end, r_##f);
+#define DECODE_A(type, f, max)  DECODE_##type(f, max)
+#define DECODE_U8A(f, max)      p = get_U8A(p, end, r_##f##_count, r_##f, max);
+#define DECODE_I32A(f, max)     p = get_I32A(p, end, r_##f##_count, r_##f, max);
+#define DECODE_ASCIIZ(f, max)   p = get_ASCIIZ(p, end, r_##f, max);
+
+/*
+ * Names of arguments, to pass them through.
+ */
+#define NAME_S(type, f)         , f
+#define NAME_A(type, f, max)    , f##_count, f
+#define RNAME_S(type, f)        , r_##f
+#define RNAME_A(type, f, max)   RNAME_##type(f)
+#define RNAME_U8A(f)            , r_##f##_count, r_##f
+#define RNAME_I32A(f)           , r_##f##_count, r_##f
+#define RNAME_ASCIIZ(f)         , r_##f
+
+/*
+ * Define functions for the method.
+ * Query buffer is sized at compile time, and both query and reply
+ * are checked to fit into a packet. The blocking call gets the reply
+ * into its own buffer, so it is safe in thread-safe mode.
+ */
+#define RPC_DEFINE(name, type, ns, rpc) \
+    _Static_assert(0 RPC_##name##_Q(SIZE_S, SIZE_A) <= MAX_DATA, \
+        "query " #name " is too long"); \
+    _Static_assert(0 RPC_##name##_R(SIZE_S, SIZE_A) <= MAX_DATA, \
+        "reply " #name " is too long"); \
+    \
+    static int decode_##name(const uint8_t *reply, int reply_len \
+        RPC_##name##_R(RPC_OUT_S, RPC_OUT_A)) \
+    { \
+        const uint8_t *p = reply, *end = reply + reply_len; \
+        \
+        RPC_##name##_R(DECODE_S, DECODE_A) \
+        return (p && p <= end) ? 0 : -1; \
+    } \
+    \
+    int dyio_queue_##name(dyio_t *d \
+        RPC_##name##_Q(RPC_ARG_S, RPC_ARG_A)) \
+    { \
+        uint8_t query[1 RPC_##name##_Q(SIZE_S, SIZE_A)], *p = query; \
+        \
+        RPC_##name##_Q(ENCODE_S, ENCODE_A) \
+        return dyio_queue_call(d, type, ns, rpc, query, p - query); \
+    } \
+    \
+    int dyio_pipe_##name(dyio_t *d, int window \
+        RPC_##name##_Q(RPC_ARG_S, RPC_ARG_A)) \
+    { \
+        uint8_t query[1 RPC_##name##_Q(SIZE_S, SIZE_A)], *p = query; \
+        \
+        RPC_##name##_Q(ENCODE_S, ENCODE_A) \
+        return dyio_pipe_call(d, window, type, ns, rpc, query, p - query); \
+    } \
+    \
+    int dyio_decode_##name(dyio_t *d \
+        RPC_##name##_R(RPC_OUT_S, RPC_OUT_A)) \
+    { \
+        return decode_##name(d->reply, d->reply_len \
+            RPC_##name##_R(RNAME_S, RNAME_A)); \
+    } \
+    \
+    int dyio_rpc_##name(dyio_t *d \
+        RPC_##name##_Q(RPC_ARG_S, RPC_ARG_A) \
+        RPC_##name##_R(RPC_OUT_S, RPC_OUT_A)) \
+    { \
+        uint8_t query[1 RPC_##name##_Q(SIZE_S, SIZE_A)], *p = query; \
+        uint8_t reply[sizeof(((dyio_request_t*)0)->reply)]; \
+        int reply_len, status; \
+        \
+        RPC_##name##_Q(ENCODE_S, ENCODE_A) \
+        status = dyio_call_reply(d, type, ns, rpc, query, p - query, \
+            reply, &reply_len); \
+        if (status < 0) \
+            return status; \
+        return decode_##name(reply, reply_len \
+            RPC_##name##_R(RNAME_S, RNAME_A)); \
+    }
+DYIO_SCHEMA(RPC_DEFINE)
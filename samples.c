@@ -0,0 +1,124 @@
+/*
+ * DyIO library: lock-free ring of asynchronous channel samples.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dyio.h"
+
+#define MAX_SAMPLES     (1 << 20)   /* Largest ring, in samples */
+
+/*
+ * Head is advanced by the producer, tail by the consumer.
+ * Both are free-running counters, masked on access.
+ * They are kept in separate cache lines.
+ */
+typedef struct {
+    unsigned        mask;           /* Size minus one */
+    unsigned long   overflow;       /* Number of lost samples */
+    char            pad1[64];
+    unsigned        head;           /* Next sample to write */
+    char            pad2[64];
+    unsigned        tail;           /* Next sample to read */
+    char            pad3[64];
+    dyio_sample_t   rec[1];         /* Actually more */
+} dyio_ring_t;
+
+/*
+ * Allocate a ring for channel values, received asynchronously.
+ */
+int dyio_enable_samples(dyio_t *d, int size)
+{
+    dyio_ring_t *ring;
+    unsigned n;
+
+    if (d->samples)
+        return 0;
+    if (size <= 0 || size > MAX_SAMPLES) {
+        fprintf(stderr, "dyio: incorrect ring size %d\n", size);
+        return -1;
+    }
+
+    for (n=2; n<size; n<<=1)
+        continue;
+    ring = calloc(1, sizeof(dyio_ring_t) + (n - 1) * sizeof(dyio_sample_t));
+    if (! ring) {
+        fprintf(stderr, "dyio: Out of memory\n");
+        return -1;
+    }
+    ring->mask = n - 1;
+
+    /* Samples are produced with the device locked. */
+    _dyio_lock(d);
+    d->samples = ring;
+    _dyio_unlock(d);
+    return 0;
+}
+
+/*
+ * Put a sample into the ring, when enabled.
+ * When the ring is full, the new sample is dropped:
+ * the receiver never waits for a consumer.
+ */
+void _dyio_put_sample(dyio_t *d, int ch, int value, unsigned long long usec)
+{
+    dyio_ring_t *ring = d->samples;
+    dyio_sample_t *s;
+    unsigned head, tail;
+
+    if (! ring)
+        return;
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > ring->mask) {
+        __atomic_store_n(&ring->overflow, ring->overflow + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    s = &ring->rec[head & ring->mask];
+    s->ch = ch;
+    s->value = value;
+    s->usec = usec;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Fetch up to max samples from the ring, oldest first.
+ * Return number of samples.
+ */
+int dyio_drain_samples(dyio_t *d, dyio_sample_t *buf, int max)
+{
+    dyio_ring_t *ring = d->samples;
+    unsigned head, tail, n, i;
+
+    if (! ring || max <= 0)
+        return 0;
+
+    tail = ring->tail;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    n = head - tail;
+    if (n > max)
+        n = max;
+
+    for (i=0; i<n; i++)
+        buf[i] = ring->rec[(tail + i) & ring->mask];
+    __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+/*
+ * Get number of samples, lost due to ring overflow.
+ */
+unsigned long dyio_sample_overflows(dyio_t *d)
+{
+    dyio_ring_t *ring = d->samples;
+
+    if (! ring)
+        return 0;
+    return __atomic_load_n(&ring->overflow, __ATOMIC_RELAXED);
+}
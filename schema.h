@@ -0,0 +1,335 @@
+/*
+ * DyIO library: schema of RPC calls, as described in README.txt.
+ *
+ * DYIO_SCHEMA(X) lists all methods:
+ *      X(name, packet type, namespace, rpc)
+ *
+ * Every method has two lists of fields:
+ *      RPC_<name>_Q(S, A) - arguments of the query
+ *      RPC_<name>_R(S, A) - fields of the reply
+ * where S(type, field) is a scalar and A(type, field, max)
+ * is an array of at most max elements.
+ *
+ * Scalar types:
+ *      U8      - byte or bool
+ *      I16     - 16-bit integer
+ *      I32     - 32-bit integer
+ *      F100    - fixed point, value*100 as 32-bit integer
+ *      F1K     - fixed point, value*1000 as 32-bit integer
+ * Array types:
+ *      U8A     - count byte, followed by bytes
+ *      I32A    - count byte, followed by 32-bit integers
+ *      ASCIIZ  - null terminated string, max includes the null
+ *
+ * For every method, the following functions are generated:
+ *
+ *      int dyio_rpc_<name>(dyio_t *d, <query args>, <reply fields>);
+ *          Send the query, wait for reply and decode it.
+ *          Return 0 on success, -1 when the reply is malformed,
+ *          or DYIO_ETIMEOUT when no reply came.
+ *
+ *      int dyio_queue_<name>(dyio_t *d, <query args>);
+ *          Send the query without waiting. Return tag for dyio_wait_reply().
+ *
+ *      int dyio_pipe_<name>(dyio_t *d, int window, <query args>);
+ *          Same, with the window of a pipelined sequence.
+ *
+ *      int dyio_decode_<name>(dyio_t *d, <reply fields>);
+ *          Decode the last reply. Return 0 on success, -1 on error.
+ *
+ * Query arguments are passed by value, arrays as (count, pointer).
+ * Reply fields are returned by pointers, named with r_ prefix; arrays
+ * as (pointer to count, pointer to buffer of max elements). Longer
+ * arrays are truncated. Null pointers are allowed.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#define DYIO_SCHEMA(X) \
+    X(ping,                 PKT_GET,      ID_BCS_CORE,    "_png") \
+    X(get_num_namespaces,   PKT_GET,      ID_BCS_CORE,    "_nms") \
+    X(get_namespace,        PKT_GET,      ID_BCS_CORE,    "_nms") \
+    X(get_method,           PKT_GET,      ID_BCS_RPC,     "_rpc") \
+    X(get_method_args,      PKT_GET,      ID_BCS_RPC,     "args") \
+    X(get_num_channels,     PKT_GET,      ID_BCS_IO,      "gchc") \
+    X(get_channel_modes,    PKT_GET,      ID_BCS_IO,      "gcml") \
+    X(get_mode,             PKT_GET,      ID_BCS_IO,      "gchm") \
+    X(get_all_modes,        PKT_GET,      ID_BCS_IO,      "gacm") \
+    X(get_value,            PKT_GET,      ID_BCS_IO,      "gchv") \
+    X(get_all_values,       PKT_GET,      ID_BCS_IO,      "gacv") \
+    X(get_async,            PKT_GET,      ID_BCS_IO,      "asyn") \
+    X(set_value,            PKT_POST,     ID_BCS_IO,      "schv") \
+    X(set_all_values,       PKT_POST,     ID_BCS_IO,      "sacv") \
+    X(set_async,            PKT_CRITICAL, ID_BCS_IO,      "asyn") \
+    X(set_mode,             PKT_POST,     ID_BCS_SETMODE, "schm") \
+    X(set_all_modes,        PKT_POST,     ID_BCS_SETMODE, "sacm") \
+    X(get_revision,         PKT_GET,      ID_DYIO,        "_rev") \
+    X(get_power,            PKT_GET,      ID_DYIO,        "_pwr") \
+    X(set_power_override,   PKT_CRITICAL, ID_DYIO,        "_pwr") \
+    X(get_all_pid,          PKT_GET,      ID_BCS_PID,     "apid") \
+    X(get_pid,              PKT_GET,      ID_BCS_PID,     "_pid") \
+    X(get_pid_config,       PKT_GET,      ID_BCS_PID,     "cpid") \
+    X(get_pid_dvel,         PKT_GET,      ID_BCS_PID,     "cpdv") \
+    X(get_pid_count,        PKT_GET,      ID_BCS_PID,     "gpdc") \
+    X(set_all_pid,          PKT_POST,     ID_BCS_PID,     "apid") \
+    X(set_pid,              PKT_POST,     ID_BCS_PID,     "_pid") \
+    X(set_pid_velocity,     PKT_POST,     ID_BCS_PID,     "_vpd") \
+    X(reset_pid,            PKT_POST,     ID_BCS_PID,     "rpid") \
+    X(kill_all_pid,         PKT_CRITICAL, ID_BCS_PID,     "kpid") \
+    X(set_pid_config,       PKT_CRITICAL, ID_BCS_PID,     "cpid") \
+    X(set_pid_dvel,         PKT_CRITICAL, ID_BCS_PID,     "cpdv") \
+    X(calibrate_pid,        PKT_CRITICAL, ID_BCS_PID,     "acal") \
+    X(get_dypid,            PKT_GET,      ID_BCS_DYPID,   "dpid") \
+    X(set_dypid,            PKT_CRITICAL, ID_BCS_DYPID,   "dpid") \
+    X(get_safe,             PKT_GET,      ID_BCS_SAFE,    "safe") \
+    X(set_safe,             PKT_POST,     ID_BCS_SAFE,    "safe")
+
+#define RPC_MAX_VALUES  60      /* Max values in int[] array */
+#define RPC_MAX_GROUPS  16      /* Max PID groups */
+
+/*
+ * bcs.core
+ */
+#define RPC_ping_Q(S, A)
+#define RPC_ping_R(S, A)
+
+#define RPC_get_num_namespaces_Q(S, A)
+#define RPC_get_num_namespaces_R(S, A) \
+    S(U8, count)
+
+#define RPC_get_namespace_Q(S, A) \
+    S(U8, ns)
+#define RPC_get_namespace_R(S, A) \
+    A(ASCIIZ, name, 64) S(U8, count)
+
+/*
+ * bcs.rpc
+ */
+#define RPC_get_method_Q(S, A) \
+    S(U8, ns) S(U8, method)
+#define RPC_get_method_R(S, A) \
+    S(U8, ns) S(U8, method) S(U8, count) A(ASCIIZ, rpc, 5)
+
+#define RPC_get_method_args_Q(S, A) \
+    S(U8, ns) S(U8, method)
+#define RPC_get_method_args_R(S, A) \
+    S(U8, ns) S(U8, method) \
+    S(U8, query_type) A(U8A, args, MAX_ARGS) \
+    S(U8, resp_type) A(U8A, resp, MAX_ARGS)
+
+/*
+ * bcs.io
+ */
+#define RPC_get_num_channels_Q(S, A)
+#define RPC_get_num_channels_R(S, A) \
+    S(I32, count)
+
+#define RPC_get_channel_modes_Q(S, A) \
+    S(U8, ch)
+#define RPC_get_channel_modes_R(S, A) \
+    A(U8A, mode, MAX_MODES)
+
+#define RPC_get_mode_Q(S, A) \
+    S(U8, ch)
+#define RPC_get_mode_R(S, A) \
+    S(U8, ch) S(U8, mode)
+
+#define RPC_get_all_modes_Q(S, A)
+#define RPC_get_all_modes_R(S, A) \
+    A(U8A, mode, MAX_CHANNELS)
+
+#define RPC_get_value_Q(S, A) \
+    S(U8, ch)
+#define RPC_get_value_R(S, A) \
+    S(U8, ch) S(I32, value)
+
+#define RPC_get_all_values_Q(S, A)
+#define RPC_get_all_values_R(S, A) \
+    A(I32A, value, RPC_MAX_VALUES)
+
+#define RPC_get_async_Q(S, A) \
+    S(U8, ch)
+#define RPC_get_async_R(S, A) \
+    S(U8, ch) S(U8, async)
+
+#define RPC_set_value_Q(S, A) \
+    S(U8, ch) S(I32, value) S(I32, msec)
+#define RPC_set_value_R(S, A) \
+    S(U8, ch) S(U8, status)
+
+#define RPC_set_all_values_Q(S, A) \
+    S(I32, msec) A(I32A, value, RPC_MAX_VALUES)
+#define RPC_set_all_values_R(S, A) \
+    A(I32A, value, RPC_MAX_VALUES)
+
+#define RPC_set_async_Q(S, A) \
+    S(U8, ch) S(U8, mode) S(I32, msec) S(I32, value) S(U8, edge)
+#define RPC_set_async_R(S, A)
+
+/*
+ * bcs.io.setmode
+ */
+#define RPC_set_mode_Q(S, A) \
+    S(U8, ch) S(U8, mode) S(U8, reserved)
+#define RPC_set_mode_R(S, A) \
+    A(U8A, mode, MAX_CHANNELS)
+
+#define RPC_set_all_modes_Q(S, A) \
+    A(U8A, mode, MAX_CHANNELS)
+#define RPC_set_all_modes_R(S, A) \
+    A(U8A, mode, MAX_CHANNELS)
+
+/*
+ * neuronrobotics.dyio
+ */
+#define RPC_get_revision_Q(S, A)
+#define RPC_get_revision_R(S, A) \
+    S(U8, major) S(U8, minor) S(U8, build) \
+    S(U8, bl_major) S(U8, bl_minor) S(U8, bl_build)
+
+#define RPC_get_power_Q(S, A)
+#define RPC_get_power_R(S, A) \
+    S(U8, right) S(U8, left) S(I16, voltage) S(U8, override)
+
+#define RPC_set_power_override_Q(S, A) \
+    S(U8, override)
+#define RPC_set_power_override_R(S, A) \
+    S(U8, right) S(U8, left)
+
+/*
+ * bcs.pid
+ */
+#define RPC_get_all_pid_Q(S, A)
+#define RPC_get_all_pid_R(S, A) \
+    A(I32A, position, RPC_MAX_GROUPS)
+
+#define RPC_get_pid_Q(S, A) \
+    S(U8, group)
+#define RPC_get_pid_R(S, A) \
+    S(U8, group) S(I32, position)
+
+#define RPC_get_pid_config_Q(S, A) \
+    S(U8, group)
+#define RPC_get_pid_config_R(S, A) \
+    S(U8, group) S(U8, enabled) S(U8, inverted) S(U8, async) \
+    S(F100, kp) S(F100, ki) S(F100, kd) S(I32, latch) \
+    S(U8, use_latch) S(U8, stop_on_latch) \
+    S(F1K, stop) S(F1K, upper) S(F1K, lower)
+
+#define RPC_get_pid_dvel_Q(S, A) \
+    S(U8, group)
+#define RPC_get_pid_dvel_R(S, A) \
+    S(U8, group) S(F100, kp) S(F100, kd)
+
+#define RPC_get_pid_count_Q(S, A)
+#define RPC_get_pid_count_R(S, A) \
+    S(I32, count)
+
+#define RPC_set_all_pid_Q(S, A) \
+    S(I32, msec) A(I32A, position, RPC_MAX_GROUPS)
+#define RPC_set_all_pid_R(S, A) \
+    S(U8, status) S(U8, code)
+
+#define RPC_set_pid_Q(S, A) \
+    S(U8, group) S(I32, position) S(I32, msec)
+#define RPC_set_pid_R(S, A) \
+    S(U8, status) S(U8, code)
+
+#define RPC_set_pid_velocity_Q(S, A) \
+    S(U8, group) S(I32, velocity) S(I32, msec)
+#define RPC_set_pid_velocity_R(S, A) \
+    S(U8, status) S(U8, code)
+
+#define RPC_reset_pid_Q(S, A) \
+    S(U8, group) S(I32, position)
+#define RPC_reset_pid_R(S, A) \
+    S(U8, status) S(U8, code)
+
+#define RPC_kill_all_pid_Q(S, A)
+#define RPC_kill_all_pid_R(S, A) \
+    S(U8, status) S(U8, code)
+
+#define RPC_set_pid_config_Q(S, A) \
+    S(U8, group) S(U8, enabled) S(U8, inverted) S(U8, async) \
+    S(F100, kp) S(F100, ki) S(F100, kd) S(I32, latch) \
+    S(U8, use_latch) S(U8, stop_on_latch) \
+    S(F1K, stop) S(F1K, upper) S(F1K, lower)
+#define RPC_set_pid_config_R(S, A) \
+    S(U8, status) S(U8, code)
+
+#define RPC_set_pid_dvel_Q(S, A) \
+    S(U8, group) S(F100, kp) S(F100, kd)
+#define RPC_set_pid_dvel_R(S, A) \
+    S(U8, status) S(U8, code)
+
+#define RPC_calibrate_pid_Q(S, A) \
+    S(U8, group)
+#define RPC_calibrate_pid_R(S, A) \
+    S(U8, status) S(U8, code)
+
+/*
+ * bcs.pid.dypid
+ */
+#define RPC_get_dypid_Q(S, A) \
+    S(U8, group)
+#define RPC_get_dypid_R(S, A) \
+    S(U8, group) S(U8, in_ch) S(U8, in_mode) S(U8, out_ch) S(U8, out_mode)
+
+#define RPC_set_dypid_Q(S, A) \
+    S(U8, group) S(U8, in_ch) S(U8, in_mode) S(U8, out_ch) S(U8, out_mode)
+#define RPC_set_dypid_R(S, A)
+
+/*
+ * bcs.safe
+ */
+#define RPC_get_safe_Q(S, A)
+#define RPC_get_safe_R(S, A) \
+    S(U8, enabled) S(I16, msec)
+
+#define RPC_set_safe_Q(S, A) \
+    S(U8, enabled) S(I16, msec)
+#define RPC_set_safe_R(S, A) \
+    S(U8, status) S(U8, code)
+
+/*
+ * C types of query arguments and reply fields.
+ */
+#define RPC_ARG_U8(f)       , int f
+#define RPC_ARG_I16(f)      , int f
+#define RPC_ARG_I32(f)      , int f
+#define RPC_ARG_F100(f)     , double f
+#define RPC_ARG_F1K(f)      , double f
+#define RPC_ARG_U8A(f)      , int f##_count, const int *f
+#define RPC_ARG_I32A(f)     , int f##_count, const int *f
+
+#define RPC_OUT_U8(f)       , int *r_##f
+#define RPC_OUT_I16(f)      , int *r_##f
+#define RPC_OUT_I32(f)      , int *r_##f
+#define RPC_OUT_F100(f)     , double *r_##f
+#define RPC_OUT_F1K(f)      , double *r_##f
+#define RPC_OUT_U8A(f)      , int *r_##f##_count, int *r_##f
+#define RPC_OUT_I32A(f)     , int *r_##f##_count, int *r_##f
+#define RPC_OUT_ASCIIZ(f)   , char *r_##f
+
+#define RPC_ARG_S(type, f)          RPC_ARG_##type(f)
+#define RPC_ARG_A(type, f, max)     RPC_ARG_##type(f)
+#define RPC_OUT_S(type, f)          RPC_OUT_##type(f)
+#define RPC_OUT_A(type, f, max)     RPC_OUT_##type(f)
+
+/*
+ * Declare functions for the method.
+ */
+#define RPC_DECLARE(name, type, ns, rpc) \
+    int dyio_rpc_##name(dyio_t *d \
+        RPC_##name##_Q(RPC_ARG_S, RPC_ARG_A) \
+        RPC_##name##_R(RPC_OUT_S, RPC_OUT_A)); \
+    int dyio_queue_##name(dyio_t *d \
+        RPC_##name##_Q(RPC_ARG_S, RPC_ARG_A)); \
+    int dyio_pipe_##name(dyio_t *d, int window \
+        RPC_##name##_Q(RPC_ARG_S, RPC_ARG_A)); \
+    int dyio_decode_##name(dyio_t *d \
+        RPC_##name##_R(RPC_OUT_S, RPC_OUT_A));
+
+DYIO_SCHEMA(RPC_DECLARE)
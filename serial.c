@@ -20,7 +20,13 @@
 #   include <windows.h>
 #else
 #   include <termios.h>
+#   include <sys/ioctl.h>
 #endif
+#ifdef __linux__
+#   include <linux/serial.h>
+#endif
+
+#define BUSY_POLL_USEC  50          /* Max spin time of busy poll */
 
 typedef struct {
     /* Generic DyIO data structure. */
@@ -30,9 +36,11 @@ typedef struct {
 #if defined(__WIN32__) || defined(WIN32)
     void *fd;
     DCB saved_mode;
+    DWORD timeout;                  /* Current read timeout, msec */
 #else
     int fd;
     struct termios saved_mode;
+    int busy_poll;                  /* Spin on non-blocking read, then select */
 #endif
 } dyio_serial_t;
 
@@ -144,6 +152,8 @@ printf("Unknown baud\n");
 
 /*
  * Send data to device.
+ * In busy poll mode the port is non-blocking: when the output
+ * queue is full, wait until it has room, and write the rest.
  * Return number of bytes, or -1 on error.
  */
 int _dyio_serial_write(dyio_t *d, unsigned char *data, int len)
@@ -157,46 +167,101 @@ int _dyio_serial_write(dyio_t *d, unsigned char *data, int len)
         return -1;
     return len;
 #else
-    return write(s->fd, data, len);
+    fd_set wfds;
+    int done = 0, got;
+
+    while (done < len) {
+        got = write(s->fd, data + done, len - done);
+        if (got > 0) {
+            done += got;
+            continue;
+        }
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0 && errno != EAGAIN)
+            return -1;
+
+        /* Output queue is full. */
+        FD_ZERO(&wfds);
+        FD_SET(s->fd, &wfds);
+        if (select(s->fd + 1, 0, &wfds, 0, 0) < 0 && errno != EINTR)
+            return -1;
+    }
+    return done;
 #endif
 }
 
 /*
  * Receive data from device.
- * Return number of bytes, or -1 on error.
+ * Wait at most usec microseconds: the time is measured
+ * on the monotonic clock, across interrupted waits.
+ * Return number of bytes, 0 on timeout, or -1 on error.
  */
-int _dyio_serial_read(dyio_t *d, unsigned char *data, int len)
+int _dyio_serial_read(dyio_t *d, unsigned char *data, int len, unsigned long usec)
 {
     dyio_serial_t *s = (dyio_serial_t*) d;
 
 #if defined(__WIN32__) || defined(WIN32)
-    DWORD got;
+    DWORD got, msec = (usec + 999) / 1000;
 
+    if (msec != s->timeout) {
+        COMMTIMEOUTS ctmo;
+
+        memset(&ctmo, 0, sizeof(ctmo));
+        ctmo.ReadIntervalTimeout = MAXDWORD;
+        ctmo.ReadTotalTimeoutMultiplier = MAXDWORD;
+        ctmo.ReadTotalTimeoutConstant = msec ? msec : 1;
+        SetCommTimeouts(s->fd, &ctmo);
+        s->timeout = msec;
+    }
     if (! ReadFile(s->fd, data, len, &got, 0)) {
         fprintf(stderr, "serial-read: read error\n");
-        exit(-1);
+        return -1;
     }
 #else
-    struct timeval timeout, to2;
+    unsigned long long deadline = _dyio_usec() + usec, now;
+    struct timeval timeout;
     long got;
     fd_set rfds;
 
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
-    to2 = timeout;
+    if (s->busy_poll) {
+        /* Poll the port without sleeping, for a short time:
+         * a reply on a fast link comes in tens of microseconds.
+         * Then sleep in select until deadline. */
+        unsigned long long spin = _dyio_usec() + BUSY_POLL_USEC;
+
+        if (spin > deadline)
+            spin = deadline;
+        for (;;) {
+            got = read(s->fd, data, len);
+            if (got > 0)
+                return got;
+            if (got < 0 && errno != EAGAIN && errno != EINTR) {
+                fprintf(stderr, "serial-read: read error\n");
+                return -1;
+            }
+            if (_dyio_usec() >= spin)
+                break;
+        }
+    }
+
 again:
+    now = _dyio_usec();
+    if (now > deadline)
+        now = deadline;
+    timeout.tv_sec = (deadline - now) / 1000000;
+    timeout.tv_usec = (deadline - now) % 1000000;
     FD_ZERO(&rfds);
     FD_SET(s->fd, &rfds);
 
-    got = select(s->fd + 1, &rfds, 0, 0, &to2);
+    got = select(s->fd + 1, &rfds, 0, 0, &timeout);
     if (got < 0) {
         if (errno == EINTR || errno == EAGAIN) {
-            if (d->debug)
-                printf("serial-read: device is not responding\n");
+            /* Continue with the remaining time. */
             goto again;
         }
         fprintf(stderr, "serial-read: select error: %s\n", strerror(errno));
-        exit(1);
+        return -1;
     }
 #endif
     if (got == 0) {
@@ -206,17 +271,48 @@ again:
     }
 
 #if ! defined(__WIN32__) && !defined(WIN32)
-    got = read(s->fd, data, (len > 1024) ? 1024 : len);
+    got = read(s->fd, data, len);
     if (got < 0) {
         fprintf(stderr, "serial-read: read error\n");
-        exit(-1);
+        return -1;
     }
 #endif
     return got;
 }
 
 /*
- * Close the serial port.
+ * Change speed of the serial port.
+ * Return -1 when the speed is not supported.
+ */
+int _dyio_serial_set_baud(dyio_t *d, int baud_rate)
+{
+    dyio_serial_t *s = (dyio_serial_t*) d;
+#if defined(__WIN32__) || defined(WIN32)
+    DCB mode;
+
+    if (! GetCommState(s->fd, &mode))
+        return -1;
+    mode.BaudRate = baud_encode(baud_rate);
+    if (! SetCommState(s->fd, &mode))
+        return -1;
+    PurgeComm(s->fd, PURGE_RXCLEAR | PURGE_TXCLEAR);
+#else
+    struct termios mode;
+    int baud_code = baud_encode(baud_rate);
+
+    if (baud_code < 0 || tcgetattr(s->fd, &mode) < 0)
+        return -1;
+    cfsetispeed(&mode, baud_code);
+    cfsetospeed(&mode, baud_code);
+    if (tcsetattr(s->fd, TCSADRAIN, &mode) < 0)
+        return -1;
+    tcflush(s->fd, TCIOFLUSH);
+#endif
+    return 0;
+}
+
+/*
+ * Close the serial port and deallocate the device object.
  */
 void _dyio_serial_close(dyio_t *d)
 {
@@ -229,14 +325,39 @@ void _dyio_serial_close(dyio_t *d)
     tcsetattr(s->fd, TCSANOW, &s->saved_mode);
     close(s->fd);
 #endif
+    free(s);
 }
 
+/*
+ * Get the descriptor of the port, for poll().
+ */
+static int serial_get_fd(dyio_t *d)
+{
+#if defined(__WIN32__) || defined(WIN32)
+    return -1;
+#else
+    dyio_serial_t *s = (dyio_serial_t*) d;
+
+    return s->fd;
+#endif
+}
+
+static const dyio_transport_t serial_transport = {
+    "serial",
+    _dyio_serial_write,
+    _dyio_serial_read,
+    _dyio_serial_set_baud,
+    _dyio_serial_close,
+    serial_get_fd,
+};
+
 /*
  * Open the serial port.
- * Return -1 on error.
+ * Return 0 on error.
  */
-dyio_t *_dyio_serial_open(const char *devname, int baud_rate)
+dyio_t *_dyio_serial_open(const char *devname, const dyio_opts_t *opts)
 {
+    int baud_rate = opts->baud;
 #if defined(__WIN32__) || defined(WIN32)
     DCB new_mode;
     COMMTIMEOUTS ctmo;
@@ -328,17 +449,37 @@ dyio_t *_dyio_serial_open(const char *devname, int baud_rate)
     new_mode.c_iflag = IGNBRK;
     new_mode.c_oflag = 0;
     new_mode.c_lflag = 0;
-    new_mode.c_cc[VTIME] = 0;
-    new_mode.c_cc[VMIN]  = 1;
+    new_mode.c_cc[VTIME] = opts->vtime;
+    new_mode.c_cc[VMIN]  = opts->vmin;
     cfsetispeed(&new_mode, baud_code);
     cfsetospeed(&new_mode, baud_code);
     tcflush(s->fd, TCIFLUSH);
     tcsetattr(s->fd, TCSANOW, &new_mode);
 
-    /* Clear O_NONBLOCK flag. */
-    int flags = fcntl(s->fd, F_GETFL, 0);
-    if (flags >= 0)
-        fcntl(s->fd, F_SETFL, flags & ~O_NONBLOCK);
+#ifdef __linux__
+    /* Ask the driver to push received data without delay. */
+    if (opts->low_latency) {
+        struct serial_struct ss;
+
+        if (ioctl(s->fd, TIOCGSERIAL, &ss) < 0) {
+            if (opts->debug)
+                printf("%s: cannot get serial info\n", devname);
+        } else {
+            ss.flags |= ASYNC_LOW_LATENCY;
+            if (ioctl(s->fd, TIOCSSERIAL, &ss) < 0 && opts->debug)
+                printf("%s: cannot set low latency mode\n", devname);
+        }
+    }
+#endif
+
+    /* Clear O_NONBLOCK flag, unless we poll. */
+    s->busy_poll = opts->busy_poll;
+    if (! s->busy_poll) {
+        int flags = fcntl(s->fd, F_GETFL, 0);
+        if (flags >= 0)
+            fcntl(s->fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
 #endif
+    s->generic.transport = &serial_transport;
     return &s->generic;
 }
@@ -0,0 +1,452 @@
+/*
+ * DyIO library: thread-safe mode.
+ *
+ * One thread owns the link, and runs the event loop of
+ * dyio_process_io(). Callers push requests into a lock-free
+ * stack, and sleep on their own semaphores. The owner takes
+ * the whole stack at once, and submits the requests in order
+ * of arrival, critical lane first. Replies are copied into
+ * buffers of callers.
+ *
+ * Pipelined sequences of queued requests (dyio_get_values(),
+ * streams, PID cycles) hold the link with a recursive mutex:
+ * the owner takes it for every round of its event loop, and
+ * releases it only while it sleeps in poll().
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "dyio.h"
+
+/*
+ * Request of a caller, allocated on its stack.
+ */
+typedef struct _dyio_job_t {
+    struct _dyio_job_t *next;       /* Link in the queue */
+    int             type;           /* Packet type */
+    int             namespace;      /* Namespace index */
+    char            *rpc;           /* RPC call identifier */
+    unsigned char   *data;          /* Query */
+    int             datalen;        /* Query length */
+    unsigned char   *reply;         /* Buffer of the caller */
+    int             *reply_len;     /* Length of reply */
+    int             status;         /* 0, DYIO_ETIMEOUT or -1 */
+    sem_t           done;           /* Posted on completion */
+} dyio_job_t;
+
+typedef struct {
+    pthread_t       thread;
+    dyio_job_t      *incoming;      /* Stack of new jobs, pushed by callers */
+    dyio_job_t      *backlog[NUM_LANES]; /* Jobs not yet submitted, per lane */
+    dyio_job_t      **backlog_tail[NUM_LANES];
+    int             wake[2];        /* Pipe to wake the owner */
+    int             stop;           /* Owner is stopped, or stopping */
+    int             users;          /* Callers inside _dyio_shared_call() */
+    pthread_mutex_t hold;           /* Exclusive use of the link, recursive */
+    int             depth;          /* Nesting of the hold */
+} dyio_shared_t;
+
+/*
+ * Take the link for exclusive use by this thread.
+ * Calls may nest. No-op, unless in thread-safe mode.
+ */
+void _dyio_hold(dyio_t *d)
+{
+    dyio_shared_t *s = d->shared;
+
+    if (s) {
+        pthread_mutex_lock(&s->hold);
+        s->depth++;
+    }
+}
+
+/*
+ * Release the link.
+ */
+void _dyio_release(dyio_t *d)
+{
+    dyio_shared_t *s = d->shared;
+
+    if (s) {
+        s->depth--;
+        pthread_mutex_unlock(&s->hold);
+    }
+}
+
+/*
+ * Check whether the link is held by this thread.
+ */
+static int holding(dyio_shared_t *s)
+{
+    int held;
+
+    if (pthread_mutex_trylock(&s->hold) != 0)
+        return 0;
+    held = (s->depth > 0);
+    pthread_mutex_unlock(&s->hold);
+    return held;
+}
+
+/*
+ * Check whether the owner thread is running.
+ */
+int _dyio_shared_running(dyio_t *d)
+{
+    dyio_shared_t *s = d->shared;
+
+    return s && ! __atomic_load_n(&s->stop, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Reply to the job: copy it to the caller, and wake it.
+ */
+static void job_complete(dyio_t *d, int tag, int status, void *arg)
+{
+    dyio_job_t *job = arg;
+
+    memcpy(job->reply, d->reply, d->reply_len + 1);
+    *job->reply_len = d->reply_len;
+    job->status = status;
+    sem_post(&job->done);
+}
+
+/*
+ * Move new jobs to the backlog. The stack is taken at once,
+ * and reversed into order of arrival.
+ */
+static void take_jobs(dyio_shared_t *s)
+{
+    dyio_job_t *list, *job, *fifo = 0;
+    int lane;
+
+    list = __atomic_exchange_n(&s->incoming, 0, __ATOMIC_ACQUIRE);
+    while (list) {
+        job = list;
+        list = job->next;
+        job->next = fifo;
+        fifo = job;
+    }
+    while (fifo) {
+        job = fifo;
+        fifo = job->next;
+        job->next = 0;
+        lane = _dyio_type_lane(job->type);
+        *s->backlog_tail[lane] = job;
+        s->backlog_tail[lane] = &job->next;
+    }
+}
+
+/*
+ * Check whether a job of the lane can be submitted.
+ * At most a window of requests of every lane wait in the
+ * request queue, so the slots remain for higher priority jobs.
+ * Jobs of a lane with rate limit stay here until the lane opens:
+ * otherwise they would hold the oldest slots of the queue.
+ */
+static int lane_open(dyio_t *d, dyio_shared_t *s, int lane)
+{
+    if (! s->backlog[lane] || d->tail - d->head >= MAX_INFLIGHT ||
+        d->lane[lane].waiting >= d->window)
+        return 0;
+    return ! d->lane[lane].period || d->lane[lane].next <= _dyio_usec();
+}
+
+/*
+ * Submit jobs from the backlog, while the request slots are free.
+ */
+static void submit_jobs(dyio_t *d, dyio_shared_t *s)
+{
+    dyio_job_t *job;
+    int lane;
+
+    for (lane=0; lane<NUM_LANES; lane++) {
+        while (lane_open(d, s, lane)) {
+            job = s->backlog[lane];
+            if (dyio_submit(d, job->type, job->namespace, job->rpc,
+                    job->data, job->datalen, job_complete, job) < 0)
+                return;
+            s->backlog[lane] = job->next;
+            if (! s->backlog[lane])
+                s->backlog_tail[lane] = &s->backlog[lane];
+        }
+    }
+}
+
+/*
+ * Check whether any job can be submitted now.
+ */
+static int can_submit(dyio_t *d, dyio_shared_t *s)
+{
+    int lane;
+
+    for (lane=0; lane<NUM_LANES; lane++) {
+        if (lane_open(d, s, lane))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Get time in msec, until a lane with rate limit opens for
+ * jobs of the backlog, or -1 when none is held by the rate.
+ */
+static int rate_timeout(dyio_t *d, dyio_shared_t *s)
+{
+    unsigned long long now = _dyio_usec();
+    int lane, msec, timeout = -1;
+
+    for (lane=0; lane<NUM_LANES; lane++) {
+        if (! s->backlog[lane] || ! d->lane[lane].period ||
+            d->lane[lane].next <= now)
+            continue;
+        msec = (d->lane[lane].next - now + 999) / 1000;
+        if (timeout < 0 || msec < timeout)
+            timeout = msec;
+    }
+    return timeout;
+}
+
+/*
+ * Fail all jobs, which are not yet submitted.
+ */
+static void cancel_jobs(dyio_shared_t *s)
+{
+    dyio_job_t *job;
+    int lane;
+
+    take_jobs(s);
+    for (lane=0; lane<NUM_LANES; lane++) {
+        while ((job = s->backlog[lane]) != 0) {
+            s->backlog[lane] = job->next;
+            *job->reply_len = 0;
+            job->status = -1;
+            sem_post(&job->done);
+        }
+        s->backlog_tail[lane] = &s->backlog[lane];
+    }
+}
+
+/*
+ * Owner thread: run the event loop until stopped.
+ */
+static void *owner_loop(void *arg)
+{
+    dyio_t *d = arg;
+    dyio_shared_t *s = d->shared;
+    struct pollfd pfd[2];
+    unsigned char buf[64];
+    int timeout, msec;
+
+    pfd[0].fd = s->wake[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd = dyio_get_fd(d);
+    pfd[1].events = POLLIN;
+
+    _dyio_hold(d);
+    while (! __atomic_load_n(&s->stop, __ATOMIC_SEQ_CST)) {
+        take_jobs(s);
+        submit_jobs(d, s);
+        dyio_process_io(d);
+        if (can_submit(d, s)) {
+            /* Slots were released by completions. */
+            continue;
+        }
+
+        timeout = dyio_io_timeout(d);
+        msec = rate_timeout(d, s);
+        if (msec >= 0 && (timeout < 0 || msec < timeout))
+            timeout = msec;
+        if (d->broken) {
+            /* Hangup would wake poll() forever. */
+            pfd[1].fd = -1;
+        }
+        if (pfd[1].fd < 0 && timeout < 0 && d->tail != d->head)
+            timeout = 0;
+
+        /* Other threads may hold the link while the owner sleeps. */
+        _dyio_release(d);
+        if (poll(pfd, 2, timeout) < 0 && errno != EINTR) {
+            perror("dyio: poll");
+            _dyio_hold(d);
+            break;
+        }
+        _dyio_hold(d);
+        if (pfd[0].revents & POLLIN) {
+            while (read(s->wake[0], buf, sizeof(buf)) > 0)
+                continue;
+        }
+    }
+
+    /* Finish requests in flight, and fail the rest. */
+    while (d->inflight + d->waiting > 0) {
+        timeout = dyio_io_timeout(d);
+        _dyio_release(d);
+        poll(&pfd[1], 1, timeout);
+        _dyio_hold(d);
+        dyio_process_io(d);
+    }
+    cancel_jobs(s);
+    _dyio_release(d);
+    return 0;
+}
+
+/*
+ * Pass the call to the owner thread, and wait for the reply.
+ */
+int _dyio_shared_call(dyio_t *d, int type, int namespace, char *rpc,
+    unsigned char *data, int datalen, unsigned char *reply, int *reply_len)
+{
+    dyio_shared_t *s = d->shared;
+    dyio_job_t job, *old;
+    unsigned char byte = 0;
+    int status;
+
+    /* Counted callers keep the stopping owner waiting. */
+    __atomic_add_fetch(&s->users, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->stop, __ATOMIC_SEQ_CST) || holding(s)) {
+        /* Owner is stopped, or the link is held by this thread,
+         * e.g. in a callback of the owner: call directly. */
+        __atomic_sub_fetch(&s->users, 1, __ATOMIC_SEQ_CST);
+        _dyio_hold(d);
+        status = dyio_wait_reply(d, dyio_queue_call(d, type, namespace,
+            rpc, data, datalen));
+        memcpy(reply, d->reply, d->reply_len + 1);
+        *reply_len = d->reply_len;
+        _dyio_release(d);
+        return status;
+    }
+
+    job.type = type;
+    job.namespace = namespace;
+    job.rpc = rpc;
+    job.data = data;
+    job.datalen = datalen;
+    job.reply = reply;
+    job.reply_len = reply_len;
+    job.status = -1;
+    sem_init(&job.done, 0, 0);
+
+    /* Push the job. The owner is woken when the stack was empty. */
+    old = __atomic_load_n(&s->incoming, __ATOMIC_RELAXED);
+    do {
+        job.next = old;
+    } while (! __atomic_compare_exchange_n(&s->incoming, &old, &job,
+                1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (! old && write(s->wake[1], &byte, 1) < 0 && errno != EAGAIN)
+        perror("dyio: wake owner");
+
+    while (sem_wait(&job.done) < 0 && errno == EINTR)
+        continue;
+    sem_destroy(&job.done);
+    __atomic_sub_fetch(&s->users, 1, __ATOMIC_SEQ_CST);
+    return job.status;
+}
+
+/*
+ * Start the owner thread. After a stop, the same state is used
+ * again: it is kept until dyio_close(), because callers may still
+ * refer to it.
+ */
+int dyio_start_shared(dyio_t *d)
+{
+    dyio_shared_t *s = d->shared;
+    pthread_mutexattr_t attr;
+    int lane;
+
+    if (_dyio_shared_running(d))
+        return 0;
+    if (_dyio_reader_running(d)) {
+        fprintf(stderr, "dyio: cannot share the device with reader running\n");
+        return -1;
+    }
+    /* The device lock becomes the link hold. */
+    _dyio_close_reader(d);
+
+    if (! s) {
+        s = calloc(1, sizeof(dyio_shared_t));
+        if (! s) {
+            fprintf(stderr, "dyio: Out of memory\n");
+            return -1;
+        }
+        if (pipe(s->wake) < 0) {
+            perror("dyio: pipe");
+            free(s);
+            return -1;
+        }
+        fcntl(s->wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(s->wake[1], F_SETFL, O_NONBLOCK);
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&s->hold, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        /* Owner is visible to the new thread from the very start. */
+        d->shared = s;
+    }
+    for (lane=0; lane<NUM_LANES; lane++) {
+        s->backlog[lane] = 0;
+        s->backlog_tail[lane] = &s->backlog[lane];
+    }
+    __atomic_store_n(&s->stop, 0, __ATOMIC_SEQ_CST);
+    if (pthread_create(&s->thread, 0, owner_loop, d) != 0) {
+        fprintf(stderr, "dyio: cannot create owner thread\n");
+        __atomic_store_n(&s->stop, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Stop the owner thread. Calls, which are already queued,
+ * fail with -1; later calls go directly to the link.
+ */
+void dyio_stop_shared(dyio_t *d)
+{
+    dyio_shared_t *s = d->shared;
+    unsigned char byte = 0;
+
+    if (! _dyio_shared_running(d))
+        return;
+
+    __atomic_store_n(&s->stop, 1, __ATOMIC_SEQ_CST);
+    if (write(s->wake[1], &byte, 1) < 0 && errno != EAGAIN)
+        perror("dyio: wake owner");
+    pthread_join(s->thread, 0);
+
+    /* Callers, which passed the check of stop, may push
+     * their jobs after the owner has finished. */
+    cancel_jobs(s);
+    while (__atomic_load_n(&s->users, __ATOMIC_SEQ_CST) > 0) {
+        usleep(1000);
+        cancel_jobs(s);
+    }
+}
+
+/*
+ * Stop the owner thread, and deallocate the state.
+ * No other thread may use the device.
+ */
+void _dyio_close_shared(dyio_t *d)
+{
+    dyio_shared_t *s = d->shared;
+
+    if (! s)
+        return;
+    dyio_stop_shared(d);
+    d->shared = 0;
+    close(s->wake[0]);
+    close(s->wake[1]);
+    pthread_mutex_destroy(&s->hold);
+    free(s);
+}
@@ -0,0 +1,252 @@
+/*
+ * DyIO device simulator.
+ * Creates a pseudo-terminal and speaks the DyIO protocol on it,
+ * so that unmodified dyio_connect() can attach to the slave side.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "dyio.h"
+#include "model.h"
+
+const char version[] = "1.0."GITVERSION;
+const char copyright[] = "Copyright (C) 2015 Serge Vakulenko";
+
+char *progname;
+
+/*
+ * Get current time of monotonic clock, in microseconds.
+ */
+static unsigned long long now_usec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void usage()
+{
+    printf("DyIO simulator, Version %s, %s\n", version, copyright);
+    printf("Usage:\n\t%s [-v] [-l usec] [-j usec] [-c rate] [-s seed] [-t ch,msec]\n", progname);
+    printf("\t\t[-L link | -U path | -T port]\n");
+    printf("Options:\n");
+    printf("\t-v\tverbose mode\n");
+    printf("\t-l usec\tdelay of every reply, microseconds\n");
+    printf("\t-j usec\trandom variation of the delay\n");
+    printf("\t-c rate\tprobability of a corrupted reply, 0 to 1\n");
+    printf("\t-s seed\tseed for random generator\n");
+    printf("\t-t ch,msec\ttoggle input channel periodically\n");
+    printf("\t-L link\tcreate a symbolic link to the pseudo-terminal\n");
+    printf("\t-U path\tlisten on Unix socket, instead of pseudo-terminal\n");
+    printf("\t-T port\tlisten on TCP port of localhost\n");
+    exit(-1);
+}
+
+/*
+ * Create a listening socket: Unix domain when path is given,
+ * or TCP on localhost.
+ */
+static int listen_socket(const char *path, int port)
+{
+    struct sockaddr_un un;
+    struct sockaddr_in in;
+    int sock, one = 1;
+
+    if (path) {
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        strncpy(un.sun_path, path, sizeof(un.sun_path) - 1);
+        unlink(path);
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock < 0 || bind(sock, (struct sockaddr*) &un, sizeof(un)) < 0) {
+            perror(path);
+            exit(-1);
+        }
+        printf("%s\n", path);
+    } else {
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        in.sin_port = htons(port);
+        in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock >= 0)
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (sock < 0 || bind(sock, (struct sockaddr*) &in, sizeof(in)) < 0) {
+            perror("bind");
+            exit(-1);
+        }
+        printf("tcp:localhost:%u\n", port);
+    }
+    if (listen(sock, 1) < 0) {
+        perror("listen");
+        exit(-1);
+    }
+    fflush(stdout);
+    return sock;
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t inbuf[MODEL_INBUF], outbuf[MODEL_INBUF];
+    int master, slave, n, timeout, listener = -1, port = 0, one = 1;
+    char *link = 0, *slave_name, *path = 0;
+    unsigned long long now, next;
+    struct termios mode;
+    struct pollfd pfd;
+    dyio_model_t *m;
+
+    progname = *argv;
+    srand48(time(0));
+    m = _dyio_model_create();
+    if (! m) {
+        fprintf(stderr, "%s: Out of memory\n", progname);
+        exit(-1);
+    }
+    for (;;) {
+        switch (getopt(argc, argv, "vl:j:c:s:t:L:U:T:")) {
+        case EOF:
+            break;
+        case 'v':
+            m->verbose++;
+            continue;
+        case 'l':
+            m->latency = strtol(optarg, 0, 0);
+            continue;
+        case 'j':
+            m->jitter = strtol(optarg, 0, 0);
+            continue;
+        case 'c':
+            m->corrupt_rate = strtod(optarg, 0);
+            continue;
+        case 's':
+            srand48(strtol(optarg, 0, 0));
+            continue;
+        case 't':
+            if (sscanf(optarg, "%d,%d", &m->toggle_chan, &m->toggle_msec) != 2 ||
+                m->toggle_chan < 0 || m->toggle_chan >= MODEL_CHANNELS ||
+                m->toggle_msec <= 0)
+                usage();
+            continue;
+        case 'L':
+            link = optarg;
+            continue;
+        case 'U':
+            path = optarg;
+            continue;
+        case 'T':
+            port = strtol(optarg, 0, 0);
+            if (port <= 0)
+                usage();
+            continue;
+        default:
+            usage();
+        }
+        break;
+    }
+    if (optind != argc)
+        usage();
+
+    if (path || port) {
+        /* Serve one client at a time. */
+        listener = listen_socket(path, port);
+        master = -1;
+        goto serve;
+    }
+
+    /* Create pseudo-terminal. */
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+        perror("posix_openpt");
+        exit(-1);
+    }
+    slave_name = ptsname(master);
+
+    /* Keep the slave side open, to avoid EIO when a client disconnects.
+     * Disable echo and line editing. */
+    slave = open(slave_name, O_RDWR | O_NOCTTY);
+    if (slave < 0) {
+        perror(slave_name);
+        exit(-1);
+    }
+    tcgetattr(slave, &mode);
+    cfmakeraw(&mode);
+    tcsetattr(slave, TCSANOW, &mode);
+
+    if (link) {
+        unlink(link);
+        if (symlink(slave_name, link) < 0) {
+            perror(link);
+            exit(-1);
+        }
+        printf("%s -> %s\n", link, slave_name);
+    } else
+        printf("%s\n", slave_name);
+    fflush(stdout);
+serve:
+    for (;;) {
+        if (master < 0) {
+            master = accept(listener, 0, 0);
+            if (master < 0) {
+                perror("accept");
+                exit(-1);
+            }
+            if (port)
+                setsockopt(master, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (m->verbose)
+                printf("--- client connected\n");
+        }
+
+        /* Wait for input or for the next reply. */
+        now = now_usec();
+        next = _dyio_model_run(m, now);
+        timeout = -1;
+        if (next)
+            timeout = (next > now) ? (next - now + 999) / 1000 : 0;
+        pfd.fd = master;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(-1);
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP)) {
+            n = read(master, inbuf, sizeof(inbuf));
+            if (n > 0)
+                _dyio_model_input(m, inbuf, n);
+            else if (listener >= 0) {
+                /* Client disconnected. */
+                if (m->verbose)
+                    printf("--- client disconnected\n");
+                close(master);
+                master = -1;
+                continue;
+            }
+        }
+
+        /* Send all replies which are due. */
+        while ((n = _dyio_model_output(m, outbuf, sizeof(outbuf), now_usec())) > 0) {
+            if (write(master, outbuf, n) != n)
+                fprintf(stderr, "%s: write error\n", progname);
+        }
+    }
+}
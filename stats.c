@@ -0,0 +1,132 @@
+/*
+ * DyIO library: per-RPC counters and latency histograms.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dyio.h"
+
+/*
+ * Find statistics entry for the method.
+ * When create flag is set, allocate a new entry if needed.
+ * Entries are never moved or removed, so the table can be
+ * searched without locking: a new entry becomes visible
+ * only when completely filled.
+ * Return index, or -1 when not found.
+ */
+int _dyio_stat_index(dyio_t *d, int ns, const char *rpc, int create)
+{
+    dyio_stat_t *s;
+    int i, n = __atomic_load_n(&d->num_stats, __ATOMIC_ACQUIRE);
+
+    for (i=0; i<n; i++) {
+        s = &d->stats[i];
+        if (s->ns == ns && memcmp(s->rpc, rpc, 4) == 0)
+            return i;
+    }
+    if (! create || n >= MAX_STATS)
+        return -1;
+
+    s = &d->stats[n];
+    memset(s, 0, sizeof(*s));
+    s->ns = ns;
+    memcpy(s->rpc, rpc, 4);
+    __atomic_store_n(&d->num_stats, n + 1, __ATOMIC_RELEASE);
+    return n;
+}
+
+/*
+ * Account the reply: size and round-trip time, from the first
+ * sending. A reply after resend may answer any of the copies,
+ * so it is counted apart from the latency.
+ */
+void _dyio_stat_reply(dyio_t *d, dyio_request_t *r, int nbytes)
+{
+    dyio_stat_t *s;
+    unsigned long usec;
+    int b;
+
+    if (r->stat < 0)
+        return;
+    s = &d->stats[r->stat];
+    s->bytes_rx += nbytes;
+    if (r->resent > 0) {
+        s->retried++;
+        return;
+    }
+    usec = _dyio_usec() - r->sent;
+    s->total_usec += usec;
+    if (usec > s->max_usec)
+        s->max_usec = usec;
+
+    /* Bucket b holds times from 2^(b-1) to 2^b-1 microseconds. */
+    for (b=0; usec>0 && b<STAT_BUCKETS-1; b++)
+        usec >>= 1;
+    s->hist[b]++;
+}
+
+/*
+ * Get per-RPC statistics.
+ */
+const dyio_stat_t *dyio_get_stats(dyio_t *d, int *count)
+{
+    *count = __atomic_load_n(&d->num_stats, __ATOMIC_ACQUIRE);
+    return d->stats;
+}
+
+/*
+ * Clear all counters.
+ * Entries are kept, as requests in flight refer to them.
+ */
+void dyio_reset_stats(dyio_t *d)
+{
+    dyio_stat_t *s;
+    int i;
+
+    _dyio_lock(d);
+    for (i=0; i<d->num_stats; i++) {
+        s = &d->stats[i];
+        s->calls = 0;
+        s->bytes_tx = 0;
+        s->bytes_rx = 0;
+        s->bad_sums = 0;
+        s->resends = 0;
+        s->timeouts = 0;
+        s->retried = 0;
+        s->max_usec = 0;
+        s->total_usec = 0;
+        memset(s->hist, 0, sizeof(s->hist));
+    }
+    _dyio_unlock(d);
+}
+
+/*
+ * Estimate a percentile of round-trip time, in microseconds.
+ * Return the upper bound of the histogram bucket,
+ * but not more than the maximum time.
+ */
+unsigned long dyio_stat_percentile(const dyio_stat_t *s, int percent)
+{
+    unsigned long total = 0, sum = 0, limit;
+    int b;
+
+    for (b=0; b<STAT_BUCKETS; b++)
+        total += s->hist[b];
+    if (total == 0)
+        return 0;
+
+    for (b=0; b<STAT_BUCKETS; b++) {
+        sum += s->hist[b];
+        if (sum * 100 >= total * percent)
+            break;
+    }
+    if (b >= STAT_BUCKETS - 1)
+        return s->max_usec;
+    limit = (1UL << b) - 1;
+    return (limit < s->max_usec) ? limit : s->max_usec;
+}
@@ -0,0 +1,156 @@
+/*
+ * DyIO library: data streams of UART, SPI and PPM channels.
+ *
+ * Streams are transferred by strm frames of bcs.io namespace.
+ * Several frames are kept in flight, so the transfer is not
+ * limited by the round-trip time.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "dyio.h"
+
+/*
+ * Get max number of stream frames in flight.
+ * Frames are queued with this window, so the window
+ * of the connection is not changed.
+ */
+static int stream_window(dyio_t *d)
+{
+    int window = d->window;
+
+    if (window < DYIO_STREAM_WINDOW)
+        window = DYIO_STREAM_WINDOW;
+    if (window > MAX_INFLIGHT)
+        window = MAX_INFLIGHT;
+    return window;
+}
+
+/*
+ * Write data to the output stream of the channel.
+ */
+int dyio_stream_write(dyio_t *d, int ch, const unsigned char *buf, int len)
+{
+    uint8_t query[2 + DYIO_STREAM_FRAME];
+    int tag[MAX_INFLIGHT], nbytes[MAX_INFLIGHT];
+    int window;
+    unsigned head = 0, tail = 0;
+    unsigned long long start = _dyio_usec();
+    int pos = 0, written = 0, failed = 0, n, s;
+
+    _dyio_hold(d);
+    window = stream_window(d);
+    while (pos < len || head != tail) {
+        /* Fill the window. */
+        while (pos < len && ! failed && tail - head < window) {
+            n = len - pos;
+            if (n > DYIO_STREAM_FRAME)
+                n = DYIO_STREAM_FRAME;
+            query[0] = ch;
+            query[1] = n;
+            memcpy(query + 2, buf + pos, n);
+            tag[tail % MAX_INFLIGHT] = dyio_pipe_call(d, window, PKT_POST,
+                ID_BCS_IO, "strm", query, 2 + n);
+            nbytes[tail % MAX_INFLIGHT] = n;
+            tail++;
+            pos += n;
+        }
+        if (head == tail)
+            break;
+
+        /* Collect the oldest reply. */
+        s = dyio_wait_reply(d, tag[head % MAX_INFLIGHT]);
+        if (s == 0 && d->reply_len < 2)
+            s = -1;
+        if (s < 0) {
+            if (! failed) {
+                printf("dyio: no reply to strm[%u] at offset %u\n", ch, written);
+                failed = s;
+            }
+        } else {
+            /* Frames in flight after a failure are delivered too. */
+            written += nbytes[head % MAX_INFLIGHT];
+        }
+        head++;
+    }
+    _dyio_release(d);
+    d->stream_bytes = written;
+    d->stream_usec = _dyio_usec() - start;
+    return (failed && written == 0) ? failed : written;
+}
+
+/*
+ * Read data from the input stream of the channel.
+ * A new query is sent only when the buffer has room
+ * for replies to all queries in flight.
+ */
+int dyio_stream_read(dyio_t *d, int ch, unsigned char *buf, int len, int msec)
+{
+    dyio_sink_t sink;
+    uint8_t query[1];
+    int tag[MAX_INFLIGHT];
+    int window;
+    unsigned head = 0, tail = 0;
+    unsigned long long start = _dyio_usec();
+    unsigned long long deadline = start + msec * 1000ULL;
+    int idle = 0, failed = 0, s;
+
+    if (len < DYIO_STREAM_FRAME) {
+        printf("dyio: too short buffer for strm[%u]: %u bytes\n", ch, len);
+        return -1;
+    }
+    _dyio_hold(d);
+    window = stream_window(d);
+    sink.buf = buf;
+    sink.len = 0;
+    sink.max = len;
+    query[0] = ch;
+
+    for (;;) {
+        /* Fill the window. */
+        while (! idle && ! failed && tail - head < window &&
+               sink.len + (tail - head + 1) * DYIO_STREAM_FRAME <= len &&
+               _dyio_usec() < deadline) {
+            tag[tail % MAX_INFLIGHT] = _dyio_queue_sink(d, PKT_GET, ID_BCS_IO,
+                "strm", query, 1, &sink, 2, window);
+            tail++;
+        }
+        if (head == tail)
+            break;
+
+        /* Collect the oldest reply. */
+        s = dyio_wait_reply(d, tag[head % MAX_INFLIGHT]);
+        if (s == 0 && d->reply_len < 2)
+            s = -1;
+        if (s < 0) {
+            if (! failed) {
+                printf("dyio: no reply to strm[%u] at offset %u\n", ch, sink.len);
+                failed = s;
+            }
+        } else if (d->reply[1] == 0 && sink.len > 0) {
+            /* No more data: the line is idle. */
+            idle = 1;
+        }
+        head++;
+    }
+    _dyio_release(d);
+    d->stream_bytes = sink.len;
+    d->stream_usec = _dyio_usec() - start;
+    return (failed && sink.len == 0) ? failed : sink.len;
+}
+
+/*
+ * Get rate of the last stream transfer, in bytes per second.
+ */
+double dyio_stream_rate(dyio_t *d)
+{
+    if (d->stream_usec == 0)
+        return 0;
+    return d->stream_bytes * 1000000.0 / d->stream_usec;
+}
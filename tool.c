@@ -14,11 +14,30 @@
 #include <getopt.h>
 #include "dyio.h"
 
+#if !defined(__WIN32__) && !defined(WIN32)
+#   include <poll.h>
+#   include <pthread.h>
+#endif
+
 const char version[] = "1.0."GITVERSION;
 const char copyright[] = "Copyright (C) 2015 Serge Vakulenko";
 
 char *progname;
 int verbose;
+int errors;                         /* Failures of tests, for exit status */
+
+/*
+ * Button event: switch the LEDs.
+ */
+static void button_event(dyio_t *d, dyio_event_t *ev, void *arg)
+{
+    int button = !ev->value;
+
+    printf(button ? "#" : ".");
+    fflush(stdout);
+    dyio_set_value(d, 0, button);
+    dyio_set_value(d, 1, !button);
+}
 
 /*
  * Simple test of digital inputs and outputs.
@@ -26,55 +45,459 @@ int verbose;
  * Two LEDs are connected to channels 00 and 01.
  * While button is idle, LED1 is off and LED2 is on.
  * When button is pressed, LED1 is turned on, and LED2 turned off.
+ * The device pushes every change of the button, no polling needed.
  */
 void test1(dyio_t *d)
 {
-    int led, button;
-
     printf("Test 1: button at channel 23, two LEDs at channels 00 and 01.\n");
     dyio_set_mode(d, 23, MODE_DI);
     dyio_set_mode(d, 0, MODE_DO);
     dyio_set_mode(d, 1, MODE_DO);
-    led = 0;
     dyio_set_value(d, 0, 0);
     dyio_set_value(d, 1, 1);
-    for (;;) {
-        button = !dyio_get_value(d, 23);
-        if (button != led) {
-            printf(button ? "#" : ".");
-            led = button;
-            dyio_set_value(d, 0, button);
-            dyio_set_value(d, 1, !button);
+    if (dyio_watch_channel(d, 23, ASYN_NOTEQUAL, 0, 0, ASYN_BOTH,
+                           button_event, 0) < 0) {
+        printf("Cannot watch channel 23\n");
+        return;
+    }
+    for (;;)
+        pause();
+}
+
+/*
+ * Sweep two servos at channels 10 and 11 in opposite directions,
+ * at 100 ticks per second.
+ */
+void test2(dyio_t *d)
+{
+    dyio_setpoint_t point[10];
+    dyio_play_stats_t st;
+    int i;
+
+    printf("Test 2: servos at channels 10 and 11.\n");
+    dyio_set_mode(d, 10, MODE_SERVO);
+    dyio_set_mode(d, 11, MODE_SERVO);
+    for (i=0; i<5; i++) {
+        point[i].ch = 10;
+        point[i].msec = i * 500;
+        point[i].value = (i & 1) ? 255 : 0;
+        point[5+i].ch = 11;
+        point[5+i].msec = i * 500;
+        point[5+i].value = (i & 1) ? 0 : 255;
+    }
+    if (dyio_play(d, point, 10, 100) < 0) {
+        printf("Cannot play the trajectory\n");
+        errors++;
+        return;
+    }
+    dyio_play_wait(d, &st);
+    printf("Ticks: %lu, overruns: %lu, lost: %lu, max lateness: %lu usec\n",
+        st.ticks, st.overruns, st.lost, st.max_late);
+    if (st.lost > 0)
+        errors++;
+}
+
+/*
+ * Supervise all PID groups: send setpoints and read positions
+ * in one round-trip per cycle.
+ */
+void test3(dyio_t *d)
+{
+    int setpoint[RPC_MAX_GROUPS], position[RPC_MAX_GROUPS];
+    int ngroups, g, i, n = 1000;
+    unsigned long long t0, t1;
+
+    ngroups = dyio_pid_count(d);
+    if (ngroups < 0) {
+        errors++;
+        return;
+    }
+    printf("Test 3: %u PID groups.\n", ngroups);
+    if (ngroups == 0)
+        return;
+
+    t0 = dyio_usec();
+    for (i=0; i<n; i++) {
+        for (g=0; g<ngroups; g++)
+            setpoint[g] = (g & 1) ? -i : i;
+        if (dyio_pid_cycle(d, 10, ngroups, setpoint, position) < 0) {
+            printf("PID cycle #%u failed\n", i);
+            errors++;
+            return;
         }
-        fflush(stdout);
-        usleep(10000);
+    }
+    t1 = dyio_usec();
+    printf("%u cycles, %.1f usec per cycle\n", n, (double) (t1 - t0) / n);
+    for (g=0; g<ngroups; g++)
+        printf("    group %u: position %d\n", g, position[g]);
+}
+
+/*
+ * Send a block of data through the UART at channels 16 and 17,
+ * and read it back. Connect pins 16 and 17 for the test.
+ */
+void test4(dyio_t *d)
+{
+    static unsigned char out[16384], in[sizeof(out) + DYIO_STREAM_FRAME];
+    int i, n;
+
+    printf("Test 4: UART stream at channels 16 and 17.\n");
+    dyio_set_mode(d, 16, MODE_UART_TX);
+    dyio_set_mode(d, 17, MODE_UART_RX);
+    for (i=0; i<sizeof(out); i++)
+        out[i] = i * 7 + (i >> 8);
+
+    n = dyio_stream_write(d, 16, out, sizeof(out));
+    printf("Written %d bytes, %.0f bytes/sec\n", n, dyio_stream_rate(d));
+    n = dyio_stream_read(d, 17, in, sizeof(in), 1000);
+    printf("Read %d bytes, %.0f bytes/sec\n", n, dyio_stream_rate(d));
+    if (n != sizeof(out) || memcmp(in, out, n) != 0) {
+        printf("Data differ!\n");
+        errors++;
     }
 }
 
+/*
+ * Measure the round-trip time of blocking calls.
+ * With "loop:" port, this is the overhead of the library itself.
+ */
+void test5(dyio_t *d)
+{
+    int i, n = 10000;
+    unsigned long long t0, t1;
+
+    printf("Test 5: %u pings through %s transport.\n", n, d->transport->name);
+    t0 = dyio_usec();
+    for (i=0; i<n; i++) {
+        if (dyio_call(d, PKT_GET, ID_BCS_CORE, "_png", 0, 0) < 0) {
+            printf("No reply to ping #%u\n", i);
+            errors++;
+            return;
+        }
+    }
+    t1 = dyio_usec();
+    printf("%.2f usec per call\n", (double) (t1 - t0) / n);
+}
+
+#if !defined(__WIN32__) && !defined(WIN32)
+static int ping_done, ping_sent, ping_failed;
+
+/*
+ * Completion of ping: submit the next one.
+ */
+static void ping_complete(dyio_t *d, int tag, int status, void *arg)
+{
+    int total = *(int*) arg;
+
+    if (status < 0)
+        ping_failed++;
+    ping_done++;
+    if (ping_sent < total &&
+        dyio_submit(d, PKT_GET, ID_BCS_CORE, "_png", 0, 0, ping_complete, arg) >= 0)
+        ping_sent++;
+}
+
+/*
+ * Run pings from an event loop, with 8 requests in flight.
+ * The thread never blocks in the library: only in poll().
+ */
+void test6(dyio_t *d)
+{
+    struct pollfd pfd;
+    int n = 10000, i, timeout;
+    unsigned long long t0, t1;
+
+    pfd.fd = dyio_get_fd(d);
+    pfd.events = POLLIN;
+    printf("Test 6: %u pings from event loop, descriptor %d.\n", n, pfd.fd);
+    if (pfd.fd < 0) {
+        errors++;
+        return;
+    }
+
+    dyio_set_window(d, 8);
+    ping_done = ping_sent = ping_failed = 0;
+    t0 = dyio_usec();
+    for (i=0; i<8; i++) {
+        dyio_submit(d, PKT_GET, ID_BCS_CORE, "_png", 0, 0, ping_complete, &n);
+        ping_sent++;
+    }
+    while (ping_done < n) {
+        timeout = dyio_io_timeout(d);
+        if (timeout != 0 && poll(&pfd, 1, timeout) < 0)
+            break;
+        dyio_process_io(d);
+    }
+    t1 = dyio_usec();
+    printf("%u replies, %u failed, %.2f usec per call\n",
+        ping_done, ping_failed, (double) (t1 - t0) / n);
+    if (ping_failed > 0)
+        errors++;
+}
+
+/*
+ * Store values of one device in the group.
+ */
+static void scan_complete(dyio_t *d, int index, int status, void *arg)
+{
+    int (*value)[MAX_CHANNELS] = arg;
+    int n;
+
+    if (status < 0 || dyio_decode_get_all_values(d, &n, value[index]) < 0)
+        errors++;
+}
+
+/*
+ * Scan values of all channels on a rig of boards: the device
+ * and 15 models in memory, with reply latency from 0.1 to 1.5 msec.
+ * One scan takes the time of the slowest board.
+ */
+void test7(dyio_t *d)
+{
+    static int value[MAX_GROUP][MAX_CHANNELS];
+    dyio_group_t *g;
+    dyio_t *model;
+    char name[32];
+    int i, n = 100, ndev;
+    unsigned long long t0, t1;
+
+    g = dyio_group_create();
+    if (! g) {
+        errors++;
+        return;
+    }
+    dyio_group_add(g, d);
+    for (i=1; i<16; i++) {
+        snprintf(name, sizeof(name), "loop:%u", i * 100);
+        model = dyio_connect(name, 0);
+        if (model)
+            dyio_group_add(g, model);
+    }
+    ndev = dyio_group_size(g);
+    printf("Test 7: %u scans of %u devices.\n", n, ndev);
+
+    t0 = dyio_usec();
+    for (i=0; i<n; i++)
+        dyio_group_call(g, PKT_GET, ID_BCS_IO, "gacv", 0, 0, scan_complete, value);
+    t1 = dyio_usec();
+    printf("%.1f usec per scan\n", (double) (t1 - t0) / n);
+    dyio_group_print_stats(g);
+
+    for (i=1; i<ndev; i++)
+        dyio_close(dyio_group_device(g, i));
+    dyio_group_destroy(g);
+}
+
+static volatile int worker_stop;
+static int sensor_errors, actuator_errors;
+
+/*
+ * Sensor thread: read channel 5, check the echoed channel number.
+ * Every other read is pipelined with channel 6.
+ */
+static void *sensor_thread(void *arg)
+{
+    static const int chan[2] = { 5, 6 };
+    dyio_t *d = arg;
+    int n = 0, errors = 0, ch, value[2];
+
+    while (! worker_stop) {
+        if (n & 1) {
+            if (dyio_get_values(d, 2, chan, value) < 0)
+                errors++;
+        } else if (dyio_rpc_get_value(d, 5, &ch, &value[0]) < 0 || ch != 5)
+            errors++;
+        n++;
+    }
+    printf("Sensor: %u reads, %u errors\n", n, errors);
+    sensor_errors = errors;
+    return 0;
+}
+
+/*
+ * Actuator thread: write channel 6, check the echoed channel number.
+ */
+static void *actuator_thread(void *arg)
+{
+    dyio_t *d = arg;
+    int n = 0, errors = 0, ch;
+
+    while (! worker_stop) {
+        if (dyio_rpc_set_value(d, 6, n & 1, 0, &ch, 0) < 0 || ch != 6)
+            errors++;
+        n++;
+    }
+    printf("Actuator: %u writes, %u errors\n", n, errors);
+    actuator_errors = errors;
+    return 0;
+}
+
+/*
+ * Share the device between sensor and actuator threads,
+ * without a lock in the application.
+ */
+void test8(dyio_t *d)
+{
+    pthread_t sensor, actuator;
+
+    printf("Test 8: two threads share the device for 2 seconds.\n");
+    dyio_set_mode(d, 5, MODE_DI);
+    dyio_set_mode(d, 6, MODE_DO);
+    dyio_set_window(d, 8);
+    if (dyio_start_shared(d) < 0) {
+        errors++;
+        return;
+    }
+
+    worker_stop = 0;
+    pthread_create(&sensor, 0, sensor_thread, d);
+    pthread_create(&actuator, 0, actuator_thread, d);
+    sleep(2);
+    worker_stop = 1;
+    pthread_join(sensor, 0);
+    pthread_join(actuator, 0);
+    dyio_stop_shared(d);
+    errors += sensor_errors + actuator_errors;
+}
+
+/*
+ * Logger thread: poll all channels as fast as possible.
+ */
+static void *logger_thread(void *arg)
+{
+    dyio_t *d = arg;
+    int num_channels, value[MAX_CHANNELS];
+
+    while (! worker_stop)
+        dyio_rpc_get_all_values(d, &num_channels, value);
+    return 0;
+}
+
+/*
+ * Measure latency of critical commands under bulk polling,
+ * without and with the rate limit of polls.
+ */
+void test9(dyio_t *d)
+{
+    pthread_t logger[4];
+    unsigned long long t0, usec, total, max;
+    int pass, i, n, status, code;
+
+    printf("Test 9: latency of 'kpid' under 'gacv' polling from 4 threads.\n");
+    dyio_set_window(d, 8);
+    if (dyio_start_shared(d) < 0) {
+        errors++;
+        return;
+    }
+
+    worker_stop = 0;
+    for (i=0; i<4; i++)
+        pthread_create(&logger[i], 0, logger_thread, d);
+
+    for (pass=0; pass<2; pass++) {
+        if (pass == 1)
+            dyio_set_rate(d, PKT_GET, 500);
+        total = max = 0;
+        for (n=0; n<100; n++) {
+            usleep(5000);
+            t0 = dyio_usec();
+            if (dyio_rpc_kill_all_pid(d, &status, &code) < 0)
+                errors++;
+            usec = dyio_usec() - t0;
+            total += usec;
+            if (usec > max)
+                max = usec;
+        }
+        printf("%s: %llu usec average, %llu usec max\n",
+            pass ? "Polls limited to 500/sec" : "Unlimited polls",
+            total / n, max);
+    }
+    worker_stop = 1;
+    for (i=0; i<4; i++)
+        pthread_join(logger[i], 0);
+    dyio_stop_shared(d);
+}
+
+/*
+ * Access the device through dyiod daemon.
+ */
+void client_main(const char *name, int argc, char **argv)
+{
+    dyio_client_t *client;
+    dyio_state_t st;
+    unsigned char query[9];
+    int ch, val, n, c;
+
+    client = dyio_client_open(name);
+    if (! client) {
+        printf("Failed to attach to daemon %s\n", name);
+        exit(-1);
+    }
+    if (argc == 4) {
+        ch = strtol(argv[2], 0, 10);
+        val = strtol(argv[3], 0, 10);
+        query[0] = ch;
+        if (strcmp(argv[1], "mode") == 0) {
+            query[1] = val;
+            query[2] = 0;
+            n = dyio_client_call(client, PKT_POST, ID_BCS_SETMODE, "schm", query, 3, 0);
+        } else {
+            query[1] = val >> 24;
+            query[2] = val >> 16;
+            query[3] = val >> 8;
+            query[4] = val;
+            memset(query + 5, 0, 4);
+            n = dyio_client_call(client, PKT_POST, ID_BCS_IO, "schv", query, 9, 0);
+        }
+        if (n < 0)
+            printf("Failed to set %s of channel %u\n", argv[1], ch);
+    }
+
+    dyio_client_state(client, &st);
+    if (verbose)
+        printf("Daemon: %u clients, %lu requests in %lu writes, %lu updates\n",
+            st.clients, st.requests, st.batches, st.updates);
+    printf("\nChannel Status:\n");
+    for (c=0; c<st.num_channels; c++)
+        printf("    %2u: mode %-3u = %d\n", c, st.mode[c], st.value[c]);
+    dyio_client_close(client);
+}
+#endif
+
 void usage()
 {
     printf("DyIO utility, Version %s, %s\n", version, copyright);
-    printf("Usage:\n\t%s [-vdinc] -t#] portname\n", progname);
+    printf("Usage:\n\t%s [-vdincSl] [-t#] [-b baud] [-r file] portname\n", progname);
+    printf("\t%s -D [-v] name [mode|value ch value]\n", progname);
     printf("Options:\n");
     printf("\t-v\tverbose mode\n");
     printf("\t-i\tdisplay generic information about DyIO device\n");
     printf("\t-n\tshow namespaces and RPC calls\n");
     printf("\t-c\tshow channel status\n");
     printf("\t-d\tprint debug trace of the USB protocol\n");
+    printf("\t-S\tshow statistics of the link on exit\n");
     printf("\t-t num\trun test with given number\n");
+    printf("\t-b baud\tset speed of the port, or 'auto' to probe the fastest\n");
+    printf("\t-l\tlow latency mode: busy polling of the port\n");
+    printf("\t-r file\treplay traffic from capture file, instead of port\n");
+    printf("\t-D\tuse dyiod daemon with given name, instead of port\n");
+    printf("Set DYIO_CAPTURE=file to capture all traffic to a binary file.\n");
     exit(-1);
 }
 
 int main(int argc, char **argv)
 {
     char *devname;
-    int iflag = 0, nflag = 0, cflag = 0, tflag = 0;
-    int debug = 0;
+    int iflag = 0, nflag = 0, cflag = 0, tflag = 0, sflag = 0;
+    int debug = 0, client = 0;
+    char *replay = 0;
+    dyio_opts_t opts;
     dyio_t *d;
 
     progname = *argv;
+    dyio_init_opts(&opts);
     for (;;) {
-        switch (getopt(argc, argv, "vdinct:")) {
+        switch (getopt(argc, argv, "vdincSlDt:r:b:")) {
         case EOF:
             break;
         case 'v':
@@ -92,15 +515,43 @@ int main(int argc, char **argv)
         case 'c':
             cflag++;
             continue;
+        case 'S':
+            sflag++;
+            continue;
+        case 'D':
+            client++;
+            continue;
         case 't':
             tflag = strtol(optarg, 0, 0);
             continue;
+        case 'r':
+            replay = optarg;
+            continue;
+        case 'b':
+            if (strcmp(optarg, "auto") == 0)
+                opts.probe = 1;
+            else
+                opts.baud = strtol(optarg, 0, 0);
+            continue;
+        case 'l':
+            opts.low_latency = 1;
+            opts.busy_poll = 1;
+            continue;
+        default:
             usage();
         }
         break;
     }
     argc -= optind;
     argv += optind;
+#if !defined(__WIN32__) && !defined(WIN32)
+    if (client) {
+        if (argc < 1)
+            usage();
+        client_main(argv[0], argc, argv);
+        return 0;
+    }
+#endif
     if (! iflag && ! nflag && ! cflag && !tflag) {
         /* By default, print generic information. */
         iflag++;
@@ -108,14 +559,20 @@ int main(int argc, char **argv)
     }
 
 
-    if (argc < 1)
-        usage();
-    devname = argv[0];
+    if (replay) {
+        devname = replay;
+        d = dyio_replay(replay, debug);
+    } else {
+        if (argc < 1)
+            usage();
+        devname = argv[0];
+        opts.debug = debug;
+        d = dyio_connect_opts(devname, &opts);
+    }
 
     if (verbose)
         printf("Port name: %s\n", devname);
 
-    d = dyio_connect(devname, debug);
     if (! d) {
         printf("Failed to open port %s\n", devname);
         exit(-1);
@@ -143,11 +600,40 @@ int main(int argc, char **argv)
         test1(d);
         break;
 
-    /* TODO: add more tests here.
     case 2:
-        test1(d);
+        test2(d);
+        break;
+
+    case 3:
+        test3(d);
+        break;
+
+    case 4:
+        test4(d);
+        break;
+
+    case 5:
+        test5(d);
+        break;
+#if !defined(__WIN32__) && !defined(WIN32)
+    case 6:
+        test6(d);
         break;
-    */
+
+    case 7:
+        test7(d);
+        break;
+
+    case 8:
+        test8(d);
+        break;
+
+    case 9:
+        test9(d);
+        break;
+#endif
+
+    /* TODO: add more tests here. */
     }
 
 	if (argc == 4){
@@ -167,6 +653,9 @@ int main(int argc, char **argv)
 		}
 	}
 	
+    if (sflag)
+        dyio_print_stats(d);
+
     dyio_close(d);
-    return 0;
+    return errors ? -1 : 0;
 }
@@ -0,0 +1,381 @@
+/*
+ * DyIO library: transports other than the serial port.
+ *
+ * Loopback transport passes the traffic to the software model
+ * of the device, in memory. It measures the overhead of the library
+ * itself, without costs of the kernel tty layer.
+ * Socket transport connects to the simulator, or to any other
+ * server of the protocol, by a Unix-domain or TCP socket.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * This file is distributed under the terms of the Apache License, Version 2.0.
+ * See http://opensource.org/licenses/Apache-2.0 for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "dyio.h"
+#include "model.h"
+
+typedef struct {
+    /* Generic DyIO data structure. */
+    dyio_t  generic;
+
+    dyio_model_t    *model;         /* Software model of the device */
+    pthread_mutex_t lock;           /* Protects the model */
+    pthread_cond_t  input;          /* Signaled on new queries */
+    int             notify[2];      /* Pipe for poll(), or -1 */
+    int             notified;       /* A byte is in the pipe */
+} dyio_loop_t;
+
+typedef struct {
+    /* Generic DyIO data structure. */
+    dyio_t  generic;
+
+    int fd;                         /* Connected socket */
+} dyio_socket_t;
+
+/*
+ * Keep the pipe readable while the model has replies.
+ * Must be called with the model locked.
+ */
+static void loop_notify(dyio_loop_t *l)
+{
+    int pending = (l->model->pending_head != l->model->pending_tail);
+    unsigned char byte = 0;
+
+    if (l->notify[0] < 0 || pending == l->notified)
+        return;
+    if (pending) {
+        if (write(l->notify[1], &byte, 1) != 1)
+            return;
+    } else {
+        if (read(l->notify[0], &byte, 1) != 1)
+            return;
+    }
+    l->notified = pending;
+}
+
+/*
+ * Pass queries to the model.
+ */
+static int loop_write(dyio_t *d, unsigned char *data, int len)
+{
+    dyio_loop_t *l = (dyio_loop_t*) d;
+
+    pthread_mutex_lock(&l->lock);
+    _dyio_model_input(l->model, data, len);
+    loop_notify(l);
+    pthread_cond_broadcast(&l->input);
+    pthread_mutex_unlock(&l->lock);
+    return len;
+}
+
+/*
+ * Get replies of the model, when due.
+ * Wait at most usec microseconds.
+ * Return number of bytes, or 0 on timeout.
+ */
+static int loop_read(dyio_t *d, unsigned char *data, int len,
+    unsigned long usec)
+{
+    dyio_loop_t *l = (dyio_loop_t*) d;
+    unsigned long long deadline = _dyio_usec() + usec, now, next;
+    struct timespec ts;
+    int got;
+
+    pthread_mutex_lock(&l->lock);
+    for (;;) {
+        now = _dyio_usec();
+        next = _dyio_model_run(l->model, now);
+        got = _dyio_model_output(l->model, data, len, now);
+        if (got > 0 || now >= deadline)
+            break;
+
+        /* Sleep until the next event of the model, or new queries. */
+        if (! next || next > deadline)
+            next = deadline;
+        ts.tv_sec = next / 1000000;
+        ts.tv_nsec = next % 1000000 * 1000;
+        pthread_cond_timedwait(&l->input, &l->lock, &ts);
+    }
+    loop_notify(l);
+    pthread_mutex_unlock(&l->lock);
+
+    if (got == 0 && d->debug)
+        printf("loop-read: device is not responding\n");
+    return got;
+}
+
+/*
+ * Create the pipe on first use, so the blocking calls
+ * do not pay for it.
+ */
+static int loop_get_fd(dyio_t *d)
+{
+    dyio_loop_t *l = (dyio_loop_t*) d;
+
+    pthread_mutex_lock(&l->lock);
+    if (l->notify[0] < 0) {
+        if (pipe(l->notify) < 0) {
+            perror("pipe");
+            l->notify[0] = l->notify[1] = -1;
+        } else
+            loop_notify(l);
+    }
+    pthread_mutex_unlock(&l->lock);
+    return l->notify[0];
+}
+
+static void loop_close(dyio_t *d)
+{
+    dyio_loop_t *l = (dyio_loop_t*) d;
+
+    if (l->notify[0] >= 0) {
+        close(l->notify[0]);
+        close(l->notify[1]);
+    }
+    pthread_cond_destroy(&l->input);
+    pthread_mutex_destroy(&l->lock);
+    free(l->model);
+    free(l);
+}
+
+static const dyio_transport_t loop_transport = {
+    "loop",
+    loop_write,
+    loop_read,
+    0,
+    loop_close,
+    loop_get_fd,
+};
+
+/*
+ * Create the model of the device in memory.
+ * Name is "loop:", or "loop:usec" to delay replies.
+ * Return 0 on error.
+ */
+dyio_t *_dyio_loop_open(const char *devname, const dyio_opts_t *opts)
+{
+    pthread_condattr_t attr;
+    dyio_loop_t *l;
+
+    l = calloc(1, sizeof(dyio_loop_t));
+    if (l)
+        l->model = _dyio_model_create();
+    if (! l || ! l->model) {
+        fprintf(stderr, "dyio: Out of memory\n");
+        free(l);
+        return 0;
+    }
+    l->model->latency = strtol(devname + 5, 0, 0);
+    l->notify[0] = l->notify[1] = -1;
+    l->model->verbose = (opts->debug > 1);
+
+    pthread_mutex_init(&l->lock, 0);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&l->input, &attr);
+    pthread_condattr_destroy(&attr);
+
+    l->generic.transport = &loop_transport;
+    return &l->generic;
+}
+
+/*
+ * Send data to the socket.
+ * Return number of bytes, or -1 on error.
+ */
+static int socket_write(dyio_t *d, unsigned char *data, int len)
+{
+    dyio_socket_t *s = (dyio_socket_t*) d;
+    int got;
+
+    do {
+        got = send(s->fd, data, len, MSG_NOSIGNAL);
+    } while (got < 0 && errno == EINTR);
+    return got;
+}
+
+/*
+ * Receive data from the socket.
+ * Wait at most usec microseconds.
+ * Return number of bytes, 0 on timeout, or -1 when
+ * the connection is lost.
+ */
+static int socket_read(dyio_t *d, unsigned char *data, int len,
+    unsigned long usec)
+{
+    dyio_socket_t *s = (dyio_socket_t*) d;
+    unsigned long long deadline = _dyio_usec() + usec, now;
+    struct timeval timeout;
+    fd_set rfds;
+    int got;
+
+again:
+    now = _dyio_usec();
+    if (now > deadline)
+        now = deadline;
+    timeout.tv_sec = (deadline - now) / 1000000;
+    timeout.tv_usec = (deadline - now) % 1000000;
+    FD_ZERO(&rfds);
+    FD_SET(s->fd, &rfds);
+
+    got = select(s->fd + 1, &rfds, 0, 0, &timeout);
+    if (got < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            /* Continue with the remaining time. */
+            goto again;
+        }
+        fprintf(stderr, "socket-read: select error: %s\n", strerror(errno));
+        return -1;
+    }
+    if (got == 0) {
+        if (d->debug)
+            printf("socket-read: device is not responding\n");
+        return 0;
+    }
+
+    got = recv(s->fd, data, len, 0);
+    if (got < 0 && errno == EINTR)
+        goto again;
+    if (got <= 0) {
+        fprintf(stderr, "socket-read: %s\n",
+            got ? strerror(errno) : "connection closed");
+        return -1;
+    }
+    return got;
+}
+
+static int socket_get_fd(dyio_t *d)
+{
+    dyio_socket_t *s = (dyio_socket_t*) d;
+
+    return s->fd;
+}
+
+static void socket_close(dyio_t *d)
+{
+    dyio_socket_t *s = (dyio_socket_t*) d;
+
+    close(s->fd);
+    free(s);
+}
+
+static const dyio_transport_t socket_transport = {
+    "socket",
+    socket_write,
+    socket_read,
+    0,
+    socket_close,
+    socket_get_fd,
+};
+
+/*
+ * Connect to TCP port, given as "host:port".
+ * Return the socket, or -1 on error.
+ */
+static int tcp_connect(const char *name)
+{
+    struct addrinfo hints, *list, *ai;
+    char host[256], *port;
+    int fd = -1, one = 1, err;
+
+    strncpy(host, name, sizeof(host) - 1);
+    host[sizeof(host) - 1] = 0;
+    port = strrchr(host, ':');
+    if (! port) {
+        fprintf(stderr, "tcp:%s: Port number expected\n", name);
+        return -1;
+    }
+    *port++ = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    err = getaddrinfo(host[0] ? host : "localhost", port, &hints, &list);
+    if (err != 0) {
+        fprintf(stderr, "tcp:%s: %s\n", name, gai_strerror(err));
+        return -1;
+    }
+    for (ai=list; ai; ai=ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(list);
+    if (fd < 0) {
+        fprintf(stderr, "tcp:%s: Cannot connect\n", name);
+        return -1;
+    }
+
+    /* Small frames must go without delay. */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/*
+ * Connect to Unix-domain socket.
+ * Return the socket, or -1 on error.
+ */
+static int unix_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Connect to the socket: "unix:path" or "tcp:host:port".
+ * Return 0 on error.
+ */
+dyio_t *_dyio_socket_open(const char *devname, const dyio_opts_t *opts)
+{
+    dyio_socket_t *s;
+
+    s = calloc(1, sizeof(dyio_socket_t));
+    if (! s) {
+        fprintf(stderr, "dyio: Out of memory\n");
+        return 0;
+    }
+    if (strncmp(devname, "unix:", 5) == 0)
+        s->fd = unix_connect(devname + 5);
+    else
+        s->fd = tcp_connect(devname + 4);
+    if (s->fd < 0) {
+        free(s);
+        return 0;
+    }
+    s->generic.transport = &socket_transport;
+    return &s->generic;
+}